@@ -0,0 +1,342 @@
+// benchmark.cpp
+// g++ benchmark.cpp -o benchmark -I. -O2 -pthread
+// g++ benchmark.cpp -o benchmark -I. -O2 `llvm-config --cppflags --ldflags --libs core jit native` -DUSE_LLVM -pthread
+//
+// Times each stage of the library over a fixed corpus of expressions and prints
+// one tab separated line per stage and expression:
+//   benchmark  expression  iterations  ns_per_op
+// Lines starting with # are comments. The optional argument is the minimum time
+// in milliseconds to spend on each measurement (default 200).
+//
+// benchmark scaling [ms] instead sweeps the size of generated expressions of
+// a few shapes, with the node count in the expression column. Lines for *_bytes
+// give the memory used in the last column.
+#include <expressions/expressions.h>
+#include <expressions/LLVMCompiler.h>
+#include <expressions/X86Evaluator.h>
+#include <expressions/RandomExpression.h>
+#include <iostream>
+#include <set>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+
+#ifdef USE_LLVM
+typedef expr::LLVMEvaluator<float> LLVMEvaluator;
+#endif
+
+typedef expr::Evaluator<float>::VariableMap VariableMap;
+
+const char *corpus[] =
+{
+	"x + y",
+	"(x + y) * 10 - x / 3",
+	"sin(x) * cos(y) + sqrt(x * x + y * y)",
+	"x > y ? pow(x, 2) + floor(y) : ceil(x) % 3",
+	"min(x, y) < max(x, 8) && x % y == 2 ? (ceil(cos(60*pi/180) + sin(30*pi/180) + tan(45*pi/180)) + sqrt(floor(16.5)) + log2(16)) * log10(100) : 0",
+	"((x + 1) * (y - 2) + (x * 3 - y / 4) * (x + y)) / ((x - y) * (x - y) + 1) + ((x + 2) * (y - 3) + (x * 4 - y / 5)) % 7",
+	NULL
+};
+
+// Keeps results alive, so the work being timed can't be optimised away
+volatile double sink;
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Runs the operation for doubling numbers of iterations until one run takes at
+// least the minimum time, then reports the time per iteration of that run
+template <typename Operation>
+double measure(const std::string &name, size_t expression, Operation &operation, double minimum)
+{
+	operation();
+	size_t iterations = 1;
+	double elapsed = 0;
+	while (true)
+	{
+		double start = now();
+		for (size_t i=0; i<iterations; i++)
+		{
+			operation();
+		}
+		elapsed = now() - start;
+		if (elapsed >= minimum || iterations >= ((size_t) 1 << 40))
+		{
+			break;
+		}
+		iterations *= 2;
+	}
+	std::cout << name << "\t" << expression << "\t" << iterations << "\t" << elapsed / iterations << std::endl;
+	return elapsed / iterations;
+}
+
+
+struct Tokenize
+{
+	Tokenize(const char *text) : text(text) {}
+
+	void operator()()
+	{
+		tokens.clear();
+		expr::Tokenizer<float> tokenizer(text);
+		tokenizer.tokenize(tokens);
+		sink = tokens.size();
+	}
+
+	const char *text;
+	std::vector<expr::TokenPtr> tokens;
+};
+
+struct Parse
+{
+	Parse(const char *text) : text(text) {}
+
+	void operator()()
+	{
+		sink = parser.parse(text)->type();
+	}
+
+	const char *text;
+	expr::Parser<float> parser;
+};
+
+struct ParseContext
+{
+	ParseContext(const char *text) : text(text) {}
+
+	void operator()()
+	{
+		sink = parser.parse(text, context)->type();
+	}
+
+	const char *text;
+	expr::Parser<float> parser;
+	expr::ParserContext<float> context;
+};
+
+// Evaluators are timed both constructing and evaluating. When only evaluating,
+// one variable changes every call
+template <typename Evaluator>
+struct Construct
+{
+	Construct(expr::ASTNodePtr ast, VariableMap &vm) : ast(ast), vm(vm) {}
+
+	void operator()()
+	{
+		Evaluator evaluator(ast, &vm);
+		sink = evaluator.evaluate();
+	}
+
+	expr::ASTNodePtr ast;
+	VariableMap &vm;
+};
+
+template <typename Evaluator>
+struct Evaluate
+{
+	Evaluate(expr::ASTNodePtr ast, VariableMap &vm, const char *variable="x") : evaluator(ast, &vm), vm(vm), x(vm[variable]) {}
+
+	void operator()()
+	{
+		x += 0.25f;
+		if (x > 100)
+		{
+			x = 1;
+		}
+		sink = evaluator.evaluate();
+	}
+
+	Evaluator evaluator;
+	VariableMap &vm;
+	float &x;
+};
+
+struct Clone
+{
+	Clone(expr::ASTNodePtr ast) : ast(ast) {}
+
+	void operator()()
+	{
+		sink = ast->clone()->type();
+	}
+
+	expr::ASTNodePtr ast;
+};
+
+struct Generate
+{
+	Generate(expr::ASTNodePtr ast) : ast(ast) {}
+
+	void operator()()
+	{
+		sink = generator.generate(ast).size();
+	}
+
+	expr::ASTNodePtr ast;
+	expr::ShaderGenerator<float> generator;
+};
+
+struct GenerateFunction
+{
+	GenerateFunction(expr::ASTNodePtr ast) : ast(ast) {}
+
+	void operator()()
+	{
+		sink = generator.generateFunction(ast).size();
+	}
+
+	expr::ASTNodePtr ast;
+	expr::ShaderGenerator<float> generator;
+};
+
+
+// Stages which take longer than this per operation are not run on larger
+// expressions, so the exponential ones don't stall the sweep
+const double ScalingLimit = 1e7;
+
+template <typename Operation>
+void scale(const std::string &name, size_t nodes, Operation &operation, double minimum, std::set<std::string> &skipped)
+{
+	if (skipped.count(name))
+	{
+		return;
+	}
+	if (measure(name, nodes, operation, minimum) > ScalingLimit)
+	{
+		std::cout << "# " << name << " is not run beyond " << nodes << " nodes" << std::endl;
+		skipped.insert(name);
+	}
+}
+
+void scaling(double minimum)
+{
+	struct Shape
+	{
+		const char *name;
+		unsigned int width;
+		unsigned int first; // depths run from first to last, doubling when chained
+		unsigned int last;
+	};
+	const Shape shapes[] =
+	{
+		{ "balanced", 2, 1, 12 },
+		{ "wide",     8, 1, 4 },
+		{ "chain",    1, 16, 8192 }
+	};
+
+	std::cout << "# benchmark\tnodes\titerations\tns_per_op" << std::endl;
+	for (size_t s=0; s<sizeof(shapes) / sizeof(shapes[0]); s++)
+	{
+		const Shape &shape = shapes[s];
+		std::set<std::string> skipped;
+		for (unsigned int depth=shape.first; depth<=shape.last; depth = shape.width == 1 ? depth * 2 : depth + 1)
+		{
+			expr::RandomExpression::Options options;
+			options.depth = depth;
+			options.width = shape.width;
+			expr::RandomExpression random(depth, options);
+			std::string text = random.generate();
+
+			VariableMap vm;
+			for (size_t i=0; i<random.variables().size(); i++)
+			{
+				vm[random.variables()[i]] = 1.5f + i;
+			}
+			expr::Parser<float> parser;
+			expr::ParserContext<float> context;
+			expr::ASTNodePtr ast = parser.parse(text.c_str(), context);
+			size_t nodes = context.statistics().nodes;
+			std::cout << "# " << shape.name << " depth " << depth << ": " << nodes << " nodes, " << text.size() << " characters" << std::endl;
+
+			std::string prefix = std::string(shape.name) + "_";
+			Parse parse(text.c_str());
+			scale(prefix + "parse", nodes, parse, minimum, skipped);
+			Clone clone(ast);
+			scale(prefix + "clone", nodes, clone, minimum, skipped);
+			Evaluate<expr::Evaluator<float> > interpreterEvaluate(ast, vm, "x0");
+			scale(prefix + "interpreter_evaluate", nodes, interpreterEvaluate, minimum, skipped);
+			Generate generate(ast);
+			scale(prefix + "generate", nodes, generate, minimum, skipped);
+			GenerateFunction generateFunction(ast);
+			scale(prefix + "generate_function", nodes, generateFunction, minimum, skipped);
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+			Construct<expr::X86Evaluator<float> > x86Construct(ast, vm);
+			scale(prefix + "x86_construct", nodes, x86Construct, minimum, skipped);
+			std::cout << prefix << "x86_code_bytes\t" << nodes << "\t1\t" << expr::X86Evaluator<float>(ast, &vm).codeSize() << std::endl;
+#endif
+
+#ifdef USE_LLVM
+			Construct<LLVMEvaluator> llvmConstruct(ast, vm);
+			scale(prefix + "llvm_construct", nodes, llvmConstruct, minimum, skipped);
+			LLVMEvaluator::MemoryFootprint footprint = LLVMEvaluator(ast, &vm).memoryFootprint();
+			std::cout << prefix << "llvm_code_bytes\t" << nodes << "\t1\t" << footprint.code << std::endl;
+#endif
+		}
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "scaling") == 0)
+	{
+		scaling((argc > 2 ? atof(argv[2]) : 200) * 1e6);
+		return 0;
+	}
+
+	double minimum = (argc > 1 ? atof(argv[1]) : 200) * 1e6;
+
+	std::cout << "# benchmark\texpression\titerations\tns_per_op" << std::endl;
+	for (size_t i=0; corpus[i]; i++)
+	{
+		std::cout << "# " << i << ": " << corpus[i] << std::endl;
+	}
+
+	for (size_t i=0; corpus[i]; i++)
+	{
+		VariableMap vm;
+		vm["x"] = 1;
+		vm["y"] = 3;
+		vm["pi"] = 3.14159265f;
+		expr::Parser<float> parser;
+		expr::ASTNodePtr ast = parser.parse(corpus[i]);
+
+		Tokenize tokenize(corpus[i]);
+		measure("tokenize", i, tokenize, minimum);
+		Parse parse(corpus[i]);
+		measure("parse", i, parse, minimum);
+		ParseContext parseContext(corpus[i]);
+		measure("parse_context", i, parseContext, minimum);
+
+		Construct<expr::Evaluator<float> > interpreterConstruct(ast, vm);
+		measure("interpreter_construct", i, interpreterConstruct, minimum);
+		Evaluate<expr::Evaluator<float> > interpreterEvaluate(ast, vm);
+		measure("interpreter_evaluate", i, interpreterEvaluate, minimum);
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+		Construct<expr::X86Evaluator<float> > x86Construct(ast, vm);
+		measure("x86_construct", i, x86Construct, minimum);
+		Evaluate<expr::X86Evaluator<float> > x86Evaluate(ast, vm);
+		measure("x86_evaluate", i, x86Evaluate, minimum);
+#endif
+
+#ifdef USE_LLVM
+		Construct<LLVMEvaluator> llvmConstruct(ast, vm);
+		measure("llvm_construct", i, llvmConstruct, minimum);
+		Evaluate<LLVMEvaluator> llvmEvaluate(ast, vm);
+		measure("llvm_evaluate", i, llvmEvaluate, minimum);
+#endif
+
+		Generate generate(ast);
+		measure("generate", i, generate, minimum);
+		GenerateFunction generateFunction(ast);
+		measure("generate_function", i, generateFunction, minimum);
+	}
+
+	return 0;
+}
@@ -16,9 +16,6 @@
 const std::string fragHead(
 	"#version 330\n"
 	"uniform float value;\n"
-	"uniform float x;\n"
-	"uniform float y;\n"
-	"uniform float pi;\n"
 	"out vec4 outputColor;\n"
 	"\n"
 );
@@ -167,17 +164,17 @@ int main(int argc, char *argv[])
 	expr::Parser<float> parser; 
 	expr::Evaluator<float>::VariableMap vm; vm["pi"] = 3.14159; vm["x"] = 10; vm["y"] = 4;
 
-	expr::ASTNode* ast = parser.parse(expression);
+	expr::ASTNodePtr ast = parser.parse(expression);
 	float value = expr::Evaluator<float>(ast, &vm).evaluate();
 	std::cout << "Output value is: " << value << std::endl << std::endl;
 
 	// Generate the GLSL fragment shader code
+	// The variables are declared in a uniform block, backed by a single buffer
 	expr::ShaderGenerator<float> generator;
+	expr::ShaderGenerator<float>::Module module = generator.generateModule(ast);
 	std::string shader;
 	shader += fragHead;
-	shader += "float calculate()\n{\n\treturn ";
-	shader += generator.generate(ast);
-	shader += ";\n}\n";
+	shader += module.source;
 	shader += std::string("\n") += fragMain;
 
 	std::cout << shader << std::endl;
@@ -192,14 +189,16 @@ int main(int argc, char *argv[])
 	glUniform1f(valueLocation, value);
 	glUseProgram(0);
 
-	// Assign uniform values for each of the values in variablemap
-	glUseProgram(program);
-	for (expr::Parser<float>::VariableMap::iterator it=vm.begin(); it!= vm.end(); it++)
-	{
-		GLuint loc = glGetUniformLocation(program, it->first.c_str());
-		glUniform1f(loc, it->second);
-	}
-	glUseProgram(0);
+	// Upload every variable in the variablemap with one buffer update
+	std::vector<float> inputs(module.size / sizeof(float));
+	module.pack(vm, &inputs[0]);
+	GLuint inputBuffer;
+	glGenBuffers(1, &inputBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, inputBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, module.size, &inputs[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glUniformBlockBinding(program, glGetUniformBlockIndex(program, module.block.c_str()), 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 0, inputBuffer);
 
 
 	// Make a pretty triangle for us to see the color on
@@ -10,15 +10,15 @@
 int main()
 {
 	expr::Parser<float> parser;
-	expr::LLVMEvaluator::VariableMap vm;
+	expr::LLVMEvaluator<float>::VariableMap vm;
 	vm["pi"] = 3.14159265359f;
 	vm["x"] = 0.5;
 	vm["y"] = 0.5;
 
 	const char * expression = "(x + y) * 10";
-	expr::ASTNode* ast = parser.parse(expression);
+	expr::ASTNodePtr ast = parser.parse(expression);
 
-	expr::LLVMEvaluator eval(ast, &vm); 
+	expr::LLVMEvaluator<float> eval(ast, &vm); 
 
 	std::cout << eval.evaluate() << std::endl;
 
@@ -4,6 +4,8 @@
 
 #include <map>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <sstream>
 #include "Exception.h"
 #include "Memory.h"
@@ -28,6 +30,7 @@ class ASTNode
 
         ASTNode(ASTNodeType nodeType)
 			: m_type(nodeType)
+			, m_height(1)
         {
         }
 
@@ -35,15 +38,78 @@ class ASTNode
         {
         }
 
+		// Copy of the whole tree below this node. Trees higher than
+		// RecursionLimit are copied by copyDeep()
 		virtual SHARED_PTR<ASTNode> clone() const = 0;
 
+		// Nodes on the longest path from this one down to a leaf
+		unsigned int height() const
+		{
+			return m_height;
+		}
+
+		// Number of subtrees, and each of them in the order copy() takes them
+		virtual size_t children() const
+		{
+			return 0;
+		}
+
+		virtual const SHARED_PTR<ASTNode> &child(size_t) const;
+
+		// Copy of this node alone, on top of copies of its subtrees. Leaves have
+		// none, so are just cloned
+		virtual SHARED_PTR<ASTNode> copy(const SHARED_PTR<ASTNode> *) const
+		{
+			return clone();
+		}
+
         ASTNodeType type()
         {
         	return m_type;
         }
 
     protected:
+		// Trees up to this height are copied and destroyed recursively, which is
+		// quickest. Higher ones are walked with stacks of their own, so that the
+		// native stack use stays bounded however deep an expression is nested
+		static const unsigned int RecursionLimit = 64;
+
+		static unsigned int height(const SHARED_PTR<ASTNode> &subtree)
+		{
+			return subtree ? subtree->m_height : 0;
+		}
+
+		static SHARED_PTR<ASTNode> copyDeep(const ASTNode *root);
+
+		// Called from the destructor of every node with subtrees. High subtrees
+		// held by nothing else are taken apart one node at a time, as their
+		// destructors would otherwise nest as deep as the tree
+		void dismantle()
+		{
+			if (m_height > RecursionLimit)
+			{
+				takeApart();
+			}
+		}
+
+		void takeApart();
+
+		// Moves the subtrees which dismantle() has to take apart onto pending
+		virtual void detach(std::vector<SHARED_PTR<ASTNode> > &)
+		{
+		}
+
+		static void detach(SHARED_PTR<ASTNode> &subtree, std::vector<SHARED_PTR<ASTNode> > &pending)
+		{
+			if (height(subtree) > RecursionLimit && subtree.use_count() == 1)
+			{
+				pending.push_back(SHARED_PTR<ASTNode>());
+				pending.back().swap(subtree);
+			}
+		}
+
         ASTNodeType m_type;
+		unsigned int m_height;
 
 };
 typedef SHARED_PTR<ASTNode> ASTNodePtr;
@@ -67,17 +133,37 @@ class OperationASTNode : public ASTNode
 		, m_operation(operationType)
 		, m_left(leftNode)
 		, m_right(rightNode)
-		{}
+		{
+			m_height = 1 + std::max(height(m_left), height(m_right));
+		}
 
 		~OperationASTNode()
 		{
+			dismantle();
+		}
+
+		virtual size_t children() const
+		{
+			return 2;
+		}
+
+		virtual const ASTNodePtr &child(size_t index) const
+		{
+			return index == 0 ? m_left : m_right;
 		}
 
 		virtual ASTNodePtr clone() const
 		{
-			ASTNodePtr leftNode = m_left->clone();
-			ASTNodePtr rightNode = m_right->clone();
-			return ASTNodePtr(new OperationASTNode(m_operation, leftNode, rightNode));
+			if (m_height > RecursionLimit)
+			{
+				return copyDeep(this);
+			}
+			return ASTNodePtr(new OperationASTNode(m_operation, m_left->clone(), m_right->clone()));
+		}
+
+		virtual ASTNodePtr copy(const ASTNodePtr *children) const
+		{
+			return ASTNodePtr(new OperationASTNode(m_operation, children[0], children[1]));
 		}
 
 		OperationType operation()
@@ -85,17 +171,23 @@ class OperationASTNode : public ASTNode
 			return m_operation;
 		}
 
-		ASTNodePtr left()
+		const ASTNodePtr &left()
 		{
 			return m_left;
 		}
 
-		ASTNodePtr right()
+		const ASTNodePtr &right()
 		{
 			return m_right;
 		}
 
 	protected:
+		virtual void detach(std::vector<ASTNodePtr> &pending)
+		{
+			ASTNode::detach(m_left, pending);
+			ASTNode::detach(m_right, pending);
+		}
+
 		OperationType m_operation;
 		ASTNodePtr m_left;
 		ASTNodePtr m_right;
@@ -122,16 +214,37 @@ class Function1ASTNode : public ASTNode
 		: ASTNode(ASTNode::FUNCTION1)
 		, m_function(functionType)
 		, m_left(leftNode)
-		{}
+		{
+			m_height = 1 + height(m_left);
+		}
 
 		~Function1ASTNode()
 		{
+			dismantle();
+		}
+
+		virtual size_t children() const
+		{
+			return 1;
+		}
+
+		virtual const ASTNodePtr &child(size_t) const
+		{
+			return m_left;
 		}
 
 		virtual ASTNodePtr clone() const
 		{
-			ASTNodePtr leftNode = m_left->clone();
-			return ASTNodePtr(new Function1ASTNode(m_function, leftNode));
+			if (m_height > RecursionLimit)
+			{
+				return copyDeep(this);
+			}
+			return ASTNodePtr(new Function1ASTNode(m_function, m_left->clone()));
+		}
+
+		virtual ASTNodePtr copy(const ASTNodePtr *children) const
+		{
+			return ASTNodePtr(new Function1ASTNode(m_function, children[0]));
 		}
 
 		Function1Type function()
@@ -139,12 +252,17 @@ class Function1ASTNode : public ASTNode
 			return m_function;
 		}
 
-		ASTNodePtr left()
+		const ASTNodePtr &left()
 		{
 			return m_left;
 		}
 
 	protected:
+		virtual void detach(std::vector<ASTNodePtr> &pending)
+		{
+			ASTNode::detach(m_left, pending);
+		}
+
 		Function1Type m_function;
 		ASTNodePtr m_left;
 };
@@ -165,17 +283,37 @@ class Function2ASTNode : public ASTNode
 		, m_function(functionType)
 		, m_left(leftNode)
 		, m_right(rightNode)
-		{}
+		{
+			m_height = 1 + std::max(height(m_left), height(m_right));
+		}
 
 		~Function2ASTNode()
 		{
+			dismantle();
+		}
+
+		virtual size_t children() const
+		{
+			return 2;
+		}
+
+		virtual const ASTNodePtr &child(size_t index) const
+		{
+			return index == 0 ? m_left : m_right;
 		}
 
 		virtual ASTNodePtr clone() const
 		{
-			ASTNodePtr leftNode = m_left->clone();
-			ASTNodePtr rightNode = m_right->clone();
-			return ASTNodePtr(new Function2ASTNode(m_function, leftNode, rightNode));
+			if (m_height > RecursionLimit)
+			{
+				return copyDeep(this);
+			}
+			return ASTNodePtr(new Function2ASTNode(m_function, m_left->clone(), m_right->clone()));
+		}
+
+		virtual ASTNodePtr copy(const ASTNodePtr *children) const
+		{
+			return ASTNodePtr(new Function2ASTNode(m_function, children[0], children[1]));
 		}
 
 		Function2Type function()
@@ -183,17 +321,23 @@ class Function2ASTNode : public ASTNode
 			return m_function;
 		}
 
-		ASTNodePtr left()
+		const ASTNodePtr &left()
 		{
 			return m_left;
 		}
 
-		ASTNodePtr right()
+		const ASTNodePtr &right()
 		{
 			return m_right;
 		}
 
 	protected:
+		virtual void detach(std::vector<ASTNodePtr> &pending)
+		{
+			ASTNode::detach(m_left, pending);
+			ASTNode::detach(m_right, pending);
+		}
+
 		Function2Type m_function;
 		ASTNodePtr m_left;
 		ASTNodePtr m_right;
@@ -218,17 +362,37 @@ class ComparisonASTNode : public ASTNode
 			, m_comparison(comparisonType)
 			, m_left(leftNode)
 			, m_right(rightNode)
-        {}
+		{
+			m_height = 1 + std::max(height(m_left), height(m_right));
+		}
 
         ~ComparisonASTNode()
         {
+			dismantle();
         }
 
+		virtual size_t children() const
+		{
+			return 2;
+		}
+
+		virtual const ASTNodePtr &child(size_t index) const
+		{
+			return index == 0 ? m_left : m_right;
+		}
+
 		virtual ASTNodePtr clone() const
 		{
-			ASTNodePtr leftNode = m_left->clone();
-			ASTNodePtr rightNode = m_right->clone();
-			return ASTNodePtr(new ComparisonASTNode(m_comparison, leftNode, rightNode));
+			if (m_height > RecursionLimit)
+			{
+				return copyDeep(this);
+			}
+			return ASTNodePtr(new ComparisonASTNode(m_comparison, m_left->clone(), m_right->clone()));
+		}
+
+		virtual ASTNodePtr copy(const ASTNodePtr *children) const
+		{
+			return ASTNodePtr(new ComparisonASTNode(m_comparison, children[0], children[1]));
 		}
 
         ComparisonType comparison()
@@ -236,17 +400,23 @@ class ComparisonASTNode : public ASTNode
         	return m_comparison;
         }
 
-        ASTNodePtr left()
+        const ASTNodePtr &left()
 		{
 			return m_left;
 		}
 
-		ASTNodePtr right()
+		const ASTNodePtr &right()
 		{
 			return m_right;
 		}
 
     protected:
+		virtual void detach(std::vector<ASTNodePtr> &pending)
+		{
+			ASTNode::detach(m_left, pending);
+			ASTNode::detach(m_right, pending);
+		}
+
         ComparisonType m_comparison;
 		ASTNodePtr m_left;
 		ASTNodePtr m_right;
@@ -265,17 +435,37 @@ class LogicalASTNode : public ASTNode
 			, m_operation(operationType)
 			, m_left(leftNode)
 			, m_right(rightNode)
-		{}
+		{
+			m_height = 1 + std::max(height(m_left), height(m_right));
+		}
 
 		~LogicalASTNode()
 		{
+			dismantle();
+		}
+
+		virtual size_t children() const
+		{
+			return 2;
+		}
+
+		virtual const ASTNodePtr &child(size_t index) const
+		{
+			return index == 0 ? m_left : m_right;
 		}
 
 		virtual ASTNodePtr clone() const
 		{
-			ASTNodePtr leftNode = m_left->clone();
-			ASTNodePtr rightNode = m_right->clone();
-			return ASTNodePtr(new LogicalASTNode(m_operation, leftNode, rightNode));
+			if (m_height > RecursionLimit)
+			{
+				return copyDeep(this);
+			}
+			return ASTNodePtr(new LogicalASTNode(m_operation, m_left->clone(), m_right->clone()));
+		}
+
+		virtual ASTNodePtr copy(const ASTNodePtr *children) const
+		{
+			return ASTNodePtr(new LogicalASTNode(m_operation, children[0], children[1]));
 		}
 
 		OperationType operation()
@@ -283,17 +473,23 @@ class LogicalASTNode : public ASTNode
 			return m_operation;
 		}
 
-		ASTNodePtr left()
+		const ASTNodePtr &left()
 		{
 			return m_left;
 		}
 
-		ASTNodePtr right()
+		const ASTNodePtr &right()
 		{
 			return m_right;
 		}
 
 	protected:
+		virtual void detach(std::vector<ASTNodePtr> &pending)
+		{
+			ASTNode::detach(m_left, pending);
+			ASTNode::detach(m_right, pending);
+		}
+
 		OperationType m_operation;
 		ASTNodePtr m_left;
 		ASTNodePtr m_right;
@@ -309,37 +505,63 @@ class BranchASTNode : public ASTNode
 			, m_condition(conditionNode)
 			, m_yes(yesNode)
 			, m_no(noNode)
-        {}
+		{
+			m_height = 1 + std::max(height(m_condition), std::max(height(m_yes), height(m_no)));
+		}
 
         ~BranchASTNode()
         {
+			dismantle();
         }
 
+		virtual size_t children() const
+		{
+			return 3;
+		}
+
+		virtual const ASTNodePtr &child(size_t index) const
+		{
+			return index == 0 ? m_condition : index == 1 ? m_yes : m_no;
+		}
+
 		virtual ASTNodePtr clone() const
 		{
-			ASTNodePtr conditionNode = m_condition->clone();
-			ASTNodePtr yesNode = m_yes->clone();
-			ASTNodePtr noNode = m_no->clone();
-			return ASTNodePtr(new BranchASTNode(conditionNode, yesNode, noNode));
+			if (m_height > RecursionLimit)
+			{
+				return copyDeep(this);
+			}
+			return ASTNodePtr(new BranchASTNode(m_condition->clone(), m_yes->clone(), m_no->clone()));
+		}
+
+		virtual ASTNodePtr copy(const ASTNodePtr *children) const
+		{
+			return ASTNodePtr(new BranchASTNode(children[0], children[1], children[2]));
 		}
 
 
-        ASTNodePtr condition()
+        const ASTNodePtr &condition()
 		{
 			return m_condition;
 		}
 
-        ASTNodePtr yes()
+        const ASTNodePtr &yes()
 		{
 			return m_yes;
 		}
 
-		ASTNodePtr no()
+		const ASTNodePtr &no()
 		{
 			return m_no;
 		}
 
     protected:
+		virtual void detach(std::vector<ASTNodePtr> &pending)
+		{
+			ASTNode::detach(m_condition, pending);
+			ASTNode::detach(m_yes, pending);
+			ASTNode::detach(m_no, pending);
+		}
+
 		ASTNodePtr m_condition;
 		ASTNodePtr m_yes;
 		ASTNodePtr m_no;
@@ -392,7 +614,7 @@ class VariableASTNode : public ASTNode
 			return ASTNodePtr(new VariableASTNode(m_key));
 		}
 
-		std::string variable()
+		const std::string &variable()
 		{
 			return m_key;
 		}
@@ -402,6 +624,128 @@ class VariableASTNode : public ASTNode
 };
 
 
+// Leaves have no subtrees to hand out
+inline const ASTNodePtr &ASTNode::child(size_t) const
+{
+	static const ASTNodePtr none;
+	return none;
+}
+
+inline ASTNodePtr ASTNode::copyDeep(const ASTNode *root)
+{
+	// Nodes still being copied, with the index of their next subtree. Copies of
+	// finished subtrees wait on copies until their parent is copied on top
+	std::vector<std::pair<const ASTNode *, size_t> > frames;
+	std::vector<ASTNodePtr> copies;
+
+	frames.push_back(std::make_pair(root, (size_t) 0));
+	while (!frames.empty())
+	{
+		const ASTNode *parent = frames.back().first;
+		size_t &next = frames.back().second;
+		size_t count = parent->children();
+		if (next < count)
+		{
+			const ASTNodePtr &subtree = parent->child(next++);
+			if (height(subtree) > RecursionLimit)
+			{
+				frames.push_back(std::make_pair((const ASTNode *) subtree.get(), (size_t) 0));
+			}
+			else
+			{
+				copies.push_back(subtree ? subtree->clone() : ASTNodePtr());
+			}
+			continue;
+		}
+
+		ASTNodePtr node = parent->copy(&copies[copies.size() - count]);
+		copies.resize(copies.size() - count);
+		copies.push_back(node);
+		frames.pop_back();
+	}
+	return copies.back();
+}
+
+inline void ASTNode::takeApart()
+{
+	std::vector<ASTNodePtr> pending;
+	detach(pending);
+	while (!pending.empty())
+	{
+		// Each node is emptied of its high subtrees before it is released, so
+		// its own destructor only has low ones left to recurse into
+		ASTNodePtr node;
+		node.swap(pending.back());
+		pending.pop_back();
+		node->detach(pending);
+	}
+}
+
+
+// Append every variable of an expression to variables once, in order of appearance
+template <typename T>
+void collectVariables(ASTNodePtr ast, std::vector<std::string> &variables)
+{
+	if (!ast)
+	{
+		return;
+	}
+	switch (ast->type())
+	{
+		case ASTNode::VARIABLE:
+		{
+			std::string variable = STATIC_POINTER_CAST<VariableASTNode<T> >(ast)->variable();
+			if (std::find(variables.begin(), variables.end(), variable) == variables.end())
+			{
+				variables.push_back(variable);
+			}
+			break;
+		}
+		case ASTNode::OPERATION:
+		{
+			SHARED_PTR<OperationASTNode> op = STATIC_POINTER_CAST<OperationASTNode>(ast);
+			collectVariables<T>(op->right(), variables);
+			collectVariables<T>(op->left(), variables);
+			break;
+		}
+		case ASTNode::FUNCTION1:
+			collectVariables<T>(STATIC_POINTER_CAST<Function1ASTNode>(ast)->left(), variables);
+			break;
+		case ASTNode::FUNCTION2:
+		{
+			SHARED_PTR<Function2ASTNode> f = STATIC_POINTER_CAST<Function2ASTNode>(ast);
+			collectVariables<T>(f->right(), variables);
+			collectVariables<T>(f->left(), variables);
+			break;
+		}
+		case ASTNode::COMPARISON:
+		{
+			SHARED_PTR<ComparisonASTNode> c = STATIC_POINTER_CAST<ComparisonASTNode>(ast);
+			collectVariables<T>(c->right(), variables);
+			collectVariables<T>(c->left(), variables);
+			break;
+		}
+		case ASTNode::LOGICAL:
+		{
+			SHARED_PTR<LogicalASTNode> l = STATIC_POINTER_CAST<LogicalASTNode>(ast);
+			collectVariables<T>(l->right(), variables);
+			collectVariables<T>(l->left(), variables);
+			break;
+		}
+		case ASTNode::BRANCH:
+		{
+			SHARED_PTR<BranchASTNode> b = STATIC_POINTER_CAST<BranchASTNode>(ast);
+			collectVariables<T>(b->condition(), variables);
+			collectVariables<T>(b->yes(), variables);
+			collectVariables<T>(b->no(), variables);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+
 } // namespace expr
 
 #endif
@@ -0,0 +1,254 @@
+#ifndef BULKPARSER_H
+#define BULKPARSER_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "AST.h"
+#include "Parser.h"
+#include "Exception.h"
+#include "Status.h"
+
+namespace expr
+{
+
+// Parses a buffer or file containing one expression per record (by default one
+// per line) across several threads. Each thread parses a contiguous block of
+// records with its own Parser and ParserContext, and failures are collected
+// per record instead of being thrown.
+template <typename T>
+class BulkParser
+{
+	public:
+		struct Error
+		{
+			size_t record; // zero based index of the failing record
+			size_t offset; // offset of the error into the parsed buffer
+			std::string message;
+		};
+
+		struct Result
+		{
+			std::vector<ASTNodePtr> asts; // one per record, empty for blank or failing records
+			std::vector<Error> errors;
+		};
+
+		BulkParser(unsigned int threads=0, char separator='\n')
+			: m_threads(threads)
+			, m_separator(separator)
+		{
+			if (m_threads == 0)
+			{
+				long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+				m_threads = cpus > 0 ? (unsigned int) cpus : 1;
+			}
+		}
+
+		void parseFile(const char *path, Result &result)
+		{
+			int fd = open(path, O_RDONLY);
+			if (fd < 0)
+			{
+				std::string message = std::string("Could not open expression file '") + path + "'";
+				throw ParserException(message.c_str());
+			}
+
+			struct stat st;
+			if (fstat(fd, &st) != 0)
+			{
+				close(fd);
+				std::string message = std::string("Could not stat expression file '") + path + "'";
+				throw ParserException(message.c_str());
+			}
+
+			size_t length = (size_t) st.st_size;
+			if (length == 0)
+			{
+				close(fd);
+				parse("", 0, result);
+				return;
+			}
+
+			void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (data == MAP_FAILED)
+			{
+				std::string message = std::string("Could not map expression file '") + path + "'";
+				throw ParserException(message.c_str());
+			}
+			madvise(data, length, MADV_SEQUENTIAL);
+
+			try
+			{
+				parse((const char *) data, length, result);
+			}
+			catch (...)
+			{
+				munmap(data, length);
+				throw;
+			}
+			munmap(data, length);
+		}
+
+		void parse(const char *data, size_t length, Result &result)
+		{
+			result.asts.clear();
+			result.errors.clear();
+
+			// Don't bother spinning up threads for tiny blocks
+			size_t threads = std::min<size_t>(m_threads, length / MinimumBlock + 1);
+
+			// Split the buffer into blocks of roughly equal size, ending each on a separator
+			std::vector<Block> blocks(threads);
+			size_t begin = 0;
+			for (size_t i=0; i<threads; i++)
+			{
+				size_t end = (i == threads - 1) ? length : std::max(begin, length * (i + 1) / threads);
+				while (end < length && data[end] != m_separator)
+				{
+					end++;
+				}
+				if (end < length)
+				{
+					end++; // keep the separator with the record it terminates
+				}
+				blocks[i].parser = this;
+				blocks[i].data = data;
+				blocks[i].begin = data + begin;
+				blocks[i].end = data + end;
+				begin = end;
+			}
+
+			// The first block runs on the calling thread
+			std::vector<pthread_t> handles(threads);
+			std::vector<bool> started(threads, false);
+			for (size_t i=1; i<threads; i++)
+			{
+				started[i] = pthread_create(&handles[i], NULL, &BulkParser::run, &blocks[i]) == 0;
+				if (!started[i])
+				{
+					run(&blocks[i]);
+				}
+			}
+			run(&blocks[0]);
+			for (size_t i=1; i<threads; i++)
+			{
+				if (started[i])
+				{
+					pthread_join(handles[i], NULL);
+				}
+			}
+
+			// Stitch the blocks back together in order
+			size_t records = 0;
+			for (size_t i=0; i<threads; i++)
+			{
+				records += blocks[i].asts.size();
+			}
+			result.asts.reserve(records);
+
+			size_t offset = 0;
+			for (size_t i=0; i<threads; i++)
+			{
+				Block &block = blocks[i];
+				result.asts.insert(result.asts.end(), block.asts.begin(), block.asts.end());
+				for (size_t j=0; j<block.errors.size(); j++)
+				{
+					result.errors.push_back(block.errors[j]);
+					result.errors.back().record += offset;
+				}
+				offset += block.asts.size();
+			}
+		}
+
+	private:
+		static const size_t MinimumBlock = 64 * 1024;
+
+		struct Block
+		{
+			BulkParser *parser;
+			const char *data;
+			const char *begin;
+			const char *end;
+			std::vector<ASTNodePtr> asts;
+			std::vector<Error> errors;
+		};
+
+		static void *run(void *arg)
+		{
+			Block *block = (Block *) arg;
+			block->parser->parseBlock(*block, block->data);
+			return NULL;
+		}
+
+		void parseBlock(Block &block, const char *data)
+		{
+			Parser<T> parser;
+			ParserContext<T> context;
+
+			const char *cursor = block.begin;
+			while (cursor < block.end)
+			{
+				const char *end = cursor;
+				while (end < block.end && *end != m_separator)
+				{
+					end++;
+				}
+
+				// Records are parsed in place, without copying or terminating them
+				size_t length = end - cursor;
+				if (m_separator == '\n' && length && cursor[length - 1] == '\r')
+				{
+					length--;
+				}
+
+				// Syntax errors come back as a Status, anything else the parser throws,
+				// like bad_alloc, is still reported against the record rather than
+				// escaping the worker thread
+				try
+				{
+					ASTNodePtr ast;
+					Status status = parser.tryParse(cursor, length, ast, context);
+					if (status.ok())
+					{
+						block.asts.push_back(ast);
+					}
+					else
+					{
+						size_t position = status.position() == Status::npos ? 0 : status.position();
+						addError(block, cursor - data + position, status.message());
+					}
+				}
+				catch (std::exception &e)
+				{
+					addError(block, cursor - data, e.what());
+				}
+
+				cursor = end + 1;
+			}
+		}
+
+		void addError(Block &block, size_t offset, const std::string &message)
+		{
+			block.asts.push_back(ASTNodePtr());
+			Error error;
+			error.record = block.asts.size() - 1;
+			error.offset = offset;
+			error.message = message;
+			block.errors.push_back(error);
+		}
+
+		unsigned int m_threads;
+		char m_separator;
+};
+
+} // namespace expr
+
+#endif
@@ -0,0 +1,383 @@
+#ifndef CANONICAL_H
+#define CANONICAL_H
+
+#include <string>
+#include <cstring>
+#include <stdint.h>
+
+#include "AST.h"
+#include "Memory.h"
+
+namespace expr
+{
+
+// 64 bit structural hash of a syntax tree (FNV-1a over its nodes). Numbers are
+// hashed from their bits in a fixed byte order, so a hash is the same across runs
+// and across platforms that use IEEE floating point
+typedef uint64_t ASTHash;
+
+namespace canonical
+{
+
+inline ASTHash offset()
+{
+	return (ASTHash(0xcbf29ce4) << 32) | 0x84222325;
+}
+
+inline ASTHash combine(ASTHash hash, const void *data, size_t size)
+{
+	const ASTHash prime = (ASTHash(0x00000100) << 32) | 0x000001b3;
+	const unsigned char *bytes = (const unsigned char *) data;
+	for (size_t i=0; i<size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= prime;
+	}
+	return hash;
+}
+
+inline ASTHash combine(ASTHash hash, unsigned int value)
+{
+	unsigned char byte = (unsigned char) value;
+	return combine(hash, &byte, 1);
+}
+
+inline ASTHash combine(ASTHash hash, ASTHash child)
+{
+	unsigned char bytes[8];
+	for (int i=0; i<8; i++)
+	{
+		bytes[i] = (unsigned char) (child >> (i * 8));
+	}
+	return combine(hash, bytes, 8);
+}
+
+// Every NaN hashes and compares the same, otherwise constants are compared bit
+// for bit, which keeps 0 and -0 apart
+template <typename T>
+bool sameNumber(T a, T b)
+{
+	if (a != a || b != b)
+	{
+		return a != a && b != b;
+	}
+	return std::memcmp(&a, &b, sizeof(T)) == 0;
+}
+
+// Unsigned integer with the same size as a number type
+template <size_t Size>
+struct NumberBits;
+
+template <>
+struct NumberBits<4>
+{
+	typedef uint32_t Type;
+};
+
+template <>
+struct NumberBits<8>
+{
+	typedef uint64_t Type;
+};
+
+// The bytes of the number are taken least significant first, whatever the byte
+// order of the platform
+template <typename T>
+ASTHash hashNumber(ASTHash hash, T value)
+{
+	if (value != value)
+	{
+		return combine(hash, 0xffu);
+	}
+	typename NumberBits<sizeof(T)>::Type bits;
+	std::memcpy(&bits, &value, sizeof(T));
+	unsigned char bytes[sizeof(T)];
+	for (size_t i=0; i<sizeof(T); i++)
+	{
+		bytes[i] = (unsigned char) (bits >> (i * 8));
+	}
+	return combine(hash, bytes, sizeof(T));
+}
+
+// Hash of a node from its own fields and the hashes of its children, in order
+inline ASTHash hashNode(ASTNode::ASTNodeType type, unsigned int kind, const ASTHash *children, size_t count)
+{
+	ASTHash hash = combine(offset(), (unsigned int) type);
+	hash = combine(hash, kind);
+	for (size_t i=0; i<count; i++)
+	{
+		hash = combine(hash, children[i]);
+	}
+	return hash;
+}
+
+} // namespace canonical
+
+
+// Hash of the tree as it is. Trees which are equivalent but written
+// differently only hash the same once they have been canonicalized
+template <typename T>
+ASTHash structuralHash(ASTNodePtr ast)
+{
+	if (!ast)
+	{
+		throw Exception("Incorrect abstract syntax tree");
+	}
+
+	ASTHash children[3];
+	switch (ast->type())
+	{
+		case ASTNode::NUMBER:
+		{
+			ASTHash hash = canonical::hashNode(ASTNode::NUMBER, 0, NULL, 0);
+			return canonical::hashNumber(hash, STATIC_POINTER_CAST<NumberASTNode<T> >(ast)->value());
+		}
+		case ASTNode::VARIABLE:
+		{
+			std::string variable = STATIC_POINTER_CAST<VariableASTNode<T> >(ast)->variable();
+			ASTHash hash = canonical::hashNode(ASTNode::VARIABLE, 0, NULL, 0);
+			return canonical::combine(hash, variable.data(), variable.size());
+		}
+		case ASTNode::OPERATION:
+		{
+			SHARED_PTR<OperationASTNode> op = STATIC_POINTER_CAST<OperationASTNode>(ast);
+			children[0] = structuralHash<T>(op->right());
+			children[1] = structuralHash<T>(op->left());
+			return canonical::hashNode(ASTNode::OPERATION, op->operation(), children, 2);
+		}
+		case ASTNode::FUNCTION1:
+		{
+			SHARED_PTR<Function1ASTNode> f = STATIC_POINTER_CAST<Function1ASTNode>(ast);
+			children[0] = structuralHash<T>(f->left());
+			return canonical::hashNode(ASTNode::FUNCTION1, f->function(), children, 1);
+		}
+		case ASTNode::FUNCTION2:
+		{
+			SHARED_PTR<Function2ASTNode> f = STATIC_POINTER_CAST<Function2ASTNode>(ast);
+			children[0] = structuralHash<T>(f->right());
+			children[1] = structuralHash<T>(f->left());
+			return canonical::hashNode(ASTNode::FUNCTION2, f->function(), children, 2);
+		}
+		case ASTNode::COMPARISON:
+		{
+			SHARED_PTR<ComparisonASTNode> c = STATIC_POINTER_CAST<ComparisonASTNode>(ast);
+			children[0] = structuralHash<T>(c->right());
+			children[1] = structuralHash<T>(c->left());
+			return canonical::hashNode(ASTNode::COMPARISON, c->comparison(), children, 2);
+		}
+		case ASTNode::LOGICAL:
+		{
+			SHARED_PTR<LogicalASTNode> l = STATIC_POINTER_CAST<LogicalASTNode>(ast);
+			children[0] = structuralHash<T>(l->right());
+			children[1] = structuralHash<T>(l->left());
+			return canonical::hashNode(ASTNode::LOGICAL, l->operation(), children, 2);
+		}
+		case ASTNode::BRANCH:
+		{
+			SHARED_PTR<BranchASTNode> b = STATIC_POINTER_CAST<BranchASTNode>(ast);
+			children[0] = structuralHash<T>(b->condition());
+			children[1] = structuralHash<T>(b->yes());
+			children[2] = structuralHash<T>(b->no());
+			return canonical::hashNode(ASTNode::BRANCH, 0, children, 3);
+		}
+	}
+	throw Exception("Incorrect abstract syntax tree");
+}
+
+
+// Whether two trees are identical, node for node
+template <typename T>
+bool structurallyEqual(ASTNodePtr a, ASTNodePtr b)
+{
+	if (a == b)
+	{
+		return true;
+	}
+	if (!a || !b || a->type() != b->type())
+	{
+		return false;
+	}
+
+	switch (a->type())
+	{
+		case ASTNode::NUMBER:
+			return canonical::sameNumber(STATIC_POINTER_CAST<NumberASTNode<T> >(a)->value(), STATIC_POINTER_CAST<NumberASTNode<T> >(b)->value());
+		case ASTNode::VARIABLE:
+			return STATIC_POINTER_CAST<VariableASTNode<T> >(a)->variable() == STATIC_POINTER_CAST<VariableASTNode<T> >(b)->variable();
+		case ASTNode::OPERATION:
+		{
+			SHARED_PTR<OperationASTNode> x = STATIC_POINTER_CAST<OperationASTNode>(a);
+			SHARED_PTR<OperationASTNode> y = STATIC_POINTER_CAST<OperationASTNode>(b);
+			return x->operation() == y->operation() && structurallyEqual<T>(x->right(), y->right()) && structurallyEqual<T>(x->left(), y->left());
+		}
+		case ASTNode::FUNCTION1:
+		{
+			SHARED_PTR<Function1ASTNode> x = STATIC_POINTER_CAST<Function1ASTNode>(a);
+			SHARED_PTR<Function1ASTNode> y = STATIC_POINTER_CAST<Function1ASTNode>(b);
+			return x->function() == y->function() && structurallyEqual<T>(x->left(), y->left());
+		}
+		case ASTNode::FUNCTION2:
+		{
+			SHARED_PTR<Function2ASTNode> x = STATIC_POINTER_CAST<Function2ASTNode>(a);
+			SHARED_PTR<Function2ASTNode> y = STATIC_POINTER_CAST<Function2ASTNode>(b);
+			return x->function() == y->function() && structurallyEqual<T>(x->right(), y->right()) && structurallyEqual<T>(x->left(), y->left());
+		}
+		case ASTNode::COMPARISON:
+		{
+			SHARED_PTR<ComparisonASTNode> x = STATIC_POINTER_CAST<ComparisonASTNode>(a);
+			SHARED_PTR<ComparisonASTNode> y = STATIC_POINTER_CAST<ComparisonASTNode>(b);
+			return x->comparison() == y->comparison() && structurallyEqual<T>(x->right(), y->right()) && structurallyEqual<T>(x->left(), y->left());
+		}
+		case ASTNode::LOGICAL:
+		{
+			SHARED_PTR<LogicalASTNode> x = STATIC_POINTER_CAST<LogicalASTNode>(a);
+			SHARED_PTR<LogicalASTNode> y = STATIC_POINTER_CAST<LogicalASTNode>(b);
+			return x->operation() == y->operation() && structurallyEqual<T>(x->right(), y->right()) && structurallyEqual<T>(x->left(), y->left());
+		}
+		case ASTNode::BRANCH:
+		{
+			SHARED_PTR<BranchASTNode> x = STATIC_POINTER_CAST<BranchASTNode>(a);
+			SHARED_PTR<BranchASTNode> y = STATIC_POINTER_CAST<BranchASTNode>(b);
+			return structurallyEqual<T>(x->condition(), y->condition()) && structurallyEqual<T>(x->yes(), y->yes()) && structurallyEqual<T>(x->no(), y->no());
+		}
+	}
+	return false;
+}
+
+
+// Builds an equivalent tree in a canonical form, so expressions which only
+// differ in how they were written share one form and one hash:
+//  - operands of commutative operators (+ * == != && ||) are ordered by hash
+//  - > and >= become < and <= with their operands swapped
+//  - pow(a,b) becomes a ^ b
+// min and max keep their operand order, which of two operands they return
+// differs when one is NaN or they are 0 and -0
+// Constants are already held as values, so their formatting doesn't matter.
+// Chains such as (a + b) + c are left alone, reassociating them would change
+// the floating point result. The hash of the new tree is stored in hash if given
+template <typename T>
+ASTNodePtr canonicalize(ASTNodePtr ast, ASTHash *hash=NULL)
+{
+	if (!ast)
+	{
+		throw Exception("Incorrect abstract syntax tree");
+	}
+
+	ASTHash result = 0;
+	ASTNodePtr node;
+	ASTHash children[3];
+	switch (ast->type())
+	{
+		case ASTNode::NUMBER:
+		case ASTNode::VARIABLE:
+			node = ast;
+			result = structuralHash<T>(ast);
+			break;
+		case ASTNode::OPERATION:
+		{
+			SHARED_PTR<OperationASTNode> op = STATIC_POINTER_CAST<OperationASTNode>(ast);
+			ASTNodePtr first = canonicalize<T>(op->right(), &children[0]);
+			ASTNodePtr second = canonicalize<T>(op->left(), &children[1]);
+			bool commutative = op->operation() == OperationASTNode::PLUS || op->operation() == OperationASTNode::MUL;
+			if (commutative && children[1] < children[0])
+			{
+				std::swap(first, second);
+				std::swap(children[0], children[1]);
+			}
+			node = ASTNodePtr(new OperationASTNode(op->operation(), second, first));
+			result = canonical::hashNode(ASTNode::OPERATION, op->operation(), children, 2);
+			break;
+		}
+		case ASTNode::FUNCTION1:
+		{
+			SHARED_PTR<Function1ASTNode> f = STATIC_POINTER_CAST<Function1ASTNode>(ast);
+			node = ASTNodePtr(new Function1ASTNode(f->function(), canonicalize<T>(f->left(), &children[0])));
+			result = canonical::hashNode(ASTNode::FUNCTION1, f->function(), children, 1);
+			break;
+		}
+		case ASTNode::FUNCTION2:
+		{
+			SHARED_PTR<Function2ASTNode> f = STATIC_POINTER_CAST<Function2ASTNode>(ast);
+			ASTNodePtr first = canonicalize<T>(f->right(), &children[0]);
+			ASTNodePtr second = canonicalize<T>(f->left(), &children[1]);
+			if (f->function() == Function2ASTNode::POW)
+			{
+				node = ASTNodePtr(new OperationASTNode(OperationASTNode::POW, second, first));
+				result = canonical::hashNode(ASTNode::OPERATION, OperationASTNode::POW, children, 2);
+				break;
+			}
+			node = ASTNodePtr(new Function2ASTNode(f->function(), second, first));
+			result = canonical::hashNode(ASTNode::FUNCTION2, f->function(), children, 2);
+			break;
+		}
+		case ASTNode::COMPARISON:
+		{
+			SHARED_PTR<ComparisonASTNode> c = STATIC_POINTER_CAST<ComparisonASTNode>(ast);
+			ASTNodePtr first = canonicalize<T>(c->right(), &children[0]);
+			ASTNodePtr second = canonicalize<T>(c->left(), &children[1]);
+			ComparisonASTNode::ComparisonType comparison = c->comparison();
+			bool swap = false;
+			switch (comparison)
+			{
+				case ComparisonASTNode::GREATER_THAN:
+					comparison = ComparisonASTNode::LESS_THAN;
+					swap = true;
+					break;
+				case ComparisonASTNode::GREATER_THAN_EQUAL:
+					comparison = ComparisonASTNode::LESS_THAN_EQUAL;
+					swap = true;
+					break;
+				case ComparisonASTNode::EQUAL:
+				case ComparisonASTNode::NOT_EQUAL:
+					swap = children[1] < children[0];
+					break;
+				default:
+					break;
+			}
+			if (swap)
+			{
+				std::swap(first, second);
+				std::swap(children[0], children[1]);
+			}
+			node = ASTNodePtr(new ComparisonASTNode(comparison, second, first));
+			result = canonical::hashNode(ASTNode::COMPARISON, comparison, children, 2);
+			break;
+		}
+		case ASTNode::LOGICAL:
+		{
+			SHARED_PTR<LogicalASTNode> l = STATIC_POINTER_CAST<LogicalASTNode>(ast);
+			ASTNodePtr first = canonicalize<T>(l->right(), &children[0]);
+			ASTNodePtr second = canonicalize<T>(l->left(), &children[1]);
+			if (children[1] < children[0])
+			{
+				std::swap(first, second);
+				std::swap(children[0], children[1]);
+			}
+			node = ASTNodePtr(new LogicalASTNode(l->operation(), second, first));
+			result = canonical::hashNode(ASTNode::LOGICAL, l->operation(), children, 2);
+			break;
+		}
+		case ASTNode::BRANCH:
+		{
+			SHARED_PTR<BranchASTNode> b = STATIC_POINTER_CAST<BranchASTNode>(ast);
+			ASTNodePtr condition = canonicalize<T>(b->condition(), &children[0]);
+			ASTNodePtr yes = canonicalize<T>(b->yes(), &children[1]);
+			ASTNodePtr no = canonicalize<T>(b->no(), &children[2]);
+			node = ASTNodePtr(new BranchASTNode(condition, yes, no));
+			result = canonical::hashNode(ASTNode::BRANCH, 0, children, 3);
+			break;
+		}
+		default:
+			throw Exception("Incorrect abstract syntax tree");
+	}
+
+	if (hash)
+	{
+		*hash = result;
+	}
+	return node;
+}
+
+} // namespace expr
+
+#endif
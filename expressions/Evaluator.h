@@ -8,12 +8,14 @@
 #include "AST.h"
 #include "Memory.h"
 #include "Exception.h"
+#include "Status.h"
 
 #ifdef USE_LLVM
 
 #include "llvm/DerivedTypes.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JIT.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/IRBuilder.h"
 #include "llvm/LLVMContext.h"
 #include "llvm/Module.h"
@@ -23,7 +25,14 @@
 #include "llvm/Analysis/Passes.h"
 #include "llvm/DataLayout.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Vectorize.h"
 #include "llvm/Support/Mutex.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/MDBuilder.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Target/TargetOptions.h"
 #include "llvm/Support/TargetSelect.h"
 
 #endif //USE_LLVM
@@ -41,6 +50,146 @@ class EvaluatorException : public Exception
 };
 
 
+// How often each ternary in an expression took its yes and no arms. Collected
+// by Evaluator, and used by LLVMEvaluator to lay out and weight its branches.
+class BranchProfile
+{
+	public:
+		struct Counts
+		{
+			Counts()
+				: yes(0)
+				, no(0)
+			{
+			}
+
+			unsigned long yes;
+			unsigned long no;
+		};
+
+		void record(const ASTNode *branch, bool yes)
+		{
+			Counts &counts = m_counts[branch];
+			if (yes)
+			{
+				counts.yes++;
+			}
+			else
+			{
+				counts.no++;
+			}
+		}
+
+		// Zero counts for branches which were never evaluated
+		Counts counts(const ASTNode *branch) const
+		{
+			std::map<const ASTNode*, Counts>::const_iterator it = m_counts.find(branch);
+			return it == m_counts.end() ? Counts() : it->second;
+		}
+
+		bool empty() const
+		{
+			return m_counts.empty();
+		}
+
+		void clear()
+		{
+			m_counts.clear();
+		}
+
+	private:
+		std::map<const ASTNode*, Counts> m_counts;
+};
+
+
+// Stack of plain values which keeps its first N entries inside itself, so that
+// shallow expressions are evaluated without touching the heap
+template <typename E, size_t N>
+class InlineStack
+{
+	public:
+		InlineStack()
+			: m_data(m_inline)
+			, m_size(0)
+			, m_capacity(N)
+		{
+		}
+
+		InlineStack(const InlineStack &other)
+			: m_data(m_inline)
+			, m_size(0)
+			, m_capacity(N)
+		{
+			*this = other;
+		}
+
+		InlineStack &operator=(const InlineStack &other)
+		{
+			clear();
+			for (size_t i=0; i<other.m_size; i++)
+			{
+				push_back(other.m_data[i]);
+			}
+			return *this;
+		}
+
+		void push_back(const E &value)
+		{
+			if (m_size == m_capacity)
+			{
+				grow();
+			}
+			m_data[m_size++] = value;
+		}
+
+		void pop_back()
+		{
+			m_size--;
+		}
+
+		E &back()
+		{
+			return m_data[m_size - 1];
+		}
+
+		E &operator[](size_t index)
+		{
+			return m_data[index];
+		}
+
+		size_t size() const
+		{
+			return m_size;
+		}
+
+		bool empty() const
+		{
+			return m_size == 0;
+		}
+
+		// Keeps the memory, for the next evaluation
+		void clear()
+		{
+			m_size = 0;
+		}
+
+	private:
+		void grow()
+		{
+			std::vector<E> heap(m_capacity * 2);
+			std::copy(m_data, m_data + m_size, heap.begin());
+			m_heap.swap(heap);
+			m_data = &m_heap[0];
+			m_capacity = m_heap.size();
+		}
+
+		E m_inline[N];
+		std::vector<E> m_heap;
+		E *m_data;
+		size_t m_size;
+		size_t m_capacity;
+};
+
 
 template <typename T>
 class Evaluator
@@ -51,302 +200,1247 @@ class Evaluator
 		Evaluator(ASTNodePtr ast, VariableMap *map=NULL)
 			: m_ast(ast)
 			, m_map(map)
+			, m_profile(NULL)
+		{
+		}
+
+		// Count the arms taken by every ternary into profile, NULL to stop counting
+		void setProfile(BranchProfile *profile)
+		{
+			m_profile = profile;
+		}
+
+		T evaluate()
+		{
+			T result;
+			Status status = tryEvaluate(result);
+			if (!status.ok())
+			{
+				throw EvaluatorException(status.message().c_str());
+			}
+			return result;
+		}
+
+		// As evaluate, but errors are returned rather than thrown
+		Status tryEvaluate(T &result)
+		{
+			m_status = Status();
+			result = evaluateSubtree(m_ast.get());
+			return m_status;
+		}
+
+	private:
+		// Errors are recorded in m_status and evaluation carries on with a zero
+		// value, so that only the first error is reported
+		T fail(Status::Code code, const char *detail)
+		{
+			if (m_status.ok())
+			{
+				m_status = Status(code, Status::npos, detail);
+			}
+			return T();
+		}
+
+		// The tree is walked with an explicit stack of the nodes still waiting on
+		// operands, so the native stack doesn't grow with the depth of the tree.
+		// Operands collect on m_values, where each node replaces them with its
+		// result. Both stacks are kept between calls, so once they have grown to
+		// the depth of the tree evaluating doesn't allocate
+		T evaluateSubtree(ASTNode *root)
+		{
+			m_frames.clear();
+			m_values.clear();
+			push(root);
+			while (!m_frames.empty())
+			{
+				Frame &frame = m_frames.back();
+				ASTNode *ast = frame.node;
+				T result;
+				switch (ast->type())
+				{
+					case ASTNode::OPERATION:
+					{
+						OperationASTNode *op = static_cast<OperationASTNode *>(ast);
+						// the operators are switched thanks to rpn notation
+						if (!operands(frame, op->right().get(), op->left().get()))
+						{
+							continue;
+						}
+						result = operation(op->operation(), m_values[m_values.size() - 2], m_values.back());
+						m_values.pop_back();
+						break;
+					}
+					case ASTNode::FUNCTION1:
+					{
+						Function1ASTNode *f = static_cast<Function1ASTNode *>(ast);
+						if (frame.stage == 0)
+						{
+							frame.stage = 1;
+							if (push(f->left().get()))
+							{
+								continue;
+							}
+						}
+						result = function(f->function(), m_values.back());
+						break;
+					}
+					case ASTNode::FUNCTION2:
+					{
+						Function2ASTNode *f = static_cast<Function2ASTNode *>(ast);
+						if (!operands(frame, f->right().get(), f->left().get()))
+						{
+							continue;
+						}
+						result = function(f->function(), m_values[m_values.size() - 2], m_values.back());
+						m_values.pop_back();
+						break;
+					}
+					case ASTNode::COMPARISON:
+					{
+						ComparisonASTNode *c = static_cast<ComparisonASTNode *>(ast);
+						if (!operands(frame, c->right().get(), c->left().get()))
+						{
+							continue;
+						}
+						result = comparison(c->comparison(), m_values[m_values.size() - 2], m_values.back());
+						m_values.pop_back();
+						break;
+					}
+					case ASTNode::LOGICAL:
+					{
+						LogicalASTNode *l = static_cast<LogicalASTNode *>(ast);
+						if (!operands(frame, l->right().get(), l->left().get()))
+						{
+							continue;
+						}
+						result = logical(l->operation(), m_values[m_values.size() - 2], m_values.back());
+						m_values.pop_back();
+						break;
+					}
+					case ASTNode::BRANCH:
+					{
+						// Only the arm taken is evaluated, its value is the result
+						BranchASTNode *b = static_cast<BranchASTNode *>(ast);
+						if (frame.stage == 0)
+						{
+							frame.stage = 1;
+							if (push(b->condition().get()))
+							{
+								continue;
+							}
+						}
+						if (frame.stage == 1)
+						{
+							bool condition = (bool)m_values.back();
+							m_values.pop_back();
+							if (m_profile)
+							{
+								m_profile->record(ast, condition);
+							}
+							frame.stage = 2;
+							if (push(condition == true ? b->yes().get() : b->no().get()))
+							{
+								continue;
+							}
+						}
+						m_frames.pop_back();
+						continue;
+					}
+					default:
+						m_values.push_back(fail(Status::INVALID_AST, "Incorrect syntax tree!"));
+						m_frames.pop_back();
+						continue;
+				}
+				m_values.back() = result;
+				m_frames.pop_back();
+			}
+			return m_values.back();
+		}
+
+		// A node waiting on its operands, stage counts the operands pushed so far
+		struct Frame
+		{
+			ASTNode *node;
+			unsigned int stage;
+		};
+
+		// Leaves go straight onto m_values, other nodes get a frame of their own.
+		// Returns whether a frame was pushed, which the caller has to wait on
+		bool push(ASTNode *ast)
+		{
+			if (!ast)
+			{
+				m_values.push_back(fail(Status::NO_AST, "No abstract syntax tree provided"));
+				return false;
+			}
+			if (ast->type() == ASTNode::NUMBER)
+			{
+				m_values.push_back(static_cast<NumberASTNode<T> *>(ast)->value());
+				return false;
+			}
+			if (ast->type() == ASTNode::VARIABLE)
+			{
+				m_values.push_back(variable(static_cast<VariableASTNode<T> *>(ast)));
+				return false;
+			}
+			Frame frame = { ast, 0 };
+			m_frames.push_back(frame);
+			return true;
+		}
+
+		// Pushes the two operands of a node in turn, true once both are on m_values.
+		// When it returns false a frame was pushed, and frame may have moved
+		bool operands(Frame &frame, ASTNode *first, ASTNode *second)
+		{
+			if (frame.stage == 0)
+			{
+				frame.stage = 1;
+				if (push(first))
+				{
+					return false;
+				}
+			}
+			if (frame.stage == 1)
+			{
+				frame.stage = 2;
+				if (push(second))
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		T variable(VariableASTNode<T> *v)
+		{
+			if (!m_map)
+			{
+				return fail(Status::NO_VARIABLE_MAP, "Variable encountered but no VariableMap provided");
+			}
+
+			typename VariableMap::const_iterator it = m_map->find(v->variable());
+			if (it == m_map->end())
+			{
+				if (m_status.ok())
+				{
+					m_status = Status(Status::UNDEFINED_VARIABLE, Status::npos);
+					m_status.setName(v->variable());
+				}
+				return T();
+			}
+			return it->second;
+		}
+
+		T operation(OperationASTNode::OperationType operation, T v1, T v2)
+		{
+			switch(operation)
+			{
+				case OperationASTNode::PLUS:  return v1 + v2;
+				case OperationASTNode::MINUS: return v1 - v2;
+				case OperationASTNode::MUL:   return v1 * v2;
+				case OperationASTNode::DIV:   return v1 / v2;
+				case OperationASTNode::POW:   return (T) pow(v1,v2);
+				case OperationASTNode::MOD:   return (T) fmod(v1,v2);
+				default: return fail(Status::INVALID_AST, "Unknown operator in syntax tree");
+			}
+		}
+
+		T function(Function1ASTNode::Function1Type function, T v1)
+		{
+			switch(function)
+			{
+				case Function1ASTNode::SIN:   return (T) sin(v1);
+				case Function1ASTNode::COS:   return (T) cos(v1);
+				case Function1ASTNode::TAN:   return (T) tan(v1);
+				case Function1ASTNode::SQRT:  return (T) sqrt(v1);
+				case Function1ASTNode::LOG:   return (T) log(v1);
+				case Function1ASTNode::LOG2:  return (T) log2(v1);
+				case Function1ASTNode::LOG10: return (T) log10(v1);
+				case Function1ASTNode::CEIL:  return (T) ceil(v1);
+				case Function1ASTNode::FLOOR: return (T) floor(v1);
+				default: return fail(Status::INVALID_AST, "Unknown function in syntax tree");
+			}
+		}
+
+		T function(Function2ASTNode::Function2Type function, T v1, T v2)
+		{
+			switch(function)
+			{
+				case Function2ASTNode::MIN:  return std::min(v1, v2);
+				case Function2ASTNode::MAX:  return std::max(v1, v2);
+				case Function2ASTNode::POW:  return (T) pow(v1, v2);
+				default: return fail(Status::INVALID_AST, "Unknown function in syntax tree");
+			}
+		}
+
+		T comparison(ComparisonASTNode::ComparisonType comparison, T v1, T v2)
+		{
+			switch(comparison)
+			{
+				case ComparisonASTNode::EQUAL:              return v1 == v2;
+				case ComparisonASTNode::NOT_EQUAL:          return v1 != v2;
+				case ComparisonASTNode::GREATER_THAN:       return v1 >  v2;
+				case ComparisonASTNode::GREATER_THAN_EQUAL: return v1 >= v2;
+				case ComparisonASTNode::LESS_THAN:          return v1 <  v2;
+				case ComparisonASTNode::LESS_THAN_EQUAL:    return v1 <= v2;
+				default: return fail(Status::INVALID_AST, "Unknown comparison in syntax tree");
+			}
+		}
+
+		T logical(LogicalASTNode::OperationType operation, T v1, T v2)
+		{
+			switch(operation)
+			{
+				case LogicalASTNode::AND: return v1 && v2;
+				case LogicalASTNode::OR:  return v1 || v2;
+				default: return fail(Status::INVALID_AST, "Unknown logical operator in syntax tree");
+			}
+		}
+
+
+		ASTNodePtr m_ast;
+		VariableMap *m_map;
+		BranchProfile *m_profile;
+		Status m_status;
+		InlineStack<Frame, 32> m_frames;
+		InlineStack<T, 32> m_values;
+};
+
+#ifdef USE_LLVM
+
+// How much effort the JIT spends on an expression, and what it may assume
+struct LLVMOptions
+{
+	enum Level
+	{
+		NONE,      // no IR passes, unoptimised machine code
+		FAST,      // cheap IR clean up, light machine code optimisation
+		AGGRESSIVE // full IR pipeline and machine code optimisation
+	};
+
+	LLVMOptions()
+		: level(AGGRESSIVE)
+		, fastMath(false)
+		, nativeCPU(false)
+		, compact(false)
+	{
+	}
+
+	Level level;
+	bool fastMath;  // allow reassociation, contraction to FMA and ignore NaN/Inf
+	bool nativeCPU; // generate code for the host CPU and all of its features
+	bool compact;   // drop the IR of each function once its machine code is emitted
+};
+
+
+// Owns an LLVM context, module, JIT engine and optimiser pipeline which can be
+// shared by any number of LLVMEvaluators. Each evaluator adds its own function
+// to the module and frees its machine code again when it is destroyed, so the
+// per expression cost is little more than the size of its compiled code.
+// Separate sessions have separate contexts, so they can compile concurrently
+// from different threads; a single session serialises its own users.
+class LLVMSession
+{
+	public:
+		LLVMSession(const LLVMOptions &options=LLVMOptions())
+			: m_options(options)
+			, m_context()
+			, m_module(new llvm::Module("expression jit", m_context))
+			, m_engine(NULL)
+			, m_fpm(NULL)
+			, m_kernelFpm(NULL)
+		{
+			initialize();
+
+			// Set up the JIT compiler, engine creation touches global LLVM state
+			std::string error;
+			{
+				llvm::sys::SmartScopedLock<false> lock(globalMutex());
+				llvm::EngineBuilder builder(m_module);
+				builder.setErrorStr(&error);
+				configure(builder);
+				m_engine = builder.create();
+			}
+			if (!m_engine)
+			{
+				delete m_module;
+				std::ostringstream ss;
+				ss << "Could not initialize LLVM JIT, ";
+				ss << error;
+				throw EvaluatorException(ss.str().c_str());
+			}
+			m_engine->RegisterJITEventListener(&m_listener);
+		}
+
+		~LLVMSession()
+		{
+			releasePasses();
+			m_engine->UnregisterJITEventListener(&m_listener);
+			// The engine owns the module
+			delete m_engine;
+		}
+
+		llvm::LLVMContext &context()
+		{
+			return m_context;
+		}
+
+		llvm::Module *module()
+		{
+			return m_module;
+		}
+
+		llvm::ExecutionEngine *engine()
+		{
+			return m_engine;
+		}
+
+		llvm::FunctionPassManager &passManager()
+		{
+			if (!m_fpm)
+			{
+				createPasses();
+			}
+			return *m_fpm;
+		}
+
+		const LLVMOptions &options() const
+		{
+			return m_options;
+		}
+
+		// Run the optimiser pipeline over a function, before its code is generated
+		void optimise(llvm::Function *function)
+		{
+			if (m_options.level != LLVMOptions::NONE)
+			{
+				passManager().run(*function);
+			}
+		}
+
+		// As optimise, for functions which loop over arrays
+		void optimiseKernel(llvm::Function *function)
+		{
+			if (m_options.level != LLVMOptions::NONE)
+			{
+				if (!m_kernelFpm)
+				{
+					createKernelPasses();
+				}
+				m_kernelFpm->run(*function);
+			}
+		}
+
+		// Free the optimiser pipelines, they are built again if they're needed later
+		void releasePasses()
+		{
+			if (m_fpm)
+			{
+				m_fpm->doFinalization();
+				delete m_fpm;
+				m_fpm = NULL;
+			}
+			if (m_kernelFpm)
+			{
+				m_kernelFpm->doFinalization();
+				delete m_kernelFpm;
+				m_kernelFpm = NULL;
+			}
+		}
+
+		// Bytes of machine code emitted for a function, 0 if it hasn't been emitted.
+		// The sizes are recorded while other evaluators compile, so under the lock
+		size_t codeSize(const llvm::Function *function) const
+		{
+			llvm::sys::SmartScopedLock<false> lock(m_mutex);
+			std::map<const llvm::Function*, size_t>::const_iterator it = m_listener.sizes.find(function);
+			return it == m_listener.sizes.end() ? 0 : it->second;
+		}
+
+		// Remove a function added by an evaluator, along with its machine code
+		void release(llvm::Function *function)
+		{
+			llvm::sys::SmartScopedLock<false> lock(m_mutex);
+			m_engine->freeMachineCodeForFunction(function);
+			m_listener.sizes.erase(function);
+			function->eraseFromParent();
+		}
+
+		// Held while an evaluator generates or releases code in this session
+		llvm::sys::SmartMutex<false> &mutex()
+		{
+			return m_mutex;
+		}
+
+		// One time set up of LLVM for use from several threads
+		static void initialize()
+		{
+			llvm::sys::SmartScopedLock<false> lock(globalMutex());
+			static bool initialized = false;
+			if (!initialized)
+			{
+				llvm::llvm_start_multithreaded();
+				llvm::InitializeNativeTarget();
+				initialized = true;
+			}
+		}
+
+	private:
+		// Sessions are not copyable
+		LLVMSession(const LLVMSession &);
+		LLVMSession &operator=(const LLVMSession &);
+
+		// Records how much machine code the JIT emits for each function. Code is
+		// only emitted while the session mutex is held.
+		struct CodeSizeListener : public llvm::JITEventListener
+		{
+			virtual void NotifyFunctionEmitted(const llvm::Function &function, void *, size_t size, const EmittedFunctionDetails &)
+			{
+				sizes[&function] = size;
+			}
+
+			std::map<const llvm::Function*, size_t> sizes;
+		};
+
+		static llvm::sys::SmartMutex<false>& globalMutex()
+		{
+			static llvm::sys::SmartMutex<false> m_mutex; return m_mutex;
+		}
+
+		void createPasses()
+		{
+			m_fpm = new llvm::FunctionPassManager(m_module);
+
+			// Register how target lays out data structures
+			m_fpm->add(new llvm::DataLayout(*m_engine->getDataLayout()));
+			if (m_options.level == LLVMOptions::AGGRESSIVE)
+			{
+				// Provide basic AliasAnalysis support for GVN
+				m_fpm->add(llvm::createBasicAliasAnalysisPass());
+			}
+			if (m_options.level != LLVMOptions::NONE)
+			{
+				// Promote allocas to registers.
+				m_fpm->add(llvm::createPromoteMemoryToRegisterPass());
+				// Do simple "peephole" optimisations and bit-twiddling
+				m_fpm->add(llvm::createInstructionCombiningPass());
+			}
+			if (m_options.level == LLVMOptions::AGGRESSIVE)
+			{
+				// Reassociate expressions
+				m_fpm->add(llvm::createReassociatePass());
+				// Eliminate common subexpressions
+				m_fpm->add(llvm::createGVNPass());
+			}
+			if (m_options.level != LLVMOptions::NONE)
+			{
+				// Simplify the control flow graph
+				m_fpm->add(llvm::createCFGSimplificationPass());
+			}
+
+			m_fpm->doInitialization();
+		}
+
+		// Batch kernels additionally get their loop into shape for the vectoriser
+		void createKernelPasses()
+		{
+			m_kernelFpm = new llvm::FunctionPassManager(m_module);
+			m_kernelFpm->add(new llvm::DataLayout(*m_engine->getDataLayout()));
+			if (m_options.level != LLVMOptions::NONE)
+			{
+				m_kernelFpm->add(llvm::createBasicAliasAnalysisPass());
+				m_kernelFpm->add(llvm::createPromoteMemoryToRegisterPass());
+				m_kernelFpm->add(llvm::createInstructionCombiningPass());
+				m_kernelFpm->add(llvm::createCFGSimplificationPass());
+				m_kernelFpm->add(llvm::createLoopRotatePass());
+				m_kernelFpm->add(llvm::createLICMPass());
+				m_kernelFpm->add(llvm::createIndVarSimplifyPass());
+				m_kernelFpm->add(llvm::createLoopVectorizePass());
+				m_kernelFpm->add(llvm::createInstructionCombiningPass());
+				m_kernelFpm->add(llvm::createCFGSimplificationPass());
+			}
+			m_kernelFpm->doInitialization();
+		}
+
+		void configure(llvm::EngineBuilder &builder)
+		{
+			switch (m_options.level)
+			{
+				case LLVMOptions::NONE:       builder.setOptLevel(llvm::CodeGenOpt::None); break;
+				case LLVMOptions::FAST:       builder.setOptLevel(llvm::CodeGenOpt::Less); break;
+				case LLVMOptions::AGGRESSIVE: builder.setOptLevel(llvm::CodeGenOpt::Aggressive); break;
+			}
+
+			if (m_options.fastMath)
+			{
+				llvm::TargetOptions target;
+				target.UnsafeFPMath = true;
+				target.NoInfsFPMath = true;
+				target.NoNaNsFPMath = true;
+				target.AllowFPOpFusion = llvm::FPOpFusion::Fast;
+				builder.setTargetOptions(target);
+			}
+
+			if (m_options.nativeCPU)
+			{
+				builder.setMCPU(llvm::sys::getHostCPUName());
+
+				// Not every LLVM build can detect the features, the CPU name alone implies most of them
+				llvm::StringMap<bool> features;
+				if (llvm::sys::getHostCPUFeatures(features))
+				{
+					std::vector<std::string> attributes;
+					for (llvm::StringMap<bool>::iterator it=features.begin(); it!=features.end(); ++it)
+					{
+						attributes.push_back((it->second ? "+" : "-") + it->getKey().str());
+					}
+					builder.setMAttrs(attributes);
+				}
+			}
+		}
+
+		LLVMOptions m_options;
+		mutable llvm::sys::SmartMutex<false> m_mutex; // recursive
+		llvm::LLVMContext m_context;
+		llvm::Module *m_module;
+		llvm::ExecutionEngine *m_engine;
+		llvm::FunctionPassManager *m_fpm;       // created on first use
+		llvm::FunctionPassManager *m_kernelFpm; // created on first use
+		CodeSizeListener m_listener;
+};
+
+
+// Maps the value type of an LLVMEvaluator onto LLVM types and constants
+template <typename T>
+struct LLVMTraits;
+
+template <>
+struct LLVMTraits<float>
+{
+	static const bool integer = false;
+	static llvm::Type *type(llvm::LLVMContext &context) { return llvm::Type::getFloatTy(context); }
+	static llvm::Constant *constant(llvm::LLVMContext &context, float value) { return llvm::ConstantFP::get(context, llvm::APFloat(value)); }
+};
+
+template <>
+struct LLVMTraits<double>
+{
+	static const bool integer = false;
+	static llvm::Type *type(llvm::LLVMContext &context) { return llvm::Type::getDoubleTy(context); }
+	static llvm::Constant *constant(llvm::LLVMContext &context, double value) { return llvm::ConstantFP::get(context, llvm::APFloat(value)); }
+};
+
+// Integers use integer arithmetic, and go through double for the math functions
+template <>
+struct LLVMTraits<int>
+{
+	static const bool integer = true;
+	static llvm::Type *type(llvm::LLVMContext &context) { return llvm::Type::getIntNTy(context, sizeof(int)*8); }
+	static llvm::Constant *constant(llvm::LLVMContext &context, int value) { return llvm::ConstantInt::get(type(context), value, true); }
+};
+
+
+template <typename T>
+class LLVMEvaluator
+{
+	public:
+		typedef std::map<std::string, T> VariableMap;
+
+		// Evaluates the expression for a single row, slots holds the value of each
+		// entry of variables(). It doesn't depend on any VariableMap, so one compiled
+		// function can be called from any number of threads with their own slots
+		typedef T (*Function)(const T *slots);
+
+		// Evaluates the expression for n rows at once, inputs holds one array per
+		// entry of variables() and out receives one result per row
+		typedef void (*Kernel)(const T * const *inputs, T *out, size_t n);
+
+		// Memory an evaluator is holding on to, in bytes unless noted
+		struct MemoryFootprint
+		{
+			size_t code;         // machine code of the function and kernel
+			size_t instructions; // IR instructions still held, none once compacted
+			size_t overhead;     // the evaluator itself and its variable bookkeeping
+		};
+
+		// Compile the expression into a session of its own
+		// The profile, if given,
+		// only has to stay alive for the duration of the constructor
+		LLVMEvaluator(ASTNodePtr ast, VariableMap *map=NULL, const LLVMOptions &options=LLVMOptions(), const BranchProfile *profile=NULL)
+			: m_ownedSession(new LLVMSession(options))
+			, m_session(m_ownedSession)
+			, m_context(m_session->context())
+			, m_module(m_session->module())
+			, m_builder(m_context)
+			, m_type(LLVMTraits<T>::type(m_context))
+			, m_function(NULL)
+			, m_evaluate(NULL)
+			, m_kernelFunction(NULL)
+			, m_kernel(NULL)
+			, m_map(map)
+			, m_profile(profile)
+			, m_eager(false)
+			, m_speculated(0)
+		{
+			compile(ast);
+			m_profile = NULL;
+		}
+
+		// Compile the expression into a shared session, which must outlive the evaluator
+		LLVMEvaluator(ASTNodePtr ast, VariableMap *map, LLVMSession &session, const BranchProfile *profile=NULL)
+			: m_ownedSession(NULL)
+			, m_session(&session)
+			, m_context(m_session->context())
+			, m_module(m_session->module())
+			, m_builder(m_context)
+			, m_type(LLVMTraits<T>::type(m_context))
+			, m_function(NULL)
+			, m_evaluate(NULL)
+			, m_kernelFunction(NULL)
+			, m_kernel(NULL)
+			, m_map(map)
+			, m_profile(profile)
+			, m_eager(false)
+			, m_speculated(0)
 		{
+			compile(ast);
+			m_profile = NULL;
+		}
+
+		// Compile the expression into a shared session, which the evaluator holds a
+		// reference to, so the session lives for as long as any of its evaluators
+		LLVMEvaluator(ASTNodePtr ast, VariableMap *map, SHARED_PTR<LLVMSession> session, const BranchProfile *profile=NULL)
+			: m_ownedSession(NULL)
+			, m_sharedSession(session)
+			, m_session(session.get())
+			, m_context(m_session->context())
+			, m_module(m_session->module())
+			, m_builder(m_context)
+			, m_type(LLVMTraits<T>::type(m_context))
+			, m_function(NULL)
+			, m_evaluate(NULL)
+			, m_kernelFunction(NULL)
+			, m_kernel(NULL)
+			, m_map(map)
+			, m_profile(profile)
+			, m_eager(false)
+			, m_speculated(0)
+		{
+			compile(ast);
+			m_profile = NULL;
+		}
+
+		~LLVMEvaluator()
+		{
+			if (m_function)
+			{
+				m_session->release(m_function);
+			}
+			if (m_kernelFunction)
+			{
+				m_session->release(m_kernelFunction);
+			}
+			delete m_ownedSession;
 		}
 
+		// Evaluate with the variables from the map given on construction. The map
+		// is bound on the first call, so this is for one thread at a time; call
+		// function() with private slots to evaluate from several threads
 		T evaluate()
 		{
-			return evaluateSubtree(m_ast);
+			if (m_sources.size() != m_variables.size())
+			{
+				bind();
+			}
+
+			// Most expressions only use a handful of variables
+			T stack[16];
+			std::vector<T> heap;
+			T *slots = stack;
+			if (m_sources.size() > 16)
+			{
+				heap.resize(m_sources.size());
+				slots = &heap[0];
+			}
+			for (size_t i=0; i<m_sources.size(); i++)
+			{
+				slots[i] = *m_sources[i];
+			}
+			return m_evaluate(slots);
+		}
+
+		T evaluate(const T *slots)
+		{
+			return m_evaluate(slots);
+		}
+
+		Function function() const
+		{
+			return m_evaluate;
+		}
+
+		// The batch kernel is only compiled the first time it is asked for
+		Kernel kernel()
+		{
+			if (!m_kernel)
+			{
+				generateKernel();
+			}
+			return m_kernel;
+		}
+
+		// Variables in the order the slots and kernel input arrays are expected in
+		const std::vector<std::string> &variables() const
+		{
+			return m_variables;
 		}
 
-	private:
-		T evaluateSubtree(ASTNodePtr ast)
+		// The session itself is not included, as it may be shared. Its lock is held
+		// while reading, as other evaluators may be compiling into it
+		MemoryFootprint memoryFootprint() const
 		{
-			if(!ast)
+			llvm::sys::SmartScopedLock<false> lock(m_session->mutex());
+			MemoryFootprint footprint;
+			footprint.code = 0;
+			footprint.instructions = 0;
+			if (m_function)
 			{
-				throw EvaluatorException("No abstract syntax tree provided");
+				footprint.code += m_session->codeSize(m_function);
+				footprint.instructions += instructions(m_function);
 			}
-			if(ast->type() == ASTNode::NUMBER)
+			if (m_kernelFunction)
 			{
-				SHARED_PTR<NumberASTNode<T> > n = STATIC_POINTER_CAST<NumberASTNode<T> >(ast);
-				return n->value();
+				footprint.code += m_session->codeSize(m_kernelFunction);
+				footprint.instructions += instructions(m_kernelFunction);
 			}
-			else if(ast->type() == ASTNode::VARIABLE)
-			{
-				SHARED_PTR<VariableASTNode<T> > v = STATIC_POINTER_CAST<VariableASTNode<T> >(ast);
-				std::string variable = v->variable();
-				if (!m_map)
-				{
-					throw EvaluatorException("Variable encountered but no VariableMap provided");
-				}
 
-				if (!m_map->count(variable))
-				{
-					std::ostringstream ss;
-					ss << "No variable '" << variable << "' defined in VariableMap";
-					throw Exception(ss.str().c_str());
-				}
-				return m_map->at(variable);
-			}
-			else if (ast->type() == ASTNode::OPERATION)
+			footprint.overhead = sizeof(*this);
+			footprint.overhead += m_variables.capacity() * sizeof(std::string);
+			for (size_t i=0; i<m_variables.size(); i++)
 			{
-				SHARED_PTR<OperationASTNode> op = STATIC_POINTER_CAST<OperationASTNode>(ast);
-
-				T v1 = evaluateSubtree(op->right()); // the operators are switched thanks to rpn notation
-				T v2 = evaluateSubtree(op->left());
-				switch(op->operation())
-				{
-					case OperationASTNode::PLUS:  return v1 + v2;
-					case OperationASTNode::MINUS: return v1 - v2;
-					case OperationASTNode::MUL:   return v1 * v2;
-					case OperationASTNode::DIV:   return v1 / v2;
-					case OperationASTNode::POW:   return (T) pow(v1,v2);
-					case OperationASTNode::MOD:   return (T) fmod(v1,v2);
-					default: throw EvaluatorException("Unknown operator in syntax tree");
-				}
+				footprint.overhead += m_variables[i].capacity();
 			}
-			else if (ast->type() == ASTNode::FUNCTION1)
+			footprint.overhead += m_sources.capacity() * sizeof(T*);
+			return footprint;
+		}
+		
+		T getVariable(const char *key)
+		{
+			if (!m_map)
 			{
-				SHARED_PTR<Function1ASTNode> f = STATIC_POINTER_CAST<Function1ASTNode>(ast);
-
-				T v1 = evaluateSubtree(f->left());
-				switch(f->function())
-				{
-					case Function1ASTNode::SIN:   return (T) sin(v1);
-					case Function1ASTNode::COS:   return (T) cos(v1);
-					case Function1ASTNode::TAN:   return (T) tan(v1);
-					case Function1ASTNode::SQRT:  return (T) sqrt(v1);
-					case Function1ASTNode::LOG:   return (T) log(v1);
-					case Function1ASTNode::LOG2:  return (T) log2(v1);
-					case Function1ASTNode::LOG10: return (T) log10(v1);
-					case Function1ASTNode::CEIL:  return (T) ceil(v1);
-					case Function1ASTNode::FLOOR: return (T) floor(v1);
-					default: throw EvaluatorException("Unknown function in syntax tree");
-				}
+				throw EvaluatorException("Variable encountered, but no variable map provided");
 			}
-			else if (ast->type() == ASTNode::FUNCTION2)
-			{
-				SHARED_PTR<Function2ASTNode> f = STATIC_POINTER_CAST<Function2ASTNode>(ast);
 
-				T v1 = evaluateSubtree(f->right()); // the operators are switched thanks to rpn notation
-				T v2 = evaluateSubtree(f->left());
-				switch(f->function())
-				{
-					case Function2ASTNode::MIN:  return std::min(v1, v2);
-					case Function2ASTNode::MAX:  return std::max(v1, v2);
-					case Function2ASTNode::POW:  return (T) pow(v1, v2);
-					default: throw EvaluatorException("Unknown function in syntax tree");
-				}
-			}
-			else if (ast->type() == ASTNode::COMPARISON)
-			{
-				SHARED_PTR<ComparisonASTNode> c = STATIC_POINTER_CAST<ComparisonASTNode>(ast);
-				T v1 = evaluateSubtree(c->right()); // the operators are switched thanks to rpn notation
-				T v2 = evaluateSubtree(c->left());
-				switch(c->comparison())
-				{
-					case ComparisonASTNode::EQUAL:              return v1 == v2;
-					case ComparisonASTNode::NOT_EQUAL:          return v1 != v2;
-					case ComparisonASTNode::GREATER_THAN:       return v1 >  v2;
-					case ComparisonASTNode::GREATER_THAN_EQUAL: return v1 >= v2;
-					case ComparisonASTNode::LESS_THAN:          return v1 <  v2;
-					case ComparisonASTNode::LESS_THAN_EQUAL:    return v1 <= v2;
-					default: throw EvaluatorException("Unknown comparison in syntax tree");
-				}
-			}
-			else if (ast->type() == ASTNode::LOGICAL)
-			{
-				SHARED_PTR<LogicalASTNode> l = STATIC_POINTER_CAST<LogicalASTNode>(ast);
-				T v1 = evaluateSubtree(l->right()); // the operators are switched thanks to rpn notation
-				T v2 = evaluateSubtree(l->left());
-				switch(l->operation())
-				{
-					case LogicalASTNode::AND: return v1 && v2;
-					case LogicalASTNode::OR:  return v1 || v2;
-					default: throw EvaluatorException("Unknown logical operator in syntax tree");
-				}
-			}
-			else if (ast->type() == ASTNode::BRANCH)
+			if (m_map->count(key))
 			{
-				SHARED_PTR<BranchASTNode> b = STATIC_POINTER_CAST<BranchASTNode>(ast);
-				if ((bool)evaluateSubtree(b->condition()) == true)
-				{
-					return evaluateSubtree(b->yes());
-				}
-				else
-				{
-					return evaluateSubtree(b->no());
-				}
+				return m_map->at(key);
 			}
 
-			throw EvaluatorException("Incorrect syntax tree!");
+			std::stringstream ss;
+			ss << "Variable '" << key << "' not defined";
+			throw EvaluatorException(ss.str().c_str());
 		}
 
 
-		ASTNodePtr m_ast;
-		VariableMap *m_map;
-};
-
-#ifdef USE_LLVM
-
-class LLVMEvaluator
-{
-	public:
-		typedef std::map<std::string, float> VariableMap;
+	private:
+		// Evaluators are not copyable
+		LLVMEvaluator(const LLVMEvaluator &);
+		LLVMEvaluator &operator=(const LLVMEvaluator &);
 
-		LLVMEvaluator(ASTNodePtr ast, VariableMap *map=NULL)
-			: m_context()
-			, m_module(new llvm::Module("expression jit", m_context))
-			, m_builder(m_context)
-			, m_engine(NULL)
-			, m_fpm(m_module)
-			, m_function(NULL)
-			, m_map(map)
+		void compile(ASTNodePtr ast)
 		{
-			// Need to use a mutex here, because LLVM apparently isn't thread safe?
-			mutex().acquire();
-
-			llvm::InitializeNativeTarget();
-
-			// Set up the JIT compiler
-			std::string error;
-			m_engine = llvm::EngineBuilder(m_module).setErrorStr(&error).create();
-			if (!m_engine)
+			m_ast = ast;
+			collectVariables<T>(ast, m_variables);
+			try
 			{
-				std::ostringstream ss;
-				ss << "Could not initialize LLVM JIT, ";
-				ss << error;
-				mutex().release();
-				throw EvaluatorException(ss.str().c_str());
+				generate(ast);
+			}
+			catch (...)
+			{
+				delete m_ownedSession;
+				throw;
 			}
+		}
 
-			
-			// Set up the optimiser pipeline
-			// Register how target lays out data structures
-			m_fpm.add(new llvm::DataLayout(*m_engine->getDataLayout()));
-			// Provide basic AliasAnalysis support for GVN
-			m_fpm.add(llvm::createBasicAliasAnalysisPass());
-			// Promote allocas to registers.
-			m_fpm.add(llvm::createPromoteMemoryToRegisterPass());
-			// Do simple "peephole" optimisations and bit-twiddling
-			m_fpm.add(llvm::createInstructionCombiningPass());
-			// Reassociate expressions
-			m_fpm.add(llvm::createReassociatePass());
-			// Eliminate common subexpressions
-			m_fpm.add(llvm::createGVNPass());
-			// Simplify the control flow graph
-			m_fpm.add(llvm::createCFGSimplificationPass());
-
-			m_fpm.doInitialization();
-			
+		void generate(ASTNodePtr ast)
+		{
+			llvm::sys::SmartScopedLock<false> lock(m_session->mutex());
+			m_speculated = 0; // a failed generation may have left it raised
 
-			// Create Function as entry point for LLVM
-			std::vector<llvm::Type*> Void(0, llvm::Type::getFloatTy(m_context));
-			llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getFloatTy(m_context), Void, false);
+			// Create Function as entry point for LLVM, taking the variable slots
+			std::vector<llvm::Type*> args(1, m_type->getPointerTo());
+			llvm::FunctionType *FT = llvm::FunctionType::get(m_type, args, false);
 			m_function = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, "", m_module);
+			llvm::Value *slots = m_function->arg_begin();
 			
 			// Create block for code
 			llvm::BasicBlock *BB = llvm::BasicBlock::Create(m_context, "entry", m_function);
 			m_builder.SetInsertPoint(BB);
 
+			for (size_t i=0; i<m_variables.size(); i++)
+			{
+				llvm::Value *gep = m_builder.CreateGEP(slots, llvm::ConstantInt::get(m_context, llvm::APInt(32, i)), "geptmp");
+				m_values[m_variables[i]] = m_builder.CreateLoad(gep, "loadtmp");
+			}
+
 			// Convert AST to LLVM and place into function pointer
 			try
 			{
-				m_builder.CreateRet(generateLLVM(ast));
+				m_builder.CreateRet(toValue(generateLLVM(ast)));
 			}
 			catch (...)
 			{
-				mutex().release();
+				m_values.clear();
+				m_function->eraseFromParent();
+				m_function = NULL;
 				throw;
 			}
+			m_values.clear();
 
 			// Verify that the function is well formed
 			//( fails when intrinsics are used )
 			//llvm::verifyFunction(*m_function);
 
+			m_session->optimise(m_function);
+
 			// Dump the LLVM IR (for debugging)
 			//m_module->dump();
 
 			// Set the evaluate function call
-			void *FPtr = m_engine->getPointerToFunction(m_function);
-			evaluate = (float (*)()) (intptr_t)FPtr;
+			void *FPtr = m_session->engine()->getPointerToFunction(m_function);
+			m_evaluate = (Function) (intptr_t)FPtr;
+			compact(m_function);
+		}
+
+		void generateKernel()
+		{
+			llvm::sys::SmartScopedLock<false> lock(m_session->mutex());
+
+			llvm::Type *valuePtr = m_type->getPointerTo();
+			llvm::Type *sizeType = llvm::Type::getIntNTy(m_context, sizeof(size_t)*8);
+			std::vector<llvm::Type*> args;
+			args.push_back(valuePtr->getPointerTo());
+			args.push_back(valuePtr);
+			args.push_back(sizeType);
+			llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getVoidTy(m_context), args, false);
+			m_kernelFunction = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, "", m_module);
+			// Results never overlap the inputs, which lets the loop be vectorised
+			m_kernelFunction->setDoesNotAlias(2);
+
+			llvm::Function::arg_iterator arg = m_kernelFunction->arg_begin();
+			llvm::Value *inputs = arg++;
+			llvm::Value *out = arg++;
+			llvm::Value *n = arg;
+
+			llvm::BasicBlock *entryBB = llvm::BasicBlock::Create(m_context, "entry", m_kernelFunction);
+			llvm::BasicBlock *loopBB  = llvm::BasicBlock::Create(m_context, "loop", m_kernelFunction);
+			llvm::BasicBlock *exitBB  = llvm::BasicBlock::Create(m_context, "exit", m_kernelFunction);
+
+			// Fetch the array of every variable once, before the loop
+			m_builder.SetInsertPoint(entryBB);
+			std::vector<llvm::Value*> arrays;
+			for (size_t i=0; i<m_variables.size(); i++)
+			{
+				llvm::Value *gep = m_builder.CreateGEP(inputs, llvm::ConstantInt::get(sizeType, i), "geptmp");
+				arrays.push_back(m_builder.CreateLoad(gep, "arraytmp"));
+			}
+			llvm::Value *zero = llvm::ConstantInt::get(sizeType, 0);
+			m_builder.CreateCondBr(m_builder.CreateICmpEQ(n, zero, "emptytmp"), exitBB, loopBB);
+
+			// One row per iteration
+			m_builder.SetInsertPoint(loopBB);
+			llvm::PHINode *row = m_builder.CreatePHI(sizeType, 2, "row");
+			row->addIncoming(zero, entryBB);
+			for (size_t i=0; i<m_variables.size(); i++)
+			{
+				llvm::Value *gep = m_builder.CreateGEP(arrays[i], row, "geptmp");
+				m_values[m_variables[i]] = m_builder.CreateLoad(gep, "loadtmp");
+			}
+
+			// The loop body has no branches, so it can be vectorised whatever the data
+			m_eager = true;
+			m_speculated = 0;
+			try
+			{
+				llvm::Value *result = toValue(generateLLVM(m_ast));
+				m_builder.CreateStore(result, m_builder.CreateGEP(out, row, "geptmp"));
+			}
+			catch (...)
+			{
+				m_eager = false;
+				m_values.clear();
+				m_kernelFunction->eraseFromParent();
+				m_kernelFunction = NULL;
+				throw;
+			}
+			m_eager = false;
+			m_values.clear();
+
+			llvm::Value *next = m_builder.CreateAdd(row, llvm::ConstantInt::get(sizeType, 1), "nexttmp");
+			row->addIncoming(next, m_builder.GetInsertBlock());
+			m_builder.CreateCondBr(m_builder.CreateICmpULT(next, n, "looptmp"), loopBB, exitBB);
+
+			m_builder.SetInsertPoint(exitBB);
+			m_builder.CreateRetVoid();
+
+			m_session->optimiseKernel(m_kernelFunction);
 
-			mutex().release();
+			void *FPtr = m_session->engine()->getPointerToFunction(m_kernelFunction);
+			m_kernel = (Kernel) (intptr_t)FPtr;
+			compact(m_kernelFunction);
 		}
 
-		~LLVMEvaluator()
+		// Once its machine code exists the IR of a function is dead weight. The
+		// declaration stays behind, as the JIT frees the code through it. Only an
+		// owned session drops its optimiser, a shared one is about to use it again
+		void compact(llvm::Function *function)
 		{
-			delete m_engine;
+			if (!m_session->options().compact)
+			{
+				return;
+			}
+			function->deleteBody();
+			if (m_ownedSession)
+			{
+				m_session->releasePasses();
+			}
 		}
 
-		float (*evaluate)();
-		
-		float getVariable(const char *key)
+		static size_t instructions(const llvm::Function *function)
+		{
+			size_t count = 0;
+			for (llvm::Function::const_iterator it = function->begin(); it != function->end(); ++it)
+			{
+				count += it->size();
+			}
+			return count;
+		}
+
+		// Look up where each variable lives in the map. Map entries don't move, so
+		// this only has to be done once, unless a variable was missing
+		void bind()
 		{
 			if (!m_map)
 			{
 				throw EvaluatorException("Variable encountered, but no variable map provided");
 			}
 
-			if (m_map->count(key))
+			std::vector<T*> sources;
+			for (size_t i=0; i<m_variables.size(); i++)
 			{
-				return m_map->at(key);
+				typename VariableMap::iterator it = m_map->find(m_variables[i]);
+				if (it == m_map->end())
+				{
+					std::stringstream ss;
+					ss << "Variable '" << m_variables[i] << "' not defined";
+					throw EvaluatorException(ss.str().c_str());
+				}
+				sources.push_back(&it->second);
 			}
+			m_sources.swap(sources);
+		}
 
-			std::stringstream ss;
-			ss << "Variable '" << key << "' not defined";
-			throw EvaluatorException(ss.str().c_str());
+		// Comparisons and logical operators produce a bool, which becomes 0 or 1
+		// wherever a value is needed
+		llvm::Value *toValue(llvm::Value *value)
+		{
+			if (value->getType()->isIntegerTy(1))
+			{
+				if (LLVMTraits<T>::integer)
+				{
+					return m_builder.CreateZExt(value, m_type, "booltmp");
+				}
+				return m_builder.CreateUIToFP(value, m_type, "booltmp");
+			}
+			return value;
+		}
+
+		// Any non zero value is true, as in C (so NaN is true as well)
+		llvm::Value *toBool(llvm::Value *value)
+		{
+			if (value->getType()->isIntegerTy(1))
+			{
+				return value;
+			}
+			llvm::Value *zero = llvm::Constant::getNullValue(m_type);
+			if (LLVMTraits<T>::integer)
+			{
+				return m_builder.CreateICmpNE(value, zero, "booltmp");
+			}
+			return m_builder.CreateFCmpUNE(value, zero, "booltmp");
+		}
+
+		// The math intrinsics only exist for floating point types
+		llvm::Value *toReal(llvm::Value *value)
+		{
+			if (LLVMTraits<T>::integer)
+			{
+				return m_builder.CreateSIToFP(value, llvm::Type::getDoubleTy(m_context), "realtmp");
+			}
+			return value;
+		}
+
+		llvm::Value *fromReal(llvm::Value *value)
+		{
+			if (LLVMTraits<T>::integer)
+			{
+				return m_builder.CreateFPToSI(value, m_type, "inttmp");
+			}
+			return value;
+		}
+
+		llvm::Value *intrinsic(llvm::Intrinsic::ID id, llvm::Value *v1, const char *name)
+		{
+			std::vector<llvm::Type*> arg_types(1, v1->getType());
+			return m_builder.CreateCall(llvm::Intrinsic::getDeclaration(m_module, id, arg_types), v1, name);
+		}
+
+		llvm::Value *power(llvm::Value *v1, llvm::Value *v2)
+		{
+			// Pow operator is defined in an intrinsic, so implement as a function call
+			llvm::Value *base = toReal(v1);
+			std::vector<llvm::Type*> arg_types(1, base->getType());
+			return fromReal(m_builder.CreateCall2(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::pow, arg_types), base, toReal(v2), "powtmp"));
+		}
+
+		// Arms that are evaluated whether or not they're taken, everywhere in the
+		// batch kernel and cheap ones picked with a select, mustn't trap on an
+		// integer division by zero, so they divide by one instead
+		llvm::Value *divisor(llvm::Value *value)
+		{
+			if (!m_eager && !m_speculated)
+			{
+				return value;
+			}
+			llvm::Value *zero = llvm::ConstantInt::get(m_type, 0);
+			return m_builder.CreateSelect(m_builder.CreateICmpEQ(value, zero, "zerotmp"), llvm::ConstantInt::get(m_type, 1), value, "divisortmp");
+		}
+
+		// Branch weights for a ternary from the profile, or NULL if it has no counts
+		llvm::MDNode *branchWeights(const ASTNode *branch)
+		{
+			if (!m_profile)
+			{
+				return NULL;
+			}
+			BranchProfile::Counts counts = m_profile->counts(branch);
+			if (counts.yes == 0 && counts.no == 0)
+			{
+				return NULL;
+			}
+
+			// Weights are 32 bit, keep the ratio while scaling the counts down
+			unsigned long yes = counts.yes;
+			unsigned long no = counts.no;
+			while (yes > 0x7fffffffUL || no > 0x7fffffffUL)
+			{
+				yes >>= 1;
+				no >>= 1;
+			}
+			return llvm::MDBuilder(m_context).createBranchWeights(yes + 1, no + 1);
+		}
+
+		// Rough number of instructions needed to evaluate a subtree
+		static unsigned int cost(ASTNodePtr ast)
+		{
+			if (!ast)
+			{
+				return 0;
+			}
+			switch (ast->type())
+			{
+				case ASTNode::OPERATION:
+				{
+					SHARED_PTR<OperationASTNode> op = STATIC_POINTER_CAST<OperationASTNode>(ast);
+					unsigned int own = 1;
+					if (op->operation() == OperationASTNode::DIV)
+					{
+						own = 4;
+					}
+					else if (op->operation() == OperationASTNode::POW || op->operation() == OperationASTNode::MOD)
+					{
+						own = 20;
+					}
+					return own + cost(op->left()) + cost(op->right());
+				}
+				case ASTNode::FUNCTION1:
+				{
+					SHARED_PTR<Function1ASTNode> f = STATIC_POINTER_CAST<Function1ASTNode>(ast);
+					unsigned int own = f->function() == Function1ASTNode::SQRT ? 4 : 20;
+					return own + cost(f->left());
+				}
+				case ASTNode::FUNCTION2:
+				{
+					SHARED_PTR<Function2ASTNode> f = STATIC_POINTER_CAST<Function2ASTNode>(ast);
+					unsigned int own = f->function() == Function2ASTNode::POW ? 20 : 2;
+					return own + cost(f->left()) + cost(f->right());
+				}
+				case ASTNode::COMPARISON:
+				{
+					SHARED_PTR<ComparisonASTNode> c = STATIC_POINTER_CAST<ComparisonASTNode>(ast);
+					return 1 + cost(c->left()) + cost(c->right());
+				}
+				case ASTNode::LOGICAL:
+				{
+					SHARED_PTR<LogicalASTNode> l = STATIC_POINTER_CAST<LogicalASTNode>(ast);
+					return 1 + cost(l->left()) + cost(l->right());
+				}
+				case ASTNode::BRANCH:
+				{
+					SHARED_PTR<BranchASTNode> b = STATIC_POINTER_CAST<BranchASTNode>(ast);
+					return 2 + cost(b->condition()) + std::max(cost(b->yes()), cost(b->no()));
+				}
+				default:
+					return 0;
+			}
 		}
 
+		// Subtrees costing no more than this are evaluated eagerly rather than behind a branch
+		static const unsigned int SelectCost = 8;
 
 	private:
 
 		// Convert AST into LLVM
 		llvm::Value *generateLLVM(ASTNodePtr ast)
 		{
+			const bool integer = LLVMTraits<T>::integer;
+
 			if(!ast)
 			{
 				throw EvaluatorException("No abstract syntax tree provided");
 			}
 			if(ast->type() == ASTNode::NUMBER)
 			{
-				SHARED_PTR<NumberASTNode<float> > n = STATIC_POINTER_CAST<NumberASTNode<float> >(ast);
-				return llvm::ConstantFP::get(m_context, llvm::APFloat(n->value()));
+				SHARED_PTR<NumberASTNode<T> > n = STATIC_POINTER_CAST<NumberASTNode<T> >(ast);
+				return LLVMTraits<T>::constant(m_context, n->value());
 			}
 			else if(ast->type() == ASTNode::VARIABLE)
 			{
-				SHARED_PTR<VariableASTNode<float> > v = STATIC_POINTER_CAST<VariableASTNode<float> >(ast);
+				SHARED_PTR<VariableASTNode<T> > v = STATIC_POINTER_CAST<VariableASTNode<T> >(ast);
 				std::string variable = v->variable();
 
-				// Put the memory location of the variable from the map, into an LLVM constant
-				llvm::Value *location = llvm::ConstantInt::get(llvm::Type::getIntNTy(m_context, sizeof(uintptr_t)*8), (uintptr_t) &m_map->at(variable));
-				// Cast it to pointer
-				llvm::Value *ptr = m_builder.CreateIntToPtr(location, llvm::Type::getFloatPtrTy(m_context));
-				// Then dereference and load the pointer value
-				llvm::Value *gep = m_builder.CreateGEP(ptr, llvm::ConstantInt::get(m_context, llvm::APInt(32, 0)), "geptmp");
-				llvm::Value *load = m_builder.CreateLoad(gep, "loadtmp");
-
-				return load;
+				// Every variable is loaded from its slot or input array up front
+				std::map<std::string, llvm::Value*>::iterator value = m_values.find(variable);
+				if (value == m_values.end())
+				{
+					throw EvaluatorException("Variable missing from the compiled variable list");
+				}
+				return value->second;
 			}
 			else if (ast->type() == ASTNode::OPERATION)
 			{
 				SHARED_PTR<OperationASTNode> op = STATIC_POINTER_CAST<OperationASTNode>(ast);
 
-				llvm::Value *v1 = generateLLVM(op->right()); // the operators are switched thanks to rpn notation
-				llvm::Value *v2 = generateLLVM(op->left());
+				llvm::Value *v1 = toValue(generateLLVM(op->right())); // the operators are switched thanks to rpn notation
+				llvm::Value *v2 = toValue(generateLLVM(op->left()));
 				switch(op->operation())
 				{
-					case OperationASTNode::PLUS:  return m_builder.CreateFAdd(v1, v2, "addtmp");
-					case OperationASTNode::MINUS: return m_builder.CreateFSub(v1, v2, "subtmp");
-					case OperationASTNode::MUL:   return m_builder.CreateFMul(v1, v2, "multmp");
-					case OperationASTNode::DIV:   return m_builder.CreateFDiv(v1, v2, "divtmp");
-					case OperationASTNode::POW:
-					{
-						// Pow operator is defined in an intrinsic, so implement as a function call
-						std::vector<llvm::Type*> arg_types(2, llvm::Type::getFloatTy(m_context)); // args are 2 floats
-						return m_builder.CreateCall2(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::pow, arg_types), v1, v2, "powtmp");
-					}
-					case OperationASTNode::MOD:   return m_builder.CreateFRem(v1, v2, "modtmp");
+					case OperationASTNode::PLUS:  return integer ? m_builder.CreateAdd(v1, v2, "addtmp")  : m_builder.CreateFAdd(v1, v2, "addtmp");
+					case OperationASTNode::MINUS: return integer ? m_builder.CreateSub(v1, v2, "subtmp")  : m_builder.CreateFSub(v1, v2, "subtmp");
+					case OperationASTNode::MUL:   return integer ? m_builder.CreateMul(v1, v2, "multmp")  : m_builder.CreateFMul(v1, v2, "multmp");
+					case OperationASTNode::DIV:   return integer ? m_builder.CreateSDiv(v1, divisor(v2), "divtmp") : m_builder.CreateFDiv(v1, v2, "divtmp");
+					case OperationASTNode::POW:   return power(v1, v2);
+					case OperationASTNode::MOD:   return integer ? m_builder.CreateSRem(v1, divisor(v2), "modtmp") : m_builder.CreateFRem(v1, v2, "modtmp");
 					default: throw EvaluatorException("Unknown operator in syntax tree");
 				}
 			}
@@ -354,33 +1448,39 @@ class LLVMEvaluator
 			{
 				SHARED_PTR<Function1ASTNode> f = STATIC_POINTER_CAST<Function1ASTNode>(ast);
 
-				llvm::Value *v1 = generateLLVM(f->left());
-				std::vector<llvm::Type*> arg_types(1, llvm::Type::getFloatTy(m_context)); // args are 1 float
+				llvm::Value *v1 = toValue(generateLLVM(f->left()));
+				if (integer && (f->function() == Function1ASTNode::CEIL || f->function() == Function1ASTNode::FLOOR))
+				{
+					// Integers are already rounded
+					return v1;
+				}
+
+				v1 = toReal(v1);
 				switch(f->function())
 				{
-					case Function1ASTNode::SIN:   return m_builder.CreateCall(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::sin, arg_types), v1, "sintmp");
-					case Function1ASTNode::COS:   return m_builder.CreateCall(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::cos, arg_types), v1, "costmp");
-					//case Function1ASTNode::TAN: return m_builder.CreateCall(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::tan, arg_types), v1 ,"tantmp");
+					case Function1ASTNode::SIN:   return fromReal(intrinsic(llvm::Intrinsic::sin, v1, "sintmp"));
+					case Function1ASTNode::COS:   return fromReal(intrinsic(llvm::Intrinsic::cos, v1, "costmp"));
+					//case Function1ASTNode::TAN: return fromReal(intrinsic(llvm::Intrinsic::tan, v1, "tantmp"));
 					case Function1ASTNode::TAN:
 					{
 						// No tan operator in LLVM 3.2. Have to use sin/cos
-						llvm::Value *sin = m_builder.CreateCall(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::sin, arg_types), v1, "sintmp");
-						llvm::Value *cos = m_builder.CreateCall(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::cos, arg_types), v1, "costmp");
-						return m_builder.CreateFDiv(sin, cos, "tantmp");
+						llvm::Value *sin = intrinsic(llvm::Intrinsic::sin, v1, "sintmp");
+						llvm::Value *cos = intrinsic(llvm::Intrinsic::cos, v1, "costmp");
+						return fromReal(m_builder.CreateFDiv(sin, cos, "tantmp"));
 					}
-					case Function1ASTNode::SQRT:  return m_builder.CreateCall(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::sqrt, arg_types), v1, "sqrttmp");
-					case Function1ASTNode::LOG:   return m_builder.CreateCall(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::log, arg_types), v1, "logtmp");
-					case Function1ASTNode::LOG2:  return m_builder.CreateCall(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::log2, arg_types), v1, "log2tmp");
-					case Function1ASTNode::LOG10: return m_builder.CreateCall(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::log10, arg_types), v1, "log10tmp");
-					//case Function1ASTNode::CEIL:  return m_builder.CreateCall(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::ceil, arg_types), v1, "ceiltmp");
+					case Function1ASTNode::SQRT:  return fromReal(intrinsic(llvm::Intrinsic::sqrt, v1, "sqrttmp"));
+					case Function1ASTNode::LOG:   return fromReal(intrinsic(llvm::Intrinsic::log, v1, "logtmp"));
+					case Function1ASTNode::LOG2:  return fromReal(intrinsic(llvm::Intrinsic::log2, v1, "log2tmp"));
+					case Function1ASTNode::LOG10: return fromReal(intrinsic(llvm::Intrinsic::log10, v1, "log10tmp"));
+					//case Function1ASTNode::CEIL:  return intrinsic(llvm::Intrinsic::ceil, v1, "ceiltmp");
 					case Function1ASTNode::CEIL:
 					{
 						// No ceil operator in LLVM 3.2. Have to use floor +1
-						llvm::Value *floor = m_builder.CreateCall(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::floor, arg_types), v1, "floortmp");
-						llvm::Value *one = llvm::ConstantFP::get(m_context, llvm::APFloat(1.0f));
+						llvm::Value *floor = intrinsic(llvm::Intrinsic::floor, v1, "floortmp");
+						llvm::Value *one = llvm::ConstantFP::get(v1->getType(), 1.0);
 						return m_builder.CreateFAdd(floor, one, "ceiltmp");
 					}
-					case Function1ASTNode::FLOOR: return m_builder.CreateCall(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::floor, arg_types), v1, "floortmp");
+					case Function1ASTNode::FLOOR: return intrinsic(llvm::Intrinsic::floor, v1, "floortmp");
 					default: throw EvaluatorException("Unknown function in syntax tree");
 				}
 			}
@@ -388,94 +1488,121 @@ class LLVMEvaluator
 			{
 				SHARED_PTR<Function2ASTNode> f = STATIC_POINTER_CAST<Function2ASTNode>(ast);
 
-				llvm::Value *v1 = generateLLVM(f->right()); // the operators are switched thanks to rpn notation
-				llvm::Value *v2 = generateLLVM(f->left());
+				llvm::Value *v1 = toValue(generateLLVM(f->right())); // the operators are switched thanks to rpn notation
+				llvm::Value *v2 = toValue(generateLLVM(f->left()));
 				switch(f->function())
 				{
 					case Function2ASTNode::MIN:  
 					{
-						// Min is 2 operations, Ordered Greater Than, then select
-						llvm::Value *gt = m_builder.CreateFCmpOGT(v1, v2, "fogttmp");
+						// Min is 2 operations, Greater Than, then select
+						llvm::Value *gt = integer ? m_builder.CreateICmpSGT(v1, v2, "gttmp") : m_builder.CreateFCmpOGT(v1, v2, "fogttmp");
 						return m_builder.CreateSelect(gt, v2, v1, "mintmp");
 					}
 					case Function2ASTNode::MAX:
 					{
-						// Max is 2 operations, Ordered Greater Than, then select
-						llvm::Value *gt = m_builder.CreateFCmpOGT(v1, v2, "fogttmp");
+						// Max is 2 operations, Greater Than, then select
+						llvm::Value *gt = integer ? m_builder.CreateICmpSGT(v1, v2, "gttmp") : m_builder.CreateFCmpOGT(v1, v2, "fogttmp");
 						return m_builder.CreateSelect(gt, v1, v2, "maxtmp");
 					}
-					case Function2ASTNode::POW: 
-					{
-						// Pow operator is defined in an intrinsic, so implement as a function call
-						std::vector<llvm::Type*> arg_types(2, llvm::Type::getFloatTy(m_context)); // args are 2 floats
-						return m_builder.CreateCall2(llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::pow, arg_types), v1, v2, "powtmp");
-					}
+					case Function2ASTNode::POW:  return power(v1, v2);
 					default: throw EvaluatorException("Unknown function in syntax tree");
 				}
 			}
 			else if (ast->type() == ASTNode::COMPARISON)
 			{
 				SHARED_PTR<ComparisonASTNode> c = STATIC_POINTER_CAST<ComparisonASTNode>(ast);
-				llvm::Value *v1 = generateLLVM(c->right()); // the operators are switched thanks to rpn notation
-				llvm::Value *v2 = generateLLVM(c->left());
+				llvm::Value *v1 = toValue(generateLLVM(c->right())); // the operators are switched thanks to rpn notation
+				llvm::Value *v2 = toValue(generateLLVM(c->left()));
 				switch(c->comparison())
 				{
-					case ComparisonASTNode::EQUAL:              return m_builder.CreateFCmpOEQ(v1, v2, "foeqtmp");
-					case ComparisonASTNode::NOT_EQUAL:          return m_builder.CreateFCmpONE(v1, v2, "fonetmp");
-					case ComparisonASTNode::GREATER_THAN:       return m_builder.CreateFCmpOGT(v1, v2, "fogttmp");
-					case ComparisonASTNode::GREATER_THAN_EQUAL: return m_builder.CreateFCmpOGE(v1, v2, "fogetmp");
-					case ComparisonASTNode::LESS_THAN:          return m_builder.CreateFCmpOLT(v1, v2, "folttmp");
-					case ComparisonASTNode::LESS_THAN_EQUAL:    return m_builder.CreateFCmpOLE(v1, v2, "foletmp");
+					case ComparisonASTNode::EQUAL:              return integer ? m_builder.CreateICmpEQ(v1, v2, "eqtmp")  : m_builder.CreateFCmpOEQ(v1, v2, "foeqtmp");
+					case ComparisonASTNode::NOT_EQUAL:          return integer ? m_builder.CreateICmpNE(v1, v2, "netmp")  : m_builder.CreateFCmpUNE(v1, v2, "funetmp");
+					case ComparisonASTNode::GREATER_THAN:       return integer ? m_builder.CreateICmpSGT(v1, v2, "gttmp") : m_builder.CreateFCmpOGT(v1, v2, "fogttmp");
+					case ComparisonASTNode::GREATER_THAN_EQUAL: return integer ? m_builder.CreateICmpSGE(v1, v2, "getmp") : m_builder.CreateFCmpOGE(v1, v2, "fogetmp");
+					case ComparisonASTNode::LESS_THAN:          return integer ? m_builder.CreateICmpSLT(v1, v2, "lttmp") : m_builder.CreateFCmpOLT(v1, v2, "folttmp");
+					case ComparisonASTNode::LESS_THAN_EQUAL:    return integer ? m_builder.CreateICmpSLE(v1, v2, "letmp") : m_builder.CreateFCmpOLE(v1, v2, "foletmp");
 					default: throw EvaluatorException("Unknown comparison in syntax tree");
 				}
 			}
 			else if (ast->type() == ASTNode::LOGICAL)
 			{
 				SHARED_PTR<LogicalASTNode> l = STATIC_POINTER_CAST<LogicalASTNode>(ast);
-				llvm::Value *v1 = generateLLVM(l->right()); // the operators are switched thanks to rpn notation
-				llvm::Value *v2 = generateLLVM(l->left());
-				switch(l->operation())
+				llvm::Value *v1 = toBool(generateLLVM(l->right())); // the operators are switched thanks to rpn notation
+				if (l->operation() != LogicalASTNode::AND && l->operation() != LogicalASTNode::OR)
+				{
+					throw EvaluatorException("Unknown logical operator in syntax tree");
+				}
+				bool isAnd = l->operation() == LogicalASTNode::AND;
+
+				if (m_eager || cost(l->left()) <= SelectCost)
+				{
+					m_speculated++;
+					llvm::Value *v2 = toBool(generateLLVM(l->left()));
+					m_speculated--;
+					return isAnd ? m_builder.CreateAnd(v1, v2, "andtmp") : m_builder.CreateOr(v1, v2, "ortmp");
+				}
+
+				// Short circuit, the second operand is only worth evaluating when it can change the result
+				llvm::Function *fun = m_builder.GetInsertBlock()->getParent();
+				llvm::BasicBlock *firstBB = m_builder.GetInsertBlock();
+				llvm::BasicBlock *secondBB = llvm::BasicBlock::Create(m_context, isAnd ? "andrhs" : "orrhs", fun);
+				llvm::BasicBlock *mergeBB = llvm::BasicBlock::Create(m_context, isAnd ? "andcont" : "orcont", fun);
+				if (isAnd)
+				{
+					m_builder.CreateCondBr(v1, secondBB, mergeBB);
+				}
+				else
 				{
-					case LogicalASTNode::AND: return m_builder.CreateAnd(v1, v2, "andtmp");
-					case LogicalASTNode::OR:  return m_builder.CreateOr(v1, v2, "ortmp");
-					default: throw EvaluatorException("Unknown logical operator in syntax tree");
+					m_builder.CreateCondBr(v1, mergeBB, secondBB);
 				}
+
+				m_builder.SetInsertPoint(secondBB);
+				llvm::Value *v2 = toBool(generateLLVM(l->left()));
+				secondBB = m_builder.GetInsertBlock();
+				m_builder.CreateBr(mergeBB);
+
+				m_builder.SetInsertPoint(mergeBB);
+				llvm::PHINode *PN = m_builder.CreatePHI(llvm::Type::getInt1Ty(m_context), 2, isAnd ? "andtmp" : "ortmp");
+				PN->addIncoming(v1, firstBB);
+				PN->addIncoming(v2, secondBB);
+				return PN;
 			}
 			else if (ast->type() == ASTNode::BRANCH)
 			{
 				SHARED_PTR<BranchASTNode> b = STATIC_POINTER_CAST<BranchASTNode>(ast);
 
-				llvm::Value *cond = generateLLVM(b->condition());
-				// If condition is a number, coerce it to bool
-				if (cond->getType() == llvm::Type::getFloatTy(m_context))
+				llvm::Value *cond = toBool(generateLLVM(b->condition()));
+
+				// Cheap arms are computed up front and picked with a select, which can't be
+				// mispredicted. The batch kernel always does this so its loop stays vectorisable
+				if (m_eager || (cost(b->yes()) <= SelectCost && cost(b->no()) <= SelectCost))
 				{
-					cond = m_builder.CreateFCmpONE(cond, llvm::ConstantFP::get(m_context, llvm::APFloat(0.0f)), "ifcond");
+					m_speculated++;
+					llvm::Value *yes = toValue(generateLLVM(b->yes()));
+					llvm::Value *no  = toValue(generateLLVM(b->no()));
+					m_speculated--;
+					return m_builder.CreateSelect(cond, yes, no, "iftmp");
 				}
-				llvm::Value *yes  = generateLLVM(b->yes());
-				llvm::Value *no   = generateLLVM(b->no());
 
+				// Otherwise only the arm taken is evaluated, weighted by the profile if there is one
 				llvm::Function *fun = m_builder.GetInsertBlock()->getParent();
 				llvm::BasicBlock *thenBB  = llvm::BasicBlock::Create(m_context, "then", fun);
-				llvm::BasicBlock *elseBB  = llvm::BasicBlock::Create(m_context, "else");
-				llvm::BasicBlock *mergeBB = llvm::BasicBlock::Create(m_context, "ifcont");
+				llvm::BasicBlock *elseBB  = llvm::BasicBlock::Create(m_context, "else", fun);
+				llvm::BasicBlock *mergeBB = llvm::BasicBlock::Create(m_context, "ifcont", fun);
+				m_builder.CreateCondBr(cond, thenBB, elseBB, branchWeights(ast.get()));
 
-				m_builder.CreateCondBr(cond, thenBB, elseBB);
 				m_builder.SetInsertPoint(thenBB);
-	
+				llvm::Value *yes = toValue(generateLLVM(b->yes()));
+				thenBB = m_builder.GetInsertBlock();
 				m_builder.CreateBr(mergeBB);
 
-				// emit else block
-				thenBB = m_builder.GetInsertBlock();
-				fun->getBasicBlockList().push_back(elseBB);
 				m_builder.SetInsertPoint(elseBB);
-
-				m_builder.CreateBr(mergeBB);
+				llvm::Value *no = toValue(generateLLVM(b->no()));
 				elseBB = m_builder.GetInsertBlock();
+				m_builder.CreateBr(mergeBB);
 
-				// emit the merge block
-				fun->getBasicBlockList().push_back(mergeBB);
 				m_builder.SetInsertPoint(mergeBB);
-				llvm::PHINode *PN = m_builder.CreatePHI(llvm::Type::getFloatTy(m_context), 2, "iftmp");
+				llvm::PHINode *PN = m_builder.CreatePHI(m_type, 2, "iftmp");
 				PN->addIncoming(yes, thenBB);
 				PN->addIncoming(no, elseBB);
 				return PN;
@@ -485,19 +1612,25 @@ class LLVMEvaluator
 
 		}
 
-		static llvm::sys::SmartMutex<false>& mutex()
-		{
-			static llvm::sys::SmartMutex<false> m_mutex; return m_mutex;
-		}
-		
-
-		llvm::LLVMContext m_context;
+		LLVMSession *m_ownedSession;
+		SHARED_PTR<LLVMSession> m_sharedSession; // released after every other member
+		LLVMSession *m_session;
+		llvm::LLVMContext &m_context;
 		llvm::Module *m_module;
 		llvm::IRBuilder<> m_builder;
-		llvm::ExecutionEngine *m_engine;
-		llvm::FunctionPassManager m_fpm;
+		llvm::Type *m_type;
 		llvm::Function *m_function;
+		Function m_evaluate;
+		llvm::Function *m_kernelFunction;
+		Kernel m_kernel;
 		VariableMap *m_map;
+		const BranchProfile *m_profile; // only set while compiling
+		bool m_eager; // every arm is evaluated and selected between, for the batch kernel
+		unsigned int m_speculated; // depth of arms being evaluated whether or not they're taken
+		ASTNodePtr m_ast;
+		std::vector<std::string> m_variables;
+		std::vector<T*> m_sources; // map entries of the variables, once bound
+		std::map<std::string, llvm::Value*> m_values; // variables loaded by the function being generated
 
 };
 
@@ -1,6 +1,7 @@
 #ifndef EXCEPTION_H
 #define EXCEPTION_H
 
+#include <cstddef>
 #include <exception>
 #include <stdexcept>
 
@@ -10,10 +11,22 @@ namespace expr
 class Exception : public std::runtime_error
 {
 	public:
-		Exception(const char* message)
+		static const size_t npos = (size_t) -1;
+
+		Exception(const char* message, size_t position=npos)
 			: std::runtime_error(message)
+			, m_position(position)
 		{
 		}
+
+		// Character offset into the expression text the error relates to, or npos if unknown
+		size_t position() const
+		{
+			return m_position;
+		}
+
+	protected:
+		size_t m_position;
 };
 
 } //namespace expr
@@ -2,8 +2,13 @@
 #define GENERATOR_H
 
 #include <iostream>
+#include <sstream>
+#include <limits>
+#include <map>
 #include <set>
+#include <vector>
 #include "AST.h"
+#include "Canonical.h"
 #include "Memory.h"
 #include "Exception.h"
 
@@ -27,179 +32,993 @@ class ShaderGenerator
 		{
 			
 			GLSLv1_0,
-			GLSLv1_3
+			GLSLv1_3,
+			C,       // C99, for compiling expressions ahead of time
+			CPP,     // C++, as C but using the overloads in std
+			OPENCL_C // OpenCL C, for batch evaluation on a compute device
 		};
+
+		// How generateModule passes the variables in
+		enum Packing
+		{
+			UNIFORM_BLOCK, // a std140 uniform block, needs GLSL 1.40 or ARB_uniform_buffer_object
+			VEC4_ARRAY     // a uniform array of vec4s, unpacked into locals by the function
+		};
+
+		// Where a variable lives in the buffer backing the inputs of a module
+		struct Binding
+		{
+			std::string variable;
+			size_t index;  // in scalars
+			size_t offset; // in bytes
+		};
+
+		// A complete shader module: the uniform declaration and the function. The
+		// variables are packed into a single buffer, so the host uploads all of
+		// them with one buffer or uniform array update
+		struct Module
+		{
+			std::string source;
+			std::string block;             // name of the uniform block or array
+			std::vector<Binding> bindings; // in buffer order
+			size_t size;                   // bytes of buffer, whole vec4s
+
+			// Fills a buffer of size bytes with the values of the bound variables
+			void pack(const std::map<std::string, T> &values, T *buffer) const
+			{
+				std::fill(buffer, buffer + size / sizeof(T), T());
+				for (size_t i=0; i<bindings.size(); i++)
+				{
+					typename std::map<std::string, T>::const_iterator it = values.find(bindings[i].variable);
+					if (it == values.end())
+					{
+						std::string message = "No value for shader variable '" + bindings[i].variable + "'";
+						throw GeneratorException(message.c_str());
+					}
+					buffer[bindings[i].index] = it->second;
+				}
+			}
+		};
+
+		ShaderGenerator()
+			: m_language(GLSLv1_3)
+			, m_function(false)
+			, m_temporaries(0)
+			, m_minMax(false)
+		{
+		}
+
+		// Generates a single expression. Operands that some operators need more than
+		// once are repeated, so nested modulos grow the source quickly; prefer
+		// generateFunction for those
 		std::string generate(ASTNodePtr ast, Language lang=GLSLv1_3)
+		{
+			std::ostringstream ss;
+			generate(ast, ss, lang);
+			return ss.str();
+		}
+
+		// As generate, appending to the given stream
+		void generate(ASTNodePtr ast, std::ostream &out, Language lang=GLSLv1_3)
 		{
 			m_language = lang;
+			m_function = false;
 
 			if(ast == NULL)
 			{
 				throw GeneratorException("Incorrect abstract syntax tree");
 			}
 
-			std::string code = generateSubtree(ast);
-			return code;
+			FormatGuard guard(out);
+			generateSubtree(ast, out);
+		}
+
+		// Generates a function taking no arguments and returning the value of the
+		// expression. Repeated operands and subtrees shared between several parents
+		// are each computed once into a local temporary, so the source stays linear
+		// in the size of the syntax tree. Those under a ternary or logical arm are
+		// repeated instead, as they may only be evaluated when the arm is taken
+		std::string generateFunction(ASTNodePtr ast, const std::string &name="calculate", Language lang=GLSLv1_3)
+		{
+			std::ostringstream ss;
+			generateFunction(ast, ss, name, lang);
+			return ss.str();
+		}
+
+		// As generateFunction, appending to the given stream
+		void generateFunction(ASTNodePtr ast, std::ostream &out, const std::string &name="calculate", Language lang=GLSLv1_3)
+		{
+			writeFunction(ast, out, name, lang, NULL, "");
+		}
+
+		// Generates generateFunction's function along with a declaration of every
+		// variable it uses, packed as requested under the given block name
+		Module generateModule(ASTNodePtr ast, Packing packing=UNIFORM_BLOCK, const std::string &block="Inputs", const std::string &name="calculate", Language lang=GLSLv1_3)
+		{
+			if(ast == NULL)
+			{
+				throw GeneratorException("Incorrect abstract syntax tree");
+			}
+			if (packing == UNIFORM_BLOCK && lang == GLSLv1_0)
+			{
+				throw GeneratorException("GLSLv1_0 has no uniform blocks, use VEC4_ARRAY packing");
+			}
+
+			std::vector<std::string> variables;
+			collectVariables<T>(ast, variables);
+
+			// Scalars are tightly packed in both layouts, and either way the buffer
+			// is made of whole vec4s
+			Module module;
+			module.block = block;
+			for (size_t i=0; i<variables.size(); i++)
+			{
+				Binding binding;
+				binding.variable = variables[i];
+				binding.index = i;
+				binding.offset = i * sizeof(T);
+				module.bindings.push_back(binding);
+			}
+			size_t vectors = (variables.size() + 3) / 4;
+			module.size = vectors * 4 * sizeof(T);
+
+			// Neither uniform blocks nor arrays may be empty
+			std::ostringstream ss;
+			if (!variables.empty() && packing == UNIFORM_BLOCK)
+			{
+				ss << "layout(std140) uniform " << block << "\n{\n";
+				for (size_t i=0; i<variables.size(); i++)
+				{
+					ss << "\t" << type() << " " << variables[i] << ";\n";
+				}
+				ss << "};\n\n";
+			}
+			else if (!variables.empty())
+			{
+				ss << "uniform " << vectorType() << " " << block << "[" << vectors << "];\n\n";
+			}
+			writeFunction(ast, ss, name, lang, packing == VEC4_ARRAY ? &variables : NULL, block);
+			module.source = ss.str();
+			return module;
+		}
+
+		// Generates a C or C++ source file holding generateFunction's function,
+		// which takes the variables as arguments in the order of collectVariables.
+		// With batch set it's followed by name_batch, which evaluates n rows with
+		// the signature of LLVMEvaluator::Kernel in a loop the compiler may vectorise
+		std::string generateSource(ASTNodePtr ast, const std::string &name="calculate", Language lang=CPP, bool batch=true)
+		{
+			std::ostringstream ss;
+			generateSource(ast, ss, name, lang, batch);
+			return ss.str();
+		}
+
+		// As generateSource, appending to the given stream
+		void generateSource(ASTNodePtr ast, std::ostream &out, const std::string &name="calculate", Language lang=CPP, bool batch=true)
+		{
+			if (lang != C && lang != CPP)
+			{
+				throw GeneratorException("Source files can only be generated for C or C++");
+			}
+			if(ast == NULL)
+			{
+				throw GeneratorException("Incorrect abstract syntax tree");
+			}
+
+			std::vector<std::string> variables;
+			collectVariables<T>(ast, variables);
+
+			out << (lang == C ? "#include <math.h>\n#include <stddef.h>\n\n" : "#include <cmath>\n#include <cstddef>\n\n");
+			writeFunction(ast, out, name, lang, NULL, "");
+			if (!batch)
+			{
+				return;
+			}
+
+			const char *size = lang == C ? "size_t" : "std::size_t";
+			out << "\nvoid " << name << "_batch(const " << type() << " *const *inputs, " << type() << " *" << (lang == C ? "restrict" : "__restrict") << " out, " << size << " n)\n{\n";
+			if (lang == C)
+			{
+				out << "\tsize_t i;\n";
+			}
+			out << "#pragma omp simd\n";
+			out << "\tfor (" << (lang == C ? "" : "std::size_t ") << "i=0; i<n; i++)\n\t{\n";
+			out << "\t\tout[i] = " << name << "(";
+			for (size_t i=0; i<variables.size(); i++)
+			{
+				out << (i ? ", " : "") << "inputs[" << i << "][i]";
+			}
+			out << ");\n\t}\n}\n";
+		}
+
+		// Generates an OpenCL C program holding generateFunction's function and
+		// name_kernel, which evaluates one row per work item. The kernel arguments
+		// are one input buffer per variable in the order of collectVariables, the
+		// output buffer and the number of rows, which the global size may round up.
+		// OpenCL's math functions only take floating point, so integer kernels
+		// are limited to arithmetic, comparisons, min and max
+		std::string generateKernel(ASTNodePtr ast, const std::string &name="calculate")
+		{
+			std::ostringstream ss;
+			generateKernel(ast, ss, name);
+			return ss.str();
+		}
+
+		// As generateKernel, appending to the given stream
+		void generateKernel(ASTNodePtr ast, std::ostream &out, const std::string &name="calculate")
+		{
+			if(ast == NULL)
+			{
+				throw GeneratorException("Incorrect abstract syntax tree");
+			}
+
+			if (std::numeric_limits<T>::is_integer && usesMath(ast))
+			{
+				throw GeneratorException("OpenCL has no integer math functions, generate the kernel for float or double instead");
+			}
+
+			std::vector<std::string> variables;
+			collectVariables<T>(ast, variables);
+
+			// Double precision is optional in OpenCL 1.x
+			if (std::numeric_limits<T>::digits == std::numeric_limits<double>::digits && !std::numeric_limits<T>::is_integer)
+			{
+				out << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n\n";
+			}
+			writeFunction(ast, out, name, OPENCL_C, NULL, "");
+
+			out << "\n__kernel void " << name << "_kernel(";
+			for (size_t i=0; i<variables.size(); i++)
+			{
+				out << "__global const " << type() << " *in" << i << ", ";
+			}
+			out << "__global " << type() << " *out, const unsigned int n)\n{\n";
+			out << "\tsize_t i = get_global_id(0);\n";
+			out << "\tif (i < n)\n\t{\n";
+			out << "\t\tout[i] = " << name << "(";
+			for (size_t i=0; i<variables.size(); i++)
+			{
+				out << (i ? ", " : "") << "in" << i << "[i]";
+			}
+			out << ");\n\t}\n}\n";
 		}
 
 	private:
-		std::string type()
+		// Writes the function for generateFunction, first loading the given
+		// variables from the vec4 array if there are any
+		void writeFunction(ASTNodePtr ast, std::ostream &out, const std::string &name, Language lang, const std::vector<std::string> *packed, const std::string &array)
+		{
+			m_language = lang;
+			m_function = true;
+			m_names.clear();
+			m_hoisted.clear();
+			m_temporaries = 0;
+
+			if(ast == NULL)
+			{
+				throw GeneratorException("Incorrect abstract syntax tree");
+			}
+
+			// Temporaries mustn't shadow a variable of the expression
+			std::vector<std::string> variables;
+			collectVariables<T>(ast, variables);
+			m_prefix = "t";
+			for (bool clash = true; clash; )
+			{
+				clash = false;
+				for (size_t i=0; i<variables.size() && !clash; i++)
+				{
+					clash = variables[i].compare(0, m_prefix.size(), m_prefix) == 0;
+				}
+				if (clash)
+				{
+					m_prefix += "_";
+				}
+			}
+
+			// Only subtrees which are evaluated whichever way the conditionals go can
+			// be computed up front, anything under a ternary or logical arm is left
+			// in place so it can't trap or have its cost paid when it isn't needed.
+			// Shader arithmetic never traps, so there every shared subtree is hoisted
+			// to keep the source linear in the size of the tree
+			std::map<const ASTNode*, unsigned int> references;
+			std::set<const ASTNode*> eager;
+			m_minMax = false;
+			countReferences(ast, references, eager, false);
+			for (std::map<const ASTNode*, unsigned int>::iterator it = references.begin(); it != references.end(); ++it)
+			{
+				if (it->second > 1 && (eager.count(it->first) || !cLike()))
+				{
+					m_hoisted.insert(it->first);
+				}
+			}
+
+			// min and max are helper functions in C like languages, so their operands
+			// are only written once without needing a temporary
+			m_helpers = name + "_";
+			if (m_minMax && cLike())
+			{
+				for (bool clash = true; clash; )
+				{
+					clash = false;
+					for (size_t i=0; i<variables.size() && !clash; i++)
+					{
+						clash = variables[i].compare(0, m_helpers.size(), m_helpers) == 0;
+					}
+					if (clash)
+					{
+						m_helpers += "_";
+					}
+				}
+				const char *qualifier = m_language == OPENCL_C ? "" : "static inline ";
+				out << qualifier << type() << " " << m_helpers << "min(" << type() << " a, " << type() << " b)\n{\n\treturn b < a ? b : a;\n}\n\n";
+				out << qualifier << type() << " " << m_helpers << "max(" << type() << " a, " << type() << " b)\n{\n\treturn a < b ? b : a;\n}\n\n";
+			}
+
+			// C and C++ functions take the variables as arguments, shaders read uniforms
+			FormatGuard guard(out);
+			out << type() << " " << name << "(";
+			for (size_t i=0; cLike() && i<variables.size(); i++)
+			{
+				out << (i ? ", " : "") << type() << " " << variables[i];
+			}
+			out << (m_language == C && variables.empty() ? "void" : "") << ")\n{\n";
+			for (size_t i=0; packed && i<packed->size(); i++)
+			{
+				out << "\t" << type() << " " << (*packed)[i] << " = " << array << "[" << i / 4 << "]." << "xyzw"[i % 4] << ";\n";
+			}
+			declareTemporaries(ast, out);
+			out << "\treturn ";
+			if (isBoolean(ast))
+			{
+				out << (cLike() ? "(" : "") << type() << (cLike() ? ")(" : "(");
+				generateSubtree(ast, out);
+				out << ")";
+			}
+			else
+			{
+				generateSubtree(ast, out);
+			}
+			out << ";\n}\n";
+
+			m_names.clear();
+			m_hoisted.clear();
+		}
+
+		static const char *type()
 		{
 			return "double";
 		}
 
-		std::string generateSubtree(ASTNodePtr ast)
+		// C like languages, which have fmod, log10 and no vector types
+		bool cLike() const
 		{
-			std::stringstream ss;
+			return m_language == C || m_language == CPP || m_language == OPENCL_C;
+		}
 
-			if(ast->type() == ASTNode::NUMBER)
+		// Name of a math library function for the current language, OpenCL's
+		// builtins are overloaded for every type already
+		void function(std::ostream &out, const char *name)
+		{
+			if (m_language == CPP)
 			{
-				SHARED_PTR<NumberASTNode<T> > n = STATIC_POINTER_CAST<NumberASTNode<T> >(ast);
-				ss << n->value();
-				if (type() == "float")
+				out << "std::";
+			}
+			out << name;
+			if (m_language == C && std::numeric_limits<T>::digits == std::numeric_limits<float>::digits && !std::numeric_limits<T>::is_integer)
+			{
+				out << "f";
+			}
+		}
+
+		// min and max are written as comparisons in C like languages, matching
+		// std::min and std::max rather than fmin and fmax when given a NaN
+		bool conditionalMinMax() const
+		{
+			return cLike();
+		}
+
+		// The math library works in floating point, so for integer types its
+		// results are truncated as the interpreter does
+		bool truncateMath() const
+		{
+			return cLike() && std::numeric_limits<T>::is_integer;
+		}
+
+		// Numbers are written with the stream's default formatting, whatever the
+		// caller has set on it
+		struct FormatGuard
+		{
+			FormatGuard(std::ostream &out)
+				: stream(out)
+				, flags(out.flags(std::ios_base::skipws | std::ios_base::dec))
+				, precision(out.precision(6))
+			{
+			}
+
+			~FormatGuard()
+			{
+				stream.flags(flags);
+				stream.precision(precision);
+			}
+
+			std::ostream &stream;
+			std::ios_base::fmtflags flags;
+			std::streamsize precision;
+		};
+
+		static bool isLeaf(ASTNodePtr ast)
+		{
+			return ast->type() == ASTNode::NUMBER || ast->type() == ASTNode::VARIABLE;
+		}
+
+		// Comparisons and logical operators produce a bool rather than a number
+		static bool isBoolean(ASTNodePtr ast)
+		{
+			return ast->type() == ASTNode::COMPARISON || ast->type() == ASTNode::LOGICAL;
+		}
+
+		// Whether any node calls into the math library, walked without recursion
+		// as the tree may be deep
+		static bool usesMath(ASTNodePtr ast)
+		{
+			std::vector<ASTNode*> pending(1, ast.get());
+			while (!pending.empty())
+			{
+				ASTNode *node = pending.back();
+				pending.pop_back();
+				if (node->type() == ASTNode::FUNCTION1 ||
+					(node->type() == ASTNode::FUNCTION2 && static_cast<Function2ASTNode*>(node)->function() == Function2ASTNode::POW) ||
+					(node->type() == ASTNode::OPERATION && static_cast<OperationASTNode*>(node)->operation() == OperationASTNode::POW))
+				{
+					return true;
+				}
+				for (size_t i=0; i<node->children(); i++)
+				{
+					pending.push_back(node->child(i).get());
+				}
+			}
+			return false;
+		}
+
+		// Counts the parents of every operator node, visiting shared subtrees only
+		// once. Operands of a modulo count twice, as they are repeated in its output.
+		// Nodes reached outside of every ternary and logical arm are put in eager
+		void countReferences(ASTNodePtr ast, std::map<const ASTNode*, unsigned int> &references, std::set<const ASTNode*> &eager, bool conditional)
+		{
+			if (!ast || isLeaf(ast))
+			{
+				return;
+			}
+			if (!conditional)
+			{
+				eager.insert(ast.get());
+			}
+			if (references[ast.get()]++)
+			{
+				return;
+			}
+			switch (ast->type())
+			{
+				case ASTNode::OPERATION:
+				{
+					SHARED_PTR<OperationASTNode> op = STATIC_POINTER_CAST<OperationASTNode>(ast);
+					countReferences(op->right(), references, eager, conditional);
+					countReferences(op->left(), references, eager, conditional);
+					if (op->operation() == OperationASTNode::MOD && !cLike())
+					{
+						m_hoisted.insert(op->right().get());
+						m_hoisted.insert(op->left().get());
+					}
+					break;
+				}
+				case ASTNode::FUNCTION1:
+					countReferences(STATIC_POINTER_CAST<Function1ASTNode>(ast)->left(), references, eager, conditional);
+					break;
+				case ASTNode::FUNCTION2:
+				{
+					SHARED_PTR<Function2ASTNode> f = STATIC_POINTER_CAST<Function2ASTNode>(ast);
+					countReferences(f->right(), references, eager, conditional);
+					countReferences(f->left(), references, eager, conditional);
+					m_minMax = m_minMax || f->function() != Function2ASTNode::POW;
+					break;
+				}
+				case ASTNode::COMPARISON:
+				{
+					SHARED_PTR<ComparisonASTNode> c = STATIC_POINTER_CAST<ComparisonASTNode>(ast);
+					countReferences(c->right(), references, eager, conditional);
+					countReferences(c->left(), references, eager, conditional);
+					break;
+				}
+				case ASTNode::LOGICAL:
+				{
+					SHARED_PTR<LogicalASTNode> l = STATIC_POINTER_CAST<LogicalASTNode>(ast);
+					countReferences(l->right(), references, eager, conditional);
+					countReferences(l->left(), references, eager, true); // short circuited
+					break;
+				}
+				case ASTNode::BRANCH:
+				{
+					SHARED_PTR<BranchASTNode> b = STATIC_POINTER_CAST<BranchASTNode>(ast);
+					countReferences(b->condition(), references, eager, conditional);
+					countReferences(b->yes(), references, eager, true);
+					countReferences(b->no(), references, eager, true);
+					break;
+				}
+				default:
+					break;
+			}
+		}
+
+		// Declares the temporaries of a subtree, children before their parents
+		void declareTemporaries(ASTNodePtr ast, std::ostream &out)
+		{
+			if (!ast || isLeaf(ast) || m_names.count(ast.get()))
+			{
+				return;
+			}
+			switch (ast->type())
+			{
+				case ASTNode::OPERATION:
+				{
+					SHARED_PTR<OperationASTNode> op = STATIC_POINTER_CAST<OperationASTNode>(ast);
+					declareTemporaries(op->right(), out);
+					declareTemporaries(op->left(), out);
+					break;
+				}
+				case ASTNode::FUNCTION1:
+					declareTemporaries(STATIC_POINTER_CAST<Function1ASTNode>(ast)->left(), out);
+					break;
+				case ASTNode::FUNCTION2:
+				{
+					SHARED_PTR<Function2ASTNode> f = STATIC_POINTER_CAST<Function2ASTNode>(ast);
+					declareTemporaries(f->right(), out);
+					declareTemporaries(f->left(), out);
+					break;
+				}
+				case ASTNode::COMPARISON:
+				{
+					SHARED_PTR<ComparisonASTNode> c = STATIC_POINTER_CAST<ComparisonASTNode>(ast);
+					declareTemporaries(c->right(), out);
+					declareTemporaries(c->left(), out);
+					break;
+				}
+				case ASTNode::LOGICAL:
 				{
-					ss << "f";
+					SHARED_PTR<LogicalASTNode> l = STATIC_POINTER_CAST<LogicalASTNode>(ast);
+					declareTemporaries(l->right(), out);
+					declareTemporaries(l->left(), out);
+					break;
 				}
-				else if (type() == "double")
+				case ASTNode::BRANCH:
 				{
-					ss << "lf";
+					SHARED_PTR<BranchASTNode> b = STATIC_POINTER_CAST<BranchASTNode>(ast);
+					declareTemporaries(b->condition(), out);
+					declareTemporaries(b->yes(), out);
+					declareTemporaries(b->no(), out);
+					break;
 				}
-				return ss.str();
+				default:
+					break;
+			}
+
+			if (m_hoisted.count(ast.get()))
+			{
+				std::ostringstream name;
+				name << m_prefix << m_temporaries++;
+				out << "\t" << (isBoolean(ast) ? (m_language == C ? "int" : "bool") : type()) << " " << name.str() << " = ";
+				generateSubtree(ast, out);
+				out << ";\n";
+				m_names[ast.get()] = name.str();
+			}
+		}
+
+		// Source of an operand which is pasted into the output more than once. In a
+		// function it's always a leaf or a temporary, so this is cheap
+		std::string operand(ASTNodePtr ast)
+		{
+			std::ostringstream ss;
+			generateSubtree(ast, ss);
+			return ss.str();
+		}
+
+		void generateSubtree(ASTNodePtr ast, std::ostream &out)
+		{
+			if (m_function)
+			{
+				std::map<const ASTNode*, std::string>::iterator it = m_names.find(ast.get());
+				if (it != m_names.end())
+				{
+					out << it->second;
+					return;
+				}
+			}
+
+			if(ast->type() == ASTNode::NUMBER)
+			{
+				SHARED_PTR<NumberASTNode<T> > n = STATIC_POINTER_CAST<NumberASTNode<T> >(ast);
+				if (cLike())
+				{
+					number(out, n->value());
+					return;
+				}
+				out << n->value() << suffix();
+				return;
 			}
 			else if(ast->type() == ASTNode::VARIABLE)
 			{
 				SHARED_PTR<VariableASTNode<T> > v = STATIC_POINTER_CAST<VariableASTNode<T> >(ast);
-				std::string var = v->variable();
-				ss << var;
-				return ss.str();
+				out << v->variable();
+				return;
 			}
 			else if (ast->type() == ASTNode::OPERATION)
 			{
 				SHARED_PTR<OperationASTNode> op = STATIC_POINTER_CAST<OperationASTNode>(ast);
 
-				std::string v1 = generateSubtree(op->right()); // the operators are switched thanks to rpn notation
-				std::string v2 = generateSubtree(op->left());
+				// the operators are switched thanks to rpn notation
+				const char *infix = NULL;
 				switch(op->operation())
 				{
-					case OperationASTNode::PLUS:  return std::string("(") + v1 + "+" + v2 + ")";
-					case OperationASTNode::MINUS: return std::string("(") + v1 + "-" + v2 + ")";
-					case OperationASTNode::MUL:   return std::string("(") + v1 + "*" + v2 + ")";
-					case OperationASTNode::DIV:   return std::string("(") + v1 + "/" + v2 + ")";
-					case OperationASTNode::POW:   return std::string("pow(") + v1 + "," + v2 + ")";
+					case OperationASTNode::PLUS:  infix = "+"; break;
+					case OperationASTNode::MINUS: infix = "-"; break;
+					case OperationASTNode::MUL:   infix = "*"; break;
+					case OperationASTNode::DIV:   infix = "/"; break;
+					case OperationASTNode::POW:   call(out, "pow", op->right(), op->left()); return;
 					case OperationASTNode::MOD:
 					{
+						if (cLike())
+						{
+							if (std::numeric_limits<T>::is_integer)
+							{
+								infix = "%";
+								break;
+							}
+							call(out, "fmod", op->right(), op->left());
+							return;
+						}
+
+						std::string v1 = operand(op->right());
+						std::string v2 = operand(op->left());
 						if(m_language == GLSLv1_0)
 						{
 							// GLSLv1_0 has no trunc or fmod operator
 							// operation should return (v1 - v2 * ((v1/v2>0) ? floor(v1/v2) : ceil(v1/v2)))
-							return std::string("(") + v1 + " - " + v2 + "* ((" + v1 + "/" + v2 + ">0) ? floor(" + v1 + "/" + v2 + ") : ceil(" + v1 + "/" + v2 + ")))";
+							out << "(" << v1 << " - " << v2 << "* ((" << v1 << "/" << v2 << ">0) ? floor(" << v1 << "/" << v2 << ") : ceil(" << v1 << "/" << v2 << ")))";
 						}
 						else if (m_language == GLSLv1_3)
 						{
 							// GLSLv1_3 has no fmod operator
 							// operation should return (v1 - v2 * trunc(v1/v2))
-							return std::string("(") + v1 + " - " + v2 + " * trunc(" + v1 + "/" + v2 + "))";
+							out << "(" << v1 << " - " << v2 << " * trunc(" << v1 << "/" << v2 << "))";
+						}
+						else
+						{
+							out << "fmod(" << v1 << "," << v2 << ")";
 						}
-						return std::string("fmod(") + v1 + "," + v2 + ")";
+						return;
 					}
 					default: throw GeneratorException("Unknown operator in syntax tree");
 				}
+				out << "(";
+				generateSubtree(op->right(), out);
+				out << infix;
+				generateSubtree(op->left(), out);
+				out << ")";
+				return;
 			}
 			else if (ast->type() == ASTNode::FUNCTION1)
 			{
 				SHARED_PTR<Function1ASTNode> f = STATIC_POINTER_CAST<Function1ASTNode>(ast);
 
-				std::string v1 = generateSubtree(f->left());
+				const char *name = NULL;
 				switch(f->function())
 				{
-					case Function1ASTNode::SIN:   return std::string("sin(") + v1 + ")";
-					case Function1ASTNode::COS:   return std::string("cos(") + v1 + ")";
-					case Function1ASTNode::TAN:   return std::string("tan(") + v1 + ")";
-					case Function1ASTNode::SQRT:  return std::string("sqrt(") + v1 + ")";
-					case Function1ASTNode::LOG:   return std::string("log(") + v1 + ")";
-					case Function1ASTNode::LOG2:  return std::string("log2(") + v1 + ")";
+					case Function1ASTNode::SIN:   name = "sin"; break;
+					case Function1ASTNode::COS:   name = "cos"; break;
+					case Function1ASTNode::TAN:   name = "tan"; break;
+					case Function1ASTNode::SQRT:  name = "sqrt"; break;
+					case Function1ASTNode::LOG:   name = "log"; break;
+					case Function1ASTNode::LOG2:  name = "log2"; break;
 					case Function1ASTNode::LOG10:
 						if (m_language == GLSLv1_0 || m_language == GLSLv1_3)
 						{
 							// GLSLv1_0 and GLSLv1_3 have no log10 operator
 							// operation should return (log(v1)/log(10f))
-							return std::string("(log(") + v1 + ")/log(10f))";
+							out << "(log(";
+							generateSubtree(f->left(), out);
+							out << ")/log(10f))";
+							return;
 						}
-						return std::string("log10(") + v1 + ")";
-					case Function1ASTNode::CEIL:  return std::string("ceil(") + v1 + ")";
-					case Function1ASTNode::FLOOR: return std::string("floor(") + v1 + ")";
+						name = "log10";
+						break;
+					case Function1ASTNode::CEIL:  name = "ceil"; break;
+					case Function1ASTNode::FLOOR: name = "floor"; break;
 					default: throw GeneratorException("Unknown function in syntax tree");
 				}
+				out << (truncateMath() ? "((int)" : "");
+				if (cLike())
+				{
+					function(out, name);
+				}
+				else
+				{
+					out << name;
+				}
+				out << "(";
+				generateSubtree(f->left(), out);
+				out << ")";
+				out << (truncateMath() ? ")" : "");
+				return;
 			}
 			else if (ast->type() == ASTNode::FUNCTION2)
 			{
 				SHARED_PTR<Function2ASTNode> f = STATIC_POINTER_CAST<Function2ASTNode>(ast);
 
-				std::string v1 = generateSubtree(f->right()); // the operators are switched thanks to rpn notation
-				std::string v2 = generateSubtree(f->left());
+				// the operators are switched thanks to rpn notation
+				if (f->function() != Function2ASTNode::POW && conditionalMinMax())
+				{
+					bool min = f->function() == Function2ASTNode::MIN;
+					if (m_function)
+					{
+						out << m_helpers << (min ? "min(" : "max(");
+						generateSubtree(f->right(), out);
+						out << ",";
+						generateSubtree(f->left(), out);
+						out << ")";
+						return;
+					}
+					// As std::min and std::max, the first operand unless the other compares past it
+					std::string v1 = operand(f->right());
+					std::string v2 = operand(f->left());
+					if (min)
+					{
+						out << "(" << v2 << "<" << v1 << " ? " << v2 << " : " << v1 << ")";
+					}
+					else
+					{
+						out << "(" << v1 << "<" << v2 << " ? " << v2 << " : " << v1 << ")";
+					}
+					return;
+				}
 				switch(f->function())
 				{
-					case Function2ASTNode::MIN:  return std::string("min(") + v1 + "," + v2 + ")";
-					case Function2ASTNode::MAX:  return std::string("max(") + v1 + "," + v2 + ")";
-					case Function2ASTNode::POW:  return std::string("pow(") + v1 + "," + v2 + ")";
+					case Function2ASTNode::MIN:  call(out, "min", f->right(), f->left()); return;
+					case Function2ASTNode::MAX:  call(out, "max", f->right(), f->left()); return;
+					case Function2ASTNode::POW:  call(out, "pow", f->right(), f->left()); return;
 					default: throw GeneratorException("Unknown function in syntax tree");
 				}
 			}
 			else if (ast->type() == ASTNode::COMPARISON)
 			{
 				SHARED_PTR<ComparisonASTNode> c = STATIC_POINTER_CAST<ComparisonASTNode>(ast);
-				std::string v1 = generateSubtree(c->right()); // the operators are switched thanks to rpn notation
-				std::string v2 = generateSubtree(c->left());
+				const char *infix = NULL;
 				switch(c->comparison())
 				{
-					case ComparisonASTNode::EQUAL:              return v1 + "==" +  v2;
-					case ComparisonASTNode::NOT_EQUAL:          return v1 + "!=" +  v2;
-					case ComparisonASTNode::GREATER_THAN:       return v1 + ">"  +  v2;
-					case ComparisonASTNode::GREATER_THAN_EQUAL: return v1 + ">=" +  v2;
-					case ComparisonASTNode::LESS_THAN:          return v1 + "<"  +  v2;
-					case ComparisonASTNode::LESS_THAN_EQUAL:    return v1 + "<=" +  v2;
+					case ComparisonASTNode::EQUAL:              infix = "=="; break;
+					case ComparisonASTNode::NOT_EQUAL:          infix = "!="; break;
+					case ComparisonASTNode::GREATER_THAN:       infix = ">";  break;
+					case ComparisonASTNode::GREATER_THAN_EQUAL: infix = ">="; break;
+					case ComparisonASTNode::LESS_THAN:          infix = "<";  break;
+					case ComparisonASTNode::LESS_THAN_EQUAL:    infix = "<="; break;
 					default: throw GeneratorException("Unknown comparison in syntax tree");
 				}
+				// the operators are switched thanks to rpn notation
+				out << (cLike() ? "(" : "");
+				generateSubtree(c->right(), out);
+				out << infix;
+				generateSubtree(c->left(), out);
+				out << (cLike() ? ")" : "");
+				return;
 			}
 			else if (ast->type() == ASTNode::LOGICAL)
 			{
 				SHARED_PTR<LogicalASTNode> l = STATIC_POINTER_CAST<LogicalASTNode>(ast);
-				std::string v1 = generateSubtree(l->right()); // the operators are switched thanks to rpn notation
-				std::string v2 = generateSubtree(l->left());
+				const char *infix = NULL;
 				switch(l->operation())
 				{
-					case LogicalASTNode::AND: return v1 + "&&" +  v2;
-					case LogicalASTNode::OR:  return v1 + "||" +  v2;
+					case LogicalASTNode::AND: infix = "&&"; break;
+					case LogicalASTNode::OR:  infix = "||"; break;
 					default: throw GeneratorException("Unknown logical operator in syntax tree");
 				}
+				// the operators are switched thanks to rpn notation
+				out << (cLike() ? "(" : "");
+				generateSubtree(l->right(), out);
+				out << infix;
+				generateSubtree(l->left(), out);
+				out << (cLike() ? ")" : "");
+				return;
 			}
 			else if (ast->type() == ASTNode::BRANCH)
 			{
 				SHARED_PTR<BranchASTNode> b = STATIC_POINTER_CAST<BranchASTNode>(ast);
-				std::string condition = generateSubtree(b->condition());
-				std::string yes = generateSubtree(b->yes());
-				std::string no = generateSubtree(b->no());
-
-				return std::string("((bool(") + condition + ")) ? " + yes + ":" + no + ")";
+				out << (cLike() ? "((" : "((bool(");
+				generateSubtree(b->condition(), out);
+				out << (cLike() ? ") ? " : ")) ? ");
+				generateSubtree(b->yes(), out);
+				out << ":";
+				generateSubtree(b->no(), out);
+				out << ")";
+				return;
 			}
 
 			throw GeneratorException("Incorrect syntax tree!");
 		}
 
+		void call(std::ostream &out, const char *name, ASTNodePtr first, ASTNodePtr second)
+		{
+			out << (truncateMath() ? "((int)" : "");
+			if (cLike())
+			{
+				function(out, name);
+			}
+			else
+			{
+				out << name;
+			}
+			out << "(";
+			generateSubtree(first, out);
+			out << ",";
+			generateSubtree(second, out);
+			out << ")";
+			out << (truncateMath() ? ")" : "");
+		}
+
+		// C literals round trip the value, always have a decimal point so the
+		// suffix applies, and are bracketed when negative
+		void number(std::ostream &out, T value)
+		{
+			if (value != value || value - value != value - value)
+			{
+				out << (value != value ? "NAN" : value > 0 ? "INFINITY" : "(-INFINITY)");
+				return;
+			}
+
+			std::ostringstream ss;
+			ss.precision(std::numeric_limits<T>::digits10 + 3);
+			ss << value;
+			std::string literal = ss.str();
+			if (!std::numeric_limits<T>::is_integer && literal.find_first_of(".e") == std::string::npos)
+			{
+				literal += ".0";
+			}
+			if (!std::numeric_limits<T>::is_integer && std::numeric_limits<T>::digits == std::numeric_limits<float>::digits)
+			{
+				literal += "f";
+			}
+			if (value < 0)
+			{
+				out << "(" << literal << ")";
+				return;
+			}
+			out << literal;
+		}
+
+		// Literal suffix matching type()
+		static const char *suffix()
+		{
+			return "lf";
+		}
+
+		// Four component vector of type()
+		static const char *vectorType()
+		{
+			return "dvec4";
+		}
+
+	private:
+		Language m_language;
+		bool m_function;                              // generating a function body rather than an expression
+		std::map<const ASTNode*, std::string> m_names; // nodes already held in a temporary
+		std::set<const ASTNode*> m_hoisted;           // nodes to compute into a temporary
+		unsigned int m_temporaries;
+		std::string m_prefix;  // of the temporaries
+		std::string m_helpers; // prefix of the min and max helper functions
+		bool m_minMax;         // the expression uses min or max
+};
+
+// Generated shader functions keyed on the canonical form of their expression,
+// so expressions which only differ in operand order or number formatting share
+// one function and, once the caller has compiled it, one program
+template <typename T>
+class ShaderCache
+{
+	public:
+		typedef typename ShaderGenerator<T>::Language Language;
+
+		struct Entry
+		{
+			ASTNodePtr ast;      // canonical form the source was generated from
+			std::string source;  // function generated by generateFunction
+			unsigned int program; // for the caller, 0 until it stores a compiled program
+		};
+
+		ShaderCache(const std::string &name="calculate", Language lang=ShaderGenerator<T>::GLSLv1_3)
+			: m_name(name)
+			, m_language(lang)
+		{
+		}
+
+		// Entry for an expression equivalent to ast, generating its source if it
+		// is the first of its kind. Entries stay at the same address until clear()
+		Entry &lookup(ASTNodePtr ast, bool *inserted=NULL)
+		{
+			ASTHash hash;
+			ASTNodePtr canonical = canonicalize<T>(ast, &hash);
+
+			// Different trees may share a hash, so the tree has to match as well
+			std::pair<typename Entries::iterator, typename Entries::iterator> range = m_entries.equal_range(hash);
+			for (typename Entries::iterator it = range.first; it != range.second; ++it)
+			{
+				if (structurallyEqual<T>(it->second.ast, canonical))
+				{
+					if (inserted)
+					{
+						*inserted = false;
+					}
+					return it->second;
+				}
+			}
+
+			Entry entry;
+			entry.ast = canonical;
+			entry.source = m_generator.generateFunction(canonical, m_name, m_language);
+			entry.program = 0;
+			if (inserted)
+			{
+				*inserted = true;
+			}
+			return m_entries.insert(std::make_pair(hash, entry))->second;
+		}
+
+		size_t size() const
+		{
+			return m_entries.size();
+		}
+
+		void clear()
+		{
+			m_entries.clear();
+		}
+
 	private:
+		typedef std::multimap<ASTHash, Entry> Entries;
+
+		std::string m_name;
 		Language m_language;
+		ShaderGenerator<T> m_generator;
+		Entries m_entries;
 };
 
-template <> std::string ShaderGenerator<int>::type()
+template <> inline const char *ShaderGenerator<int>::type()
 {
 	return "int";
 }
 
-template <> std::string ShaderGenerator<float>::type()
+template <> inline const char *ShaderGenerator<float>::type()
 {
 	return "float";
 }
 
+template <> inline const char *ShaderGenerator<int>::vectorType()
+{
+	return "ivec4";
+}
+
+template <> inline const char *ShaderGenerator<float>::vectorType()
+{
+	return "vec4";
+}
+
+template <> inline const char *ShaderGenerator<int>::suffix()
+{
+	return "";
+}
+
+template <> inline const char *ShaderGenerator<float>::suffix()
+{
+	return "f";
+}
+
 } // namespace expr
 
 #endif
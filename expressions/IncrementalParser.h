@@ -0,0 +1,219 @@
+#ifndef INCREMENTALPARSER_H
+#define INCREMENTALPARSER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "AST.h"
+#include "Tokenizer.h"
+#include "Parser.h"
+#include "Exception.h"
+
+namespace expr
+{
+
+// Keeps the text, tokens and AST of an expression that is being edited. An edit
+// only re-tokenizes the text from the token before the edit up to the point the
+// new tokens line up with the old ones again, and only the nodes that depend on
+// a changed token are rebuilt. Every other node is handed back unchanged, so
+// callers can use changed() to selectively invalidate anything derived from it.
+template <typename T>
+class IncrementalParser
+{
+	public:
+		IncrementalParser()
+			: m_retokenized(0)
+		{
+		}
+
+		ASTNodePtr parse(const char *text)
+		{
+			return parse(std::string(text));
+		}
+
+		ASTNodePtr parse(const std::string &text)
+		{
+			m_text.clear();
+			m_tokens.clear();
+			m_starts.clear();
+			m_ends.clear();
+			m_ast = ASTNodePtr();
+			m_reuse.clear();
+			return edit(0, 0, text);
+		}
+
+		// Replace removed characters at offset with inserted. On a syntax error the
+		// previous text and AST are kept and a ParserException is thrown.
+		ASTNodePtr edit(size_t offset, size_t removed, const std::string &inserted)
+		{
+			if (offset > m_text.size() || removed > m_text.size() - offset)
+			{
+				throw ParserException("Edit lies outside of the expression text", offset);
+			}
+
+			std::string text(m_text);
+			text.replace(offset, removed, inserted);
+			ptrdiff_t delta = (ptrdiff_t) inserted.size() - (ptrdiff_t) removed;
+			size_t editEnd = offset + removed;            // end of the edit in the old text
+			size_t insertedEnd = offset + inserted.size(); // end of the edit in the new text
+
+			// Tokens which end before the edit can't be affected by it
+			size_t first = std::lower_bound(m_ends.begin(), m_ends.end(), offset) - m_ends.begin();
+			std::vector<TokenPtr> tokens(m_tokens.begin(), m_tokens.begin() + first);
+			std::vector<size_t> starts(m_starts.begin(), m_starts.begin() + first);
+			std::vector<size_t> ends(m_ends.begin(), m_ends.begin() + first);
+
+			Tokenizer<T> tokenizer(text.data(), text.size());
+			tokenizer.seek(first ? m_ends[first - 1] : 0);
+
+			// Index of the first old token that is still valid after the edit
+			size_t resume = m_tokens.size();
+			m_retokenized = 0;
+			try
+			{
+				while (true)
+				{
+					size_t start = tokenizer.index();
+					size_t count = tokens.size();
+					if (!tokenizer.next(tokens))
+					{
+						break;
+					}
+					if (tokens.size() == count)
+					{
+						continue;
+					}
+					m_retokenized++;
+
+					size_t end = tokenizer.index();
+					while (isspace(text[start]))
+					{
+						start++;
+					}
+					starts.push_back(start);
+					ends.push_back(end);
+
+					// A token lexed again before the edit is the same token as before
+					if (start < offset)
+					{
+						size_t k = std::lower_bound(m_starts.begin(), m_starts.end(), start) - m_starts.begin();
+						if (k < m_tokens.size() && m_starts[k] == start && m_ends[k] == end &&
+							m_tokens[k]->getType() == tokens.back()->getType() &&
+							m_tokens[k]->print() == tokens.back()->print())
+						{
+							tokens.back() = m_tokens[k];
+						}
+					}
+
+					// Once past the edit, stop as soon as the text lines up with an old token
+					// that follows the same kind of token it did before
+					if (end >= insertedEnd)
+					{
+						size_t next = end;
+						while (next < text.size() && isspace(text[next]))
+						{
+							next++;
+						}
+						size_t j = std::lower_bound(m_starts.begin(), m_starts.end(), next - delta) - m_starts.begin();
+						if (j > 0 && j < m_tokens.size() && m_starts[j] == next - delta && m_starts[j] >= editEnd &&
+							m_tokens[j - 1]->getType() == tokens.back()->getType())
+						{
+							resume = j;
+							break;
+						}
+					}
+				}
+
+				if (resume == m_tokens.size())
+				{
+					tokenizer.finish(tokens);
+					tokens.pop_back(); // the endoftext token isn't kept
+				}
+			}
+			catch (TokenizerException &e)
+			{
+				throw ParserException(e.what(), e.position());
+			}
+
+			// Everything after the resume point is kept, moved along by the edit
+			for (size_t i=resume; i<m_tokens.size(); i++)
+			{
+				tokens.push_back(m_tokens[i]);
+				starts.push_back(m_starts[i] + delta);
+				ends.push_back(m_ends[i] + delta);
+			}
+			shift(resume, delta);
+
+			ASTNodePtr ast;
+			m_reuse.begin();
+			try
+			{
+				ast = m_parser.parse(tokens, m_context, &m_reuse);
+			}
+			catch (...)
+			{
+				m_reuse.abort();
+				shift(resume, -delta);
+				throw;
+			}
+			m_reuse.end();
+
+			m_text.swap(text);
+			m_tokens.swap(tokens);
+			m_starts.swap(starts);
+			m_ends.swap(ends);
+			m_ast = ast;
+			m_changed = m_reuse.created();
+			return m_ast;
+		}
+
+		ASTNodePtr ast() const
+		{
+			return m_ast;
+		}
+
+		const std::string &text() const
+		{
+			return m_text;
+		}
+
+		// Nodes which were created by the latest parse or edit, every other node in
+		// the AST is the same object as before the edit
+		const std::vector<ASTNodePtr> &changed() const
+		{
+			return m_changed;
+		}
+
+		// Number of tokens which the latest parse or edit had to read from the text
+		size_t retokenized() const
+		{
+			return m_retokenized;
+		}
+
+	private:
+		void shift(size_t from, ptrdiff_t delta)
+		{
+			for (size_t i=from; i<m_tokens.size(); i++)
+			{
+				m_tokens[i]->setPosition(m_tokens[i]->getPosition() + delta);
+			}
+		}
+
+		std::string m_text;
+		std::vector<TokenPtr> m_tokens; // without the endoftext token
+		std::vector<size_t> m_starts;   // offset of the first character of each token
+		std::vector<size_t> m_ends;     // offset just past the last character of each token
+		ASTNodePtr m_ast;
+		std::vector<ASTNodePtr> m_changed;
+		size_t m_retokenized;
+
+		Parser<T> m_parser;
+		ParserContext<T> m_context;
+		ASTReuse m_reuse;
+};
+
+} // namespace expr
+
+#endif
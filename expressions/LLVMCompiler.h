@@ -0,0 +1,310 @@
+#ifndef LLVMCOMPILER_H
+#define LLVMCOMPILER_H
+
+#ifdef USE_LLVM
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "AST.h"
+#include "Memory.h"
+#include "Evaluator.h"
+
+namespace expr
+{
+
+template <typename T>
+class LLVMCompiler;
+
+// Handle to an expression queued on an LLVMCompiler. The compiled evaluator is
+// owned by the task until release() is called.
+template <typename T>
+class LLVMCompileTask
+{
+	public:
+		typedef typename LLVMEvaluator<T>::VariableMap VariableMap;
+
+		// Called on the compiling thread once the expression is compiled, evaluator
+		// is NULL and error is set if compilation failed
+		typedef void (*Callback)(LLVMEvaluator<T> *evaluator, const char *error, void *data);
+
+		~LLVMCompileTask()
+		{
+			delete m_evaluator;
+			pthread_cond_destroy(&m_done);
+			pthread_mutex_destroy(&m_mutex);
+		}
+
+		bool ready()
+		{
+			pthread_mutex_lock(&m_mutex);
+			bool ready = m_ready;
+			pthread_mutex_unlock(&m_mutex);
+			return ready;
+		}
+
+		// Block until the expression is compiled, throws if compilation failed
+		LLVMEvaluator<T> *wait()
+		{
+			pthread_mutex_lock(&m_mutex);
+			while (!m_ready)
+			{
+				pthread_cond_wait(&m_done, &m_mutex);
+			}
+			pthread_mutex_unlock(&m_mutex);
+
+			if (!m_evaluator)
+			{
+				throw EvaluatorException(m_error.c_str());
+			}
+			return m_evaluator;
+		}
+
+		// As wait, but the caller takes ownership of the evaluator
+		LLVMEvaluator<T> *release()
+		{
+			LLVMEvaluator<T> *evaluator = wait();
+			m_evaluator = NULL;
+			return evaluator;
+		}
+
+	private:
+		friend class LLVMCompiler<T>;
+
+		LLVMCompileTask(ASTNodePtr ast, VariableMap *map, Callback callback, void *data, const BranchProfile *profile)
+			: m_ast(ast)
+			, m_map(map)
+			, m_callback(callback)
+			, m_data(data)
+			, m_evaluator(NULL)
+			, m_ready(false)
+		{
+			pthread_mutex_init(&m_mutex, NULL);
+			pthread_cond_init(&m_done, NULL);
+			if (profile)
+			{
+				m_profile = *profile;
+			}
+		}
+
+		void run(SHARED_PTR<LLVMSession> session)
+		{
+			try
+			{
+				m_evaluator = new LLVMEvaluator<T>(m_ast, m_map, session, &m_profile);
+			}
+			catch (std::exception &e)
+			{
+				fail(e.what());
+				return;
+			}
+			catch (...)
+			{
+				fail("Unknown error while compiling the expression");
+				return;
+			}
+			finish();
+		}
+
+		void fail(const char *error)
+		{
+			m_error = error;
+			finish();
+		}
+
+		void finish()
+		{
+			m_ast = ASTNodePtr();
+			if (m_callback)
+			{
+				m_callback(m_evaluator, m_evaluator ? NULL : m_error.c_str(), m_data);
+			}
+
+			pthread_mutex_lock(&m_mutex);
+			m_ready = true;
+			pthread_cond_broadcast(&m_done);
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		ASTNodePtr m_ast;
+		VariableMap *m_map;
+		BranchProfile m_profile; // copied, as the original may still be counting
+		Callback m_callback;
+		void *m_data;
+		LLVMEvaluator<T> *m_evaluator;
+		std::string m_error;
+		bool m_ready;
+		pthread_mutex_t m_mutex;
+		pthread_cond_t m_done;
+};
+
+
+// Compiles expressions on a pool of threads. Every thread has an LLVMSession of
+// its own, so compilation runs in parallel and the callers aren't blocked on
+// code generation. The compiled evaluators live in the compiler's sessions and
+// hold a reference to theirs, so tasks and released evaluators may outlive the
+// compiler.
+template <typename T>
+class LLVMCompiler
+{
+	public:
+		typedef SHARED_PTR<LLVMCompileTask<T> > TaskPtr;
+		typedef typename LLVMCompileTask<T>::VariableMap VariableMap;
+		typedef typename LLVMCompileTask<T>::Callback Callback;
+
+		LLVMCompiler(unsigned int threads=0, const LLVMOptions &options=LLVMOptions())
+			: m_options(options)
+			, m_stopping(false)
+		{
+			if (threads == 0)
+			{
+				long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+				threads = cpus > 0 ? (unsigned int) cpus : 1;
+			}
+
+			LLVMSession::initialize();
+			pthread_mutex_init(&m_mutex, NULL);
+			pthread_cond_init(&m_queued, NULL);
+
+			m_sessions.resize(threads);
+			m_workers.resize(threads);
+			m_handles.resize(threads);
+			for (unsigned int i=0; i<threads; i++)
+			{
+				m_workers[i].compiler = this;
+				m_workers[i].index = i;
+				if (pthread_create(&m_handles[i], NULL, &LLVMCompiler::run, &m_workers[i]) != 0)
+				{
+					m_handles.resize(i);
+					break;
+				}
+			}
+
+			if (m_handles.empty())
+			{
+				pthread_cond_destroy(&m_queued);
+				pthread_mutex_destroy(&m_mutex);
+				throw EvaluatorException("Could not start any LLVM compiler threads");
+			}
+		}
+
+		// Tasks still queued are failed rather than compiled
+		~LLVMCompiler()
+		{
+			pthread_mutex_lock(&m_mutex);
+			m_stopping = true;
+			pthread_cond_broadcast(&m_queued);
+			pthread_mutex_unlock(&m_mutex);
+
+			for (size_t i=0; i<m_handles.size(); i++)
+			{
+				pthread_join(m_handles[i], NULL);
+			}
+			for (size_t i=0; i<m_queue.size(); i++)
+			{
+				m_queue[i]->fail("LLVM compiler was destroyed before the expression was compiled");
+			}
+			m_sessions.clear(); // each session goes once its last evaluator does
+
+			pthread_cond_destroy(&m_queued);
+			pthread_mutex_destroy(&m_mutex);
+		}
+
+		// The profile is copied, so it can carry on being updated while compiling
+		TaskPtr compile(ASTNodePtr ast, VariableMap *map=NULL, Callback callback=NULL, void *data=NULL, const BranchProfile *profile=NULL)
+		{
+			TaskPtr task(new LLVMCompileTask<T>(ast, map, callback, data, profile));
+
+			pthread_mutex_lock(&m_mutex);
+			m_queue.push_back(task);
+			pthread_cond_signal(&m_queued);
+			pthread_mutex_unlock(&m_mutex);
+
+			return task;
+		}
+
+		size_t threads() const
+		{
+			return m_handles.size();
+		}
+
+	private:
+		// Compilers are not copyable
+		LLVMCompiler(const LLVMCompiler &);
+		LLVMCompiler &operator=(const LLVMCompiler &);
+
+		struct Worker
+		{
+			LLVMCompiler *compiler;
+			size_t index;
+		};
+
+		static void *run(void *arg)
+		{
+			Worker *worker = (Worker *) arg;
+			worker->compiler->work(worker->index);
+			return NULL;
+		}
+
+		void work(size_t index)
+		{
+			std::string error;
+			try
+			{
+				m_sessions[index] = SHARED_PTR<LLVMSession>(new LLVMSession(m_options));
+			}
+			catch (std::exception &e)
+			{
+				error = e.what();
+			}
+			catch (...)
+			{
+				error = "Unknown error while creating an LLVM session";
+			}
+
+			while (true)
+			{
+				pthread_mutex_lock(&m_mutex);
+				while (m_queue.empty() && !m_stopping)
+				{
+					pthread_cond_wait(&m_queued, &m_mutex);
+				}
+				if (m_stopping)
+				{
+					pthread_mutex_unlock(&m_mutex);
+					return;
+				}
+				TaskPtr task = m_queue.front();
+				m_queue.pop_front();
+				pthread_mutex_unlock(&m_mutex);
+
+				if (m_sessions[index])
+				{
+					task->run(m_sessions[index]);
+				}
+				else
+				{
+					task->fail(error.c_str());
+				}
+			}
+		}
+
+		LLVMOptions m_options;
+		std::vector<SHARED_PTR<LLVMSession> > m_sessions; // one per thread
+		std::vector<Worker> m_workers;
+		std::vector<pthread_t> m_handles;
+		std::deque<TaskPtr> m_queue;
+		bool m_stopping;
+		pthread_mutex_t m_mutex;
+		pthread_cond_t m_queued;
+};
+
+} // namespace expr
+
+#endif // USE_LLVM
+
+#endif
@@ -4,7 +4,9 @@
 #include "AST.h"
 #include "Tokenizer.h"
 #include "Exception.h"
+#include "Status.h"
 #include <map>
+#include <vector>
 #include <iostream>
 
 namespace expr
@@ -13,14 +15,214 @@ namespace expr
 class ParserException : public Exception
 {
     public:
-        ParserException(const char * message)
-        : Exception(message)
+        ParserException(const char * message, size_t position=npos)
+        : Exception(message, position)
         {
         }
 };
 
 
 
+template <typename T>
+class Parser;
+
+// Owns the working buffers used while parsing (token buffer, operator stack,
+// output queue and AST node stack). They are cleared, but not freed, between
+// calls so that a context which is reused for many parses stops allocating
+// buffer memory once it has grown to fit the largest expression seen. A
+// context must only be used by one parse at a time.
+template <typename T>
+class ParserContext
+{
+	public:
+		struct Statistics
+		{
+			unsigned int tokens;            // Token objects created by the tokenizer
+			unsigned int nodes;             // AST nodes created
+			unsigned int bufferAllocations; // Context buffers which had to grow
+
+			Statistics()
+				: tokens(0)
+				, nodes(0)
+				, bufferAllocations(0)
+			{}
+		};
+
+		ParserContext(size_t reserve=64)
+		{
+			m_tokens.reserve(reserve);
+			m_output.reserve(reserve);
+			m_operators.reserve(reserve);
+			m_nodes.reserve(reserve);
+		}
+
+		// Allocation counts for the most recent parse
+		const Statistics &statistics() const
+		{
+			return m_statistics;
+		}
+
+		void reset()
+		{
+			m_tokens.clear();
+			m_output.clear();
+			m_operators.clear();
+			m_nodes.clear();
+		}
+
+	private:
+		friend class Parser<T>;
+
+		void begin()
+		{
+			reset();
+			m_statistics = Statistics();
+			m_capacity[0] = m_tokens.capacity();
+			m_capacity[1] = m_output.capacity();
+			m_capacity[2] = m_operators.capacity();
+			m_capacity[3] = m_nodes.capacity();
+		}
+
+		void end()
+		{
+			m_statistics.bufferAllocations += (m_tokens.capacity()    != m_capacity[0]);
+			m_statistics.bufferAllocations += (m_output.capacity()    != m_capacity[1]);
+			m_statistics.bufferAllocations += (m_operators.capacity() != m_capacity[2]);
+			m_statistics.bufferAllocations += (m_nodes.capacity()     != m_capacity[3]);
+			reset();
+		}
+
+		std::vector<TokenPtr> m_tokens;
+		std::vector<TokenPtr> m_output;
+		std::vector<TokenPtr> m_operators;
+		std::vector<ASTNodePtr> m_nodes;
+		size_t m_capacity[4];
+		Statistics m_statistics;
+		Status m_status;
+};
+
+
+// Remembers which node each token produced while building an AST, so that a
+// later build from mostly the same tokens can hand back the previous node
+// whenever a token is applied to the same operands again.
+class ASTReuse
+{
+	public:
+		ASTReuse()
+			: m_size(0)
+		{
+		}
+
+		// Start a new build, the nodes recorded by the previous build become reusable
+		void begin()
+		{
+			m_previous.swap(m_current);
+			m_current.clear();
+			m_created.clear();
+		}
+
+		// Finish a build, releasing any previous nodes that weren't reused
+		void end()
+		{
+			m_previous.clear();
+		}
+
+		// Abandon a failed build, the previous nodes stay reusable for the next one
+		void abort()
+		{
+			m_current.swap(m_previous);
+			m_previous.clear();
+			m_created.clear();
+		}
+
+		void clear()
+		{
+			m_previous.clear();
+			m_current.clear();
+			m_created.clear();
+		}
+
+		// Nodes built, rather than reused, by the latest build
+		const std::vector<ASTNodePtr> &created() const
+		{
+			return m_created;
+		}
+
+		// Replace the operands on the top of the stack with the node the token
+		// produced last time, if it was applied to exactly the same operands
+		bool reuse(Token *token, std::vector<ASTNodePtr> &stack)
+		{
+			EntryMap::iterator it = m_previous.find(token);
+			if (it == m_previous.end())
+			{
+				return false;
+			}
+
+			Entry &entry = it->second;
+			if (stack.size() < entry.operands)
+			{
+				return false;
+			}
+
+			size_t base = stack.size() - entry.operands;
+			for (size_t i=0; i<entry.operands; i++)
+			{
+				if (stack[base + i].get() != entry.operand[i])
+				{
+					return false;
+				}
+			}
+
+			stack.resize(base);
+			stack.push_back(entry.node);
+			m_current[token] = entry;
+			return true;
+		}
+
+		// Note the top of the stack before a token builds its node
+		void snapshot(const std::vector<ASTNodePtr> &stack)
+		{
+			m_size = stack.size();
+			for (size_t i=0; i<3; i++)
+			{
+				m_top[i] = i < m_size ? stack[m_size - 1 - i].get() : NULL;
+			}
+		}
+
+		// Record the node a token has just built from the operands in the snapshot
+		void record(Token *token, const std::vector<ASTNodePtr> &stack)
+		{
+			Entry entry;
+			entry.node = stack.back();
+			entry.operands = m_size + 1 - stack.size();
+			for (size_t i=0; i<entry.operands; i++)
+			{
+				entry.operand[i] = m_top[entry.operands - 1 - i];
+			}
+			m_current[token] = entry;
+			m_created.push_back(entry.node);
+		}
+
+	private:
+		struct Entry
+		{
+			ASTNodePtr node;
+			size_t operands;
+			ASTNode *operand[3]; // bottom to top of the stack
+		};
+		typedef std::map<Token *, Entry> EntryMap;
+
+		EntryMap m_previous;
+		EntryMap m_current;
+		std::vector<ASTNodePtr> m_created;
+		size_t m_size;
+		ASTNode *m_top[3];
+};
+
+
+// Parsers hold no state, so one can be shared between threads. The overloads
+// without a context parse with a fresh one each call; pass a ParserContext to
+// reuse its buffers across parses.
 template <typename T>
 class Parser
 {
@@ -28,17 +230,110 @@ class Parser
 
         ASTNodePtr parse(const char* text)
         {
+            ParserContext<T> context;
+            return parse(text, strlen(text), context);
+        }
+
+        ASTNodePtr parse(const std::string &text)
+        {
+            ParserContext<T> context;
+            return parse(text.data(), text.size(), context);
+        }
+
+        // Parse length characters of text, which need not be null terminated. Error
+        // positions are offsets from text, so expressions can be parsed in place
+        // from inside a larger buffer.
+        ASTNodePtr parse(const char* text, size_t length)
+        {
+            ParserContext<T> context;
+            return parse(text, length, context);
+        }
+
+        ASTNodePtr parse(const char* text, ParserContext<T> &context)
+        {
+            return parse(text, strlen(text), context);
+        }
+
+        // Build an AST from tokens which have already been read by a Tokenizer. Nodes
+        // recorded by reuse from an earlier build are returned again where possible.
+        ASTNodePtr parse(const std::vector<TokenPtr> &tokens, ParserContext<T> &context, ASTReuse *reuse=NULL)
+        {
+            ASTNodePtr ast;
+            Status status = tryParse(tokens, ast, context, reuse);
+            if (!status.ok())
+            {
+                throw ParserException(status.message().c_str(), status.position());
+            }
+            return ast;
+        }
+
+        ASTNodePtr parse(const char* text, size_t length, ParserContext<T> &context)
+        {
+            ASTNodePtr ast;
+            Status status = tryParse(text, length, ast, context);
+            if (!status.ok())
+            {
+                throw ParserException(status.message().c_str(), status.position());
+            }
+            return ast;
+        }
+
+        // The tryParse calls mirror parse, but report syntax errors through the
+        // returned Status instead of throwing, which is much cheaper when invalid
+        // expressions are common. ast is only assigned on success.
+        Status tryParse(const char* text, ASTNodePtr &ast)
+        {
+            ParserContext<T> context;
+            return tryParse(text, strlen(text), ast, context);
+        }
+
+        Status tryParse(const std::string &text, ASTNodePtr &ast)
+        {
+            ParserContext<T> context;
+            return tryParse(text.data(), text.size(), ast, context);
+        }
+
+        Status tryParse(const char* text, size_t length, ASTNodePtr &ast)
+        {
+            ParserContext<T> context;
+            return tryParse(text, length, ast, context);
+        }
+
+        Status tryParse(const char* text, size_t length, ASTNodePtr &ast, ParserContext<T> &context)
+        {
+            context.begin();
+            try
+            {
+				Status status = Tokenizer<T>(text, length).tryTokenize(context.m_tokens);
+				context.m_statistics.tokens = context.m_tokens.size();
+				if (status.ok())
+				{
+					status = build(context, ast, NULL);
+				}
+				context.end();
+				return status;
+            }
+            catch (...)
+            {
+                context.end();
+                throw;
+            }
+        }
+
+        Status tryParse(const std::vector<TokenPtr> &tokens, ASTNodePtr &ast, ParserContext<T> &context, ASTReuse *reuse=NULL)
+        {
+            context.begin();
             try
             {
-				std::deque<TokenPtr> tokens;
-				Tokenizer<T>(text).tokenize(tokens);
-                shuntingYard(tokens);
-                ASTNodePtr node = rpnToAST(tokens);
-				return node;
+				context.m_tokens.assign(tokens.begin(), tokens.end());
+				Status status = build(context, ast, reuse);
+				context.end();
+				return status;
             }
-            catch (TokenizerException &e)
+            catch (...)
             {
-                throw ParserException(e.what());
+                context.end();
+                throw;
             }
         }
 
@@ -56,22 +351,39 @@ class Parser
 
     private:
 
-        void shuntingYard(std::deque<TokenPtr> &tokens)
+        Status build(ParserContext<T> &context, ASTNodePtr &ast, ASTReuse *reuse)
+        {
+            context.m_status = Status();
+            if (shuntingYard(context) && rpnToAST(context, reuse, ast))
+            {
+                return Status();
+            }
+            return context.m_status;
+        }
+
+        bool fail(ParserContext<T> &context, Status::Code code, size_t position, const char *detail)
+        {
+            context.m_status = Status(code, position, detail);
+            return false;
+        }
+
+        bool shuntingYard(ParserContext<T> &context)
 		{
            	// This is an implementation of the shunting yard algorithm
 			// to convert infix notation into reverse polish notation.
 			// this ensures that the operator precedence is maintained
 			// in our AST.
 
-        	// Stacks for "shunting"
-        	std::deque<TokenPtr> output;
-        	std::deque<TokenPtr> stack;
+        	// Stacks for "shunting", the top of the stack is the back of the vector
+        	std::vector<TokenPtr> &tokens = context.m_tokens;
+        	std::vector<TokenPtr> &output = context.m_output;
+        	std::vector<TokenPtr> &stack = context.m_operators;
 
         	// While there are tokens to be read
-        	while (tokens.size() != 0)
+        	for (size_t i=0; i<tokens.size(); i++)
         	{
         		// Read a token
-        		TokenPtr token = tokens.front(); tokens.pop_front();
+        		const TokenPtr &token = tokens[i];
 
         		// If the token is a number, then add it to the output queue.
         		if (token->getType() == Token::NUMBER || token->getType() == Token::VARIABLE)
@@ -83,7 +395,7 @@ class Parser
         		// If the token is a function token, then push it onto the stack.
         		else if (token->getType() == Token::FUNCTION)
 				{
-					stack.push_front(token);
+					stack.push_back(token);
 					continue;
 				}
 
@@ -95,12 +407,12 @@ class Parser
         			{
         				if (stack.size() != 0)
         				{
-        					TokenPtr stackToken = stack.front();
+        					TokenPtr stackToken = stack.back();
         					if (stackToken->getType() != Token::OPEN_PARENTHESIS)
         					{
         						// pop operators off the stack onto the output queue
         						output.push_back(stackToken);
-        						stack.pop_front();
+        						stack.pop_back();
         					}
         					else
         					{
@@ -111,10 +423,7 @@ class Parser
         				{
         					// If no left parentheses are encountered, either the separator was misplaced
         					// or parentheses were mismatched.
-							std::stringstream ss;
-							ss << "Misplaced separator or unmatched parenthesis, character: ";
-							ss << token->getPosition();
-							throw ParserException(ss.str().c_str());
+							return fail(context, Status::MISPLACED_SEPARATOR, token->getPosition(), "Misplaced separator or unmatched parenthesis");
         				}
         			}
         			continue;
@@ -130,7 +439,7 @@ class Parser
         			// while there is an operator token, o2, at the top of the stack,
         			while (stack.size() != 0)
         			{
-        				TokenPtr stackToken = stack.front();
+        				TokenPtr stackToken = stack.back();
         				if (stackToken->getType() == Token::OPERATOR    ||
         					stackToken->getType() == Token::UNARY       ||
         					stackToken->getType() == Token::CONDITIONAL ||
@@ -146,7 +455,7 @@ class Parser
         					{
         						// pop o2 off the stack, onto the output queue;
         						output.push_back(stackToken);
-        						stack.pop_front();
+        						stack.pop_back();
         					}
         					else
         					{
@@ -159,14 +468,14 @@ class Parser
         				}
         			}
         			// push o1 onto the stack.
-        			stack.push_front(token);
+        			stack.push_back(token);
         			continue;
         		}
 
         		// If the token is a left parenthesis, then push it onto the stack.
         		else if (token->getType() == Token::OPEN_PARENTHESIS)
         		{
-        			stack.push_front(token);
+        			stack.push_back(token);
         			continue;
         		}
 
@@ -178,12 +487,12 @@ class Parser
         			{
         				if (stack.size() != 0)
         				{
-        					TokenPtr stackToken = stack.front();
+        					TokenPtr stackToken = stack.back();
         					if (stackToken->getType() != Token::OPEN_PARENTHESIS)
         					{
         						// pop operators off the stack onto the output queue
         						output.push_back(stackToken);
-        						stack.pop_front();
+        						stack.pop_back();
         					}
         					else
         					{
@@ -193,24 +502,21 @@ class Parser
         				else
         				{
         					// If the stack runs out without finding a left parenthesis, then there are mismatched parentheses
-							std::stringstream ss;
-							ss << "Mismatched parenthesis, character: ";
-							ss << token->getPosition();
-							throw ParserException(ss.str().c_str());
+							return fail(context, Status::MISMATCHED_PARENTHESIS, token->getPosition(), "Mismatched parenthesis");
         				}
         			}
 
         			// Pop the left parenthesis from the stack, but not onto the output queue
-        			stack.pop_front();
+        			stack.pop_back();
 
         			// If the token at the top of the stack is a function token,
         			if (stack.size() != 0)
         			{
-        				if (stack.front()->getType() == Token::FUNCTION)
+        				if (stack.back()->getType() == Token::FUNCTION)
         				{
         					// pop it onto the output queue.
-        					output.push_back(stack.front());
-        					stack.pop_front();
+        					output.push_back(stack.back());
+        					stack.pop_back();
         				}
         			}
         			continue;
@@ -221,292 +527,283 @@ class Parser
         	// While there are still operator tokens in the stack
         	while (stack.size() != 0)
         	{
-        		TokenPtr stackToken = stack.front();
+        		TokenPtr stackToken = stack.back();
         		if (stackToken->getType() == Token::OPEN_PARENTHESIS ||
         			stackToken->getType() == Token::CLOSE_PARENTHESIS )
         		{
-        			throw ParserException("Mismatched parenthesis");
+        			return fail(context, Status::MISMATCHED_PARENTHESIS, stackToken->getPosition(), "Mismatched parenthesis");
         		}
         		else
         		{
         			output.push_back(stackToken);
-        			stack.pop_front();
+        			stack.pop_back();
         		}
         	}
 
-			// Replace the tokens in the original TokVec
-			tokens = std::deque<TokenPtr>(output.begin(), output.end());
+			// The output queue now holds the tokens in reverse polish notation
+			return true;
         }
 
-        ASTNodePtr rpnToAST(std::deque<TokenPtr> &tokens)
+        bool rpnToAST(ParserContext<T> &context, ASTReuse *reuse, ASTNodePtr &ast)
         {
-        	// To convert from RPN to AST, just push each number node onto the front of the stack
+        	// To convert from RPN to AST, just push each number node onto the top of the stack
         	// and for each operator, pop the required operands, then push the resulting node
-        	// to the front of the stack
+        	// to the top of the stack
 
-        	std::deque<ASTNodePtr> stack;
-        	for (unsigned int i=0; i<tokens.size(); i++)
+        	std::vector<TokenPtr> &tokens = context.m_output;
+        	std::vector<ASTNodePtr> &stack = context.m_nodes;
+        	for (size_t i=0; i<tokens.size(); i++)
         	{
-        		TokenPtr token = tokens[i];
-
-        		if (token->getType() == Token::NUMBER)
-				{
-					SHARED_PTR<NumberToken<T> > nt = STATIC_POINTER_CAST<NumberToken<T> >(token);
-					ASTNodePtr n = ASTNodePtr(new NumberASTNode<T>(nt->getValue()));
-					stack.push_front(n);
-					continue;
-				}
+        		const TokenPtr &token = tokens[i];
 
-        		if (token->getType() == Token::VARIABLE)
+        		if (reuse)
         		{
-					SHARED_PTR<VariableToken> v = STATIC_POINTER_CAST<VariableToken>(token);
-        			std::string key = v->getValue();
-        			ASTNodePtr n = ASTNodePtr(new VariableASTNode<T>(key));
-        			stack.push_front(n);
-        			continue;
+        			if (reuse->reuse(token.get(), stack))
+        			{
+        				continue;
+        			}
+        			reuse->snapshot(stack);
         		}
 
+        		size_t size = stack.size();
+        		ASTNode *top = size ? stack.back().get() : NULL;
 
+        		if (!buildNode(token, stack, context))
+        		{
+        			return false;
+        		}
 
-        		if (token->getType() == Token::UNARY)
+        		// Unary plus and the ternary colon leave the stack untouched, every
+        		// other token replaces its operands with a new node
+        		if (stack.size() > size || (stack.size() && stack.back().get() != top))
         		{
-					if (stack.size() == 0)
-					{
-						std::stringstream ss;
-						ss << "Invalid syntax: unary operator given without variable, character: ";
-						ss << token->getPosition();
-						throw ParserException(ss.str().c_str());
-					}
+        			context.m_statistics.nodes++;
+        			if (reuse)
+        			{
+        				reuse->record(token.get(), stack);
+        			}
+        		}
+        	}
 
-        			SHARED_PTR<UnaryToken> u = STATIC_POINTER_CAST<UnaryToken>(token);
+        	ast = stack.size() ? stack.back() : ASTNodePtr();
+        	return true;
+        }
 
-        			if (u->getDirection() == UnaryToken::NEGATIVE)
-        			{
+        bool buildNode(const TokenPtr &token, std::vector<ASTNodePtr> &stack, ParserContext<T> &context)
+        {
+        	if (token->getType() == Token::NUMBER)
+			{
+				SHARED_PTR<NumberToken<T> > nt = STATIC_POINTER_CAST<NumberToken<T> >(token);
+				ASTNodePtr n = ASTNodePtr(new NumberASTNode<T>(nt->getValue()));
+				stack.push_back(n);
+				return true;
+			}
+
+        	if (token->getType() == Token::VARIABLE)
+        	{
+				SHARED_PTR<VariableToken> v = STATIC_POINTER_CAST<VariableToken>(token);
+        		std::string key = v->getValue();
+        		ASTNodePtr n = ASTNodePtr(new VariableASTNode<T>(key));
+        		stack.push_back(n);
+        		return true;
+        	}
 
-        				// Take the number from the top of the stack and make it negative
-						SHARED_PTR<NumberASTNode<T> > n = STATIC_POINTER_CAST<NumberASTNode<T> >(stack.front());
-        				stack.pop_front();
 
-        				stack.push_front(ASTNodePtr(new NumberASTNode<T>(n->value() * -1)));
-        			}
-        			continue;
-        		}
 
-        		if (token->getType() == Token::OPERATOR)
+        	if (token->getType() == Token::UNARY)
+        	{
+				if (stack.size() == 0)
+				{
+					return fail(context, Status::MISSING_OPERAND, token->getPosition(), "Invalid syntax: unary operator given without variable");
+				}
+
+        		SHARED_PTR<UnaryToken> u = STATIC_POINTER_CAST<UnaryToken>(token);
+
+        		if (u->getDirection() == UnaryToken::NEGATIVE)
         		{
-					if (stack.size() < 2)
-					{
-						std::stringstream ss;
-						ss << "Invalid syntax: operator given with insufficient operands, character: ";
-						ss << token->getPosition();
-						throw ParserException(ss.str().c_str());
-					}
 
-        			SHARED_PTR<OperatorToken> opt = STATIC_POINTER_CAST<OperatorToken>(token);
-        			ASTNodePtr left = stack.front(); stack.pop_front();
-        			ASTNodePtr right = stack.front(); stack.pop_front();
-        			OperationASTNode::OperationType type;
-        			switch(opt->getOperator())
-        			{
-        				case OperatorToken::PLUS:  type = OperationASTNode::PLUS;  break;
-        				case OperatorToken::MINUS: type = OperationASTNode::MINUS; break;
-        				case OperatorToken::MUL:   type = OperationASTNode::MUL;   break;
-        				case OperatorToken::DIV:   type = OperationASTNode::DIV;   break;
-        				case OperatorToken::POW:   type = OperationASTNode::POW;   break;
-        				case OperatorToken::MOD:   type = OperationASTNode::MOD;   break;
-        				default:
-							std::stringstream ss;
-							ss << "Unknown operator token, character: ";
-							ss << token->getPosition();
-							throw ParserException(ss.str().c_str());
-        			}
-        			stack.push_front(ASTNodePtr(new OperationASTNode(type, left, right)));
-        			continue;
+        			// Take the number from the top of the stack and make it negative
+					SHARED_PTR<NumberASTNode<T> > n = STATIC_POINTER_CAST<NumberASTNode<T> >(stack.back());
+        			stack.pop_back();
+
+        			stack.push_back(ASTNodePtr(new NumberASTNode<T>(n->value() * -1)));
         		}
+        		return true;
+        	}
 
-        		if (token->getType() == Token::FUNCTION)
+        	if (token->getType() == Token::OPERATOR)
+        	{
+				if (stack.size() < 2)
+				{
+					return fail(context, Status::MISSING_OPERAND, token->getPosition(), "Invalid syntax: operator given with insufficient operands");
+				}
+
+        		SHARED_PTR<OperatorToken> opt = STATIC_POINTER_CAST<OperatorToken>(token);
+        		ASTNodePtr left = stack.back(); stack.pop_back();
+        		ASTNodePtr right = stack.back(); stack.pop_back();
+        		OperationASTNode::OperationType type;
+        		switch(opt->getOperator())
         		{
-					if (stack.size() == 0)
-					{
-						std::stringstream ss;
-						ss << "Invalid syntax: function given with insufficient operands, character: ";
-						ss << token->getPosition();
-						throw ParserException(ss.str().c_str());
-					}
-        			SHARED_PTR<FunctionToken> f = STATIC_POINTER_CAST<FunctionToken>(token);
-        			ASTNodePtr left = stack.front(); stack.pop_front();
+        			case OperatorToken::PLUS:  type = OperationASTNode::PLUS;  break;
+        			case OperatorToken::MINUS: type = OperationASTNode::MINUS; break;
+        			case OperatorToken::MUL:   type = OperationASTNode::MUL;   break;
+        			case OperatorToken::DIV:   type = OperationASTNode::DIV;   break;
+        			case OperatorToken::POW:   type = OperationASTNode::POW;   break;
+        			case OperatorToken::MOD:   type = OperationASTNode::MOD;   break;
+        			default:
+						return fail(context, Status::UNKNOWN_OPERATOR, token->getPosition(), "Unknown operator token");
+        		}
+        		stack.push_back(ASTNodePtr(new OperationASTNode(type, left, right)));
+        		return true;
+        	}
 
-        			switch(f->getFunction())
-        			{
-        				case FunctionToken::SIN:
-        					stack.push_front(ASTNodePtr(new Function1ASTNode(Function1ASTNode::SIN, left)));
-        					break;
-        				case FunctionToken::COS:
-        					stack.push_front(ASTNodePtr(new Function1ASTNode(Function1ASTNode::COS, left)));
-        					break;
-        				case FunctionToken::TAN:
-        					stack.push_front(ASTNodePtr(new Function1ASTNode(Function1ASTNode::TAN, left)));
-        					break;
-        				case FunctionToken::SQRT:
-							stack.push_front(ASTNodePtr(new Function1ASTNode(Function1ASTNode::SQRT, left)));
-							break;
-        				case FunctionToken::LOG:
-							stack.push_front(ASTNodePtr(new Function1ASTNode(Function1ASTNode::LOG, left)));
-							break;
-        				case FunctionToken::LOG2:
-							stack.push_front(ASTNodePtr(new Function1ASTNode(Function1ASTNode::LOG2, left)));
-							break;
-        				case FunctionToken::LOG10:
-							stack.push_front(ASTNodePtr(new Function1ASTNode(Function1ASTNode::LOG10, left)));
-							break;
-        				case FunctionToken::CEIL:
-							stack.push_front(ASTNodePtr(new Function1ASTNode(Function1ASTNode::CEIL, left)));
-							break;
-        				case FunctionToken::FLOOR:
-							stack.push_front(ASTNodePtr(new Function1ASTNode(Function1ASTNode::FLOOR, left)));
-							break;
-        				case FunctionToken::MIN:
-        				{
-							if (stack.size() == 0)
-							{
-								std::stringstream ss;
-								ss << "Invalid syntax: function given with insuffucient operands, character: ";
-								ss << token->getPosition();
-								throw ParserException(ss.str().c_str());
-							}
-        					ASTNodePtr right = stack.front(); stack.pop_front();
-        					stack.push_front(ASTNodePtr(new Function2ASTNode(Function2ASTNode::MIN, left, right)));
-        				}
+        	if (token->getType() == Token::FUNCTION)
+        	{
+				if (stack.size() == 0)
+				{
+					return fail(context, Status::MISSING_OPERAND, token->getPosition(), "Invalid syntax: function given with insufficient operands");
+				}
+        		SHARED_PTR<FunctionToken> f = STATIC_POINTER_CAST<FunctionToken>(token);
+        		ASTNodePtr left = stack.back(); stack.pop_back();
+
+        		switch(f->getFunction())
+        		{
+        			case FunctionToken::SIN:
+        				stack.push_back(ASTNodePtr(new Function1ASTNode(Function1ASTNode::SIN, left)));
         				break;
-        				case FunctionToken::MAX:
-						{
-							if (stack.size() == 0)
-							{
-								std::stringstream ss;
-								ss << "Invalid syntax: function given with insuffucient operands, character: ";
-								ss << token->getPosition();
-								throw ParserException(ss.str().c_str());
-							}
-							ASTNodePtr right = stack.front(); stack.pop_front();
-							stack.push_front(ASTNodePtr(new Function2ASTNode(Function2ASTNode::MAX, left, right)));
-						}
+        			case FunctionToken::COS:
+        				stack.push_back(ASTNodePtr(new Function1ASTNode(Function1ASTNode::COS, left)));
+        				break;
+        			case FunctionToken::TAN:
+        				stack.push_back(ASTNodePtr(new Function1ASTNode(Function1ASTNode::TAN, left)));
+        				break;
+        			case FunctionToken::SQRT:
+						stack.push_back(ASTNodePtr(new Function1ASTNode(Function1ASTNode::SQRT, left)));
 						break;
-						case FunctionToken::POW:
-        				{
-							if (stack.size() == 0)
-							{
-								std::stringstream ss;
-								ss << "Invalid syntax: function given with insuffucient operands, character: ";
-								ss << token->getPosition();
-								throw ParserException(ss.str().c_str());
-							}
-        					ASTNodePtr right = stack.front(); stack.pop_front();
-        					stack.push_front(ASTNodePtr(new Function2ASTNode(Function2ASTNode::POW, left, right)));
-        				}
+        			case FunctionToken::LOG:
+						stack.push_back(ASTNodePtr(new Function1ASTNode(Function1ASTNode::LOG, left)));
+						break;
+        			case FunctionToken::LOG2:
+						stack.push_back(ASTNodePtr(new Function1ASTNode(Function1ASTNode::LOG2, left)));
+						break;
+        			case FunctionToken::LOG10:
+						stack.push_back(ASTNodePtr(new Function1ASTNode(Function1ASTNode::LOG10, left)));
 						break;
-        				default:
-							std::stringstream ss;
-							ss << "Unknown function token, character: ";
-							ss << token->getPosition();
-							throw ParserException(ss.str().c_str());
+        			case FunctionToken::CEIL:
+						stack.push_back(ASTNodePtr(new Function1ASTNode(Function1ASTNode::CEIL, left)));
+						break;
+        			case FunctionToken::FLOOR:
+						stack.push_back(ASTNodePtr(new Function1ASTNode(Function1ASTNode::FLOOR, left)));
+						break;
+        			case FunctionToken::MIN:
+        			{
+						if (stack.size() == 0)
+						{
+							return fail(context, Status::MISSING_OPERAND, token->getPosition(), "Invalid syntax: function given with insuffucient operands");
+						}
+        				ASTNodePtr right = stack.back(); stack.pop_back();
+        				stack.push_back(ASTNodePtr(new Function2ASTNode(Function2ASTNode::MIN, left, right)));
         			}
-        			continue;
-        		}
-
-        		if (token->getType() == Token::CONDITIONAL)
-        		{
-					if (stack.size() < 2)
+        			break;
+        			case FunctionToken::MAX:
 					{
-						std::stringstream ss;
-						ss << "Invalid syntax: conditional operator given with insuffucient operands, character: ";
-						ss << token->getPosition();
-						throw ParserException(ss.str().c_str());
+						if (stack.size() == 0)
+						{
+							return fail(context, Status::MISSING_OPERAND, token->getPosition(), "Invalid syntax: function given with insuffucient operands");
+						}
+						ASTNodePtr right = stack.back(); stack.pop_back();
+						stack.push_back(ASTNodePtr(new Function2ASTNode(Function2ASTNode::MAX, left, right)));
 					}
-        			SHARED_PTR<ConditionalToken> c = STATIC_POINTER_CAST<ConditionalToken>(token);
-        			ASTNodePtr left = stack.front(); stack.pop_front();
-        			ASTNodePtr right = stack.front(); stack.pop_front();
-        			ComparisonASTNode::ComparisonType type;
-        			switch(c->getConditional())
+					break;
+					case FunctionToken::POW:
         			{
-        				case ConditionalToken::EQUAL:
-        					type = ComparisonASTNode::EQUAL; break;
-        				case ConditionalToken::NOT_EQUAL:
-        					type = ComparisonASTNode::NOT_EQUAL; break;
-        				case ConditionalToken::GREATER_THAN:
-        					type = ComparisonASTNode::GREATER_THAN; break;
-        				case ConditionalToken::GREATER_THAN_EQUAL:
-        					type = ComparisonASTNode::GREATER_THAN_EQUAL; break;
-        				case ConditionalToken::LESS_THAN:
-        					type = ComparisonASTNode::LESS_THAN; break;
-        				case ConditionalToken::LESS_THAN_EQUAL:
-        					type = ComparisonASTNode::LESS_THAN_EQUAL; break;
-        				default:
-							std::stringstream ss;
-							ss << "Unknown conditional operator token, character: ";
-							ss << token->getPosition();
-							throw ParserException(ss.str().c_str());
+						if (stack.size() == 0)
+						{
+							return fail(context, Status::MISSING_OPERAND, token->getPosition(), "Invalid syntax: function given with insuffucient operands");
+						}
+        				ASTNodePtr right = stack.back(); stack.pop_back();
+        				stack.push_back(ASTNodePtr(new Function2ASTNode(Function2ASTNode::POW, left, right)));
         			}
-        			stack.push_front(ASTNodePtr(new ComparisonASTNode(type, left, right)));
-        			continue;
+					break;
+        			default:
+						return fail(context, Status::UNKNOWN_OPERATOR, token->getPosition(), "Unknown function token");
         		}
+        		return true;
+        	}
 
-        		if (token->getType() == Token::LOGICAL)
+        	if (token->getType() == Token::CONDITIONAL)
+        	{
+				if (stack.size() < 2)
+				{
+					return fail(context, Status::MISSING_OPERAND, token->getPosition(), "Invalid syntax: conditional operator given with insuffucient operands");
+				}
+        		SHARED_PTR<ConditionalToken> c = STATIC_POINTER_CAST<ConditionalToken>(token);
+        		ASTNodePtr left = stack.back(); stack.pop_back();
+        		ASTNodePtr right = stack.back(); stack.pop_back();
+        		ComparisonASTNode::ComparisonType type;
+        		switch(c->getConditional())
         		{
-					if (stack.size() < 2)
-					{
-						std::stringstream ss;
-						ss << "Invalid syntax: logical operator given with insuffucient operands, character: ";
-						ss << token->getPosition();
-						throw ParserException(ss.str().c_str());
-					}
-        			SHARED_PTR<LogicalToken> l = STATIC_POINTER_CAST<LogicalToken>(token);
-        			ASTNodePtr left = stack.front(); stack.pop_front();
-        			ASTNodePtr right = stack.front(); stack.pop_front();
-        			LogicalASTNode::OperationType type;
-        			switch(l->getOperator())
-        			{
-        				case LogicalToken::AND:
-        					type = LogicalASTNode::AND; break;
-        				case LogicalToken::OR:
-        					type = LogicalASTNode::OR; break;
-        				default:
-							std::stringstream ss;
-							ss << "Unknown logical operator token, character: ";
-							ss << token->getPosition();
-							throw ParserException(ss.str().c_str());
-        			}
-        			stack.push_front(ASTNodePtr(new LogicalASTNode(type, left, right)));
-					continue;
+        			case ConditionalToken::EQUAL:
+        				type = ComparisonASTNode::EQUAL; break;
+        			case ConditionalToken::NOT_EQUAL:
+        				type = ComparisonASTNode::NOT_EQUAL; break;
+        			case ConditionalToken::GREATER_THAN:
+        				type = ComparisonASTNode::GREATER_THAN; break;
+        			case ConditionalToken::GREATER_THAN_EQUAL:
+        				type = ComparisonASTNode::GREATER_THAN_EQUAL; break;
+        			case ConditionalToken::LESS_THAN:
+        				type = ComparisonASTNode::LESS_THAN; break;
+        			case ConditionalToken::LESS_THAN_EQUAL:
+        				type = ComparisonASTNode::LESS_THAN_EQUAL; break;
+        			default:
+						return fail(context, Status::UNKNOWN_OPERATOR, token->getPosition(), "Unknown conditional operator token");
         		}
+        		stack.push_back(ASTNodePtr(new ComparisonASTNode(type, left, right)));
+        		return true;
+        	}
 
-        		if (token->getType() == Token::TERNARY)
+        	if (token->getType() == Token::LOGICAL)
+        	{
+				if (stack.size() < 2)
+				{
+					return fail(context, Status::MISSING_OPERAND, token->getPosition(), "Invalid syntax: logical operator given with insuffucient operands");
+				}
+        		SHARED_PTR<LogicalToken> l = STATIC_POINTER_CAST<LogicalToken>(token);
+        		ASTNodePtr left = stack.back(); stack.pop_back();
+        		ASTNodePtr right = stack.back(); stack.pop_back();
+        		LogicalASTNode::OperationType type;
+        		switch(l->getOperator())
         		{
-					if (stack.size() < 3)
-					{
-						std::stringstream ss;
-						ss << "Invalid syntax: ternary operator given with insuffucient operands, character: ";
-						ss << token->getPosition();
-						throw ParserException(ss.str().c_str());
-					}
-        			SHARED_PTR<TernaryToken> t = STATIC_POINTER_CAST<TernaryToken>(token);
-        			if (t->getSymbol() == TernaryToken::TERNARY)
-        			{
-        				ASTNodePtr no =  stack.front(); stack.pop_front();
-        				ASTNodePtr yes = stack.front(); stack.pop_front();
-        				ASTNodePtr condition = stack.front(); stack.pop_front();
-
-        				stack.push_front(ASTNodePtr(new BranchASTNode(condition, yes, no)));
-        			}
-        			continue;
+        			case LogicalToken::AND:
+        				type = LogicalASTNode::AND; break;
+        			case LogicalToken::OR:
+        				type = LogicalASTNode::OR; break;
+        			default:
+						return fail(context, Status::UNKNOWN_OPERATOR, token->getPosition(), "Unknown logical operator token");
         		}
+        		stack.push_back(ASTNodePtr(new LogicalASTNode(type, left, right)));
+				return true;
         	}
 
-        	if (stack.size() != 0)
+        	if (token->getType() == Token::TERNARY)
         	{
-        		return stack.front();
+				if (stack.size() < 3)
+				{
+					return fail(context, Status::MISSING_OPERAND, token->getPosition(), "Invalid syntax: ternary operator given with insuffucient operands");
+				}
+        		SHARED_PTR<TernaryToken> t = STATIC_POINTER_CAST<TernaryToken>(token);
+        		if (t->getSymbol() == TernaryToken::TERNARY)
+        		{
+        			ASTNodePtr no =  stack.back(); stack.pop_back();
+        			ASTNodePtr yes = stack.back(); stack.pop_back();
+        			ASTNodePtr condition = stack.back(); stack.pop_back();
+
+        			stack.push_back(ASTNodePtr(new BranchASTNode(condition, yes, no)));
+        		}
+        		return true;
         	}
 
-        	return ASTNodePtr();
+        	return true;
         }
 };
 
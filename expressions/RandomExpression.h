@@ -0,0 +1,226 @@
+#ifndef RANDOMEXPRESSION_H
+#define RANDOMEXPRESSION_H
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <stdint.h>
+
+namespace expr
+{
+
+// Generates random expression text from a seed, for benchmarks and fuzzing. The
+// same seed and options always give the same expressions, on any platform.
+// Every kind of node is produced: arithmetic, functions of one and two
+// arguments, comparisons, logical operators, ternaries, numbers and variables.
+// Exponents are kept to small constants so that most results stay finite.
+class RandomExpression
+{
+	public:
+		struct Options
+		{
+			Options()
+				: depth(4)
+				, width(2)
+				, variables(3)
+				, branches(0.1)
+				, functions(0.2)
+				, comparisons(0.05)
+			{
+			}
+
+			unsigned int depth;     // levels of operators above the leaves
+			unsigned int width;     // subtrees per node, 1 gives a chain of nodes with leaves hanging off it
+			unsigned int variables; // named x0, x1, ...; 0 gives constant expressions
+			double branches;        // chance of a ternary at each level
+			double functions;       // chance of a function call at each level
+			double comparisons;     // chance of a comparison or logical value at each level
+		};
+
+		RandomExpression(uint64_t seed, const Options &options=Options())
+			: m_state(seed ? seed : 1)
+			, m_options(options)
+		{
+			for (unsigned int i=0; i<m_options.variables; i++)
+			{
+				std::ostringstream ss;
+				ss << "x" << i;
+				m_variables.push_back(ss.str());
+			}
+		}
+
+		std::string generate()
+		{
+			std::ostringstream ss;
+			generate(ss);
+			return ss.str();
+		}
+
+		void generate(std::ostream &out)
+		{
+			term(out, m_options.depth);
+		}
+
+		// Names of the variables the expressions may use
+		const std::vector<std::string> &variables() const
+		{
+			return m_variables;
+		}
+
+		// Next value of the generator (xorshift64*)
+		uint64_t next()
+		{
+			m_state ^= m_state >> 12;
+			m_state ^= m_state << 25;
+			m_state ^= m_state >> 27;
+			return m_state * ((uint64_t(0x2545F491) << 32) | 0x4F6CDD1D);
+		}
+
+		// Uniform in [0, 1)
+		double uniform()
+		{
+			return (next() >> 11) * (1.0 / 9007199254740992.0);
+		}
+
+		// Uniform in [0, n)
+		unsigned int below(unsigned int n)
+		{
+			return (unsigned int) (uniform() * n);
+		}
+
+	private:
+		// At most width operands of any node are subtrees, the rest are leaves
+		void operand(std::ostream &out, unsigned int depth, unsigned int &index)
+		{
+			if (index++ < m_options.width)
+			{
+				term(out, depth);
+			}
+			else
+			{
+				leaf(out);
+			}
+		}
+
+		void term(std::ostream &out, unsigned int depth)
+		{
+			if (depth == 0)
+			{
+				leaf(out);
+				return;
+			}
+
+			unsigned int index = 0;
+			double choice = uniform();
+			if (choice < m_options.branches)
+			{
+				out << "(";
+				condition(out, depth - 1, index);
+				out << " ? ";
+				operand(out, depth - 1, index);
+				out << " : ";
+				operand(out, depth - 1, index);
+				out << ")";
+				return;
+			}
+			choice -= m_options.branches;
+			if (choice < m_options.functions)
+			{
+				function(out, depth - 1, index);
+				return;
+			}
+			choice -= m_options.functions;
+			if (choice < m_options.comparisons)
+			{
+				out << "(";
+				condition(out, depth - 1, index);
+				out << ")";
+				return;
+			}
+
+			static const char *operators[] = { " + ", " - ", " * ", " / ", " % ", " + ", " - ", " * " };
+			// Occasionally the whole group is raised to a small power
+			bool power = below(16) == 0;
+			unsigned int operands = m_options.width < 2 ? 2 : m_options.width;
+			out << (power ? "((" : "(");
+			for (unsigned int i=0; i<operands; i++)
+			{
+				if (i)
+				{
+					out << operators[below(8)];
+				}
+				operand(out, depth - 1, index);
+			}
+			out << ")";
+			if (power)
+			{
+				out << " ^ " << (below(2) ? "2" : "0.5") << ")";
+			}
+		}
+
+		void function(std::ostream &out, unsigned int depth, unsigned int &index)
+		{
+			// log( is left out, it is ambiguous with log2( and log10( for the tokenizer
+			static const char *unary[] = { "sin", "cos", "tan", "sqrt", "ceil", "floor", "log2", "log10" };
+			static const char *binary[] = { "min", "max" };
+			unsigned int choice = below(11);
+			if (choice < 8)
+			{
+				out << unary[choice] << "(";
+				operand(out, depth, index);
+				out << ")";
+			}
+			else if (choice < 10)
+			{
+				out << binary[choice - 8] << "(";
+				operand(out, depth, index);
+				out << ", ";
+				operand(out, depth, index);
+				out << ")";
+			}
+			else
+			{
+				out << "pow(";
+				operand(out, depth, index);
+				out << ", " << (below(2) ? "3" : "0.5") << ")";
+			}
+		}
+
+		void condition(std::ostream &out, unsigned int depth, unsigned int &index)
+		{
+			static const char *comparisons[] = { " < ", " <= ", " > ", " >= ", " == ", " != " };
+			operand(out, depth, index);
+			out << comparisons[below(6)];
+			operand(out, depth, index);
+			if (below(4) == 0)
+			{
+				out << (below(2) ? " && " : " || ");
+				leaf(out);
+				out << comparisons[below(6)];
+				leaf(out);
+			}
+		}
+
+		void leaf(std::ostream &out)
+		{
+			if (!m_variables.empty() && below(3) < 2)
+			{
+				out << m_variables[below(m_variables.size())];
+				return;
+			}
+			switch (below(3))
+			{
+				case 0:  out << below(10) + 1; break;
+				case 1:  out << below(100) << "." << below(100) + 1; break;
+				default: out << below(9) + 1 << "e-" << below(3); break;
+			}
+		}
+
+		uint64_t m_state;
+		Options m_options;
+		std::vector<std::string> m_variables;
+};
+
+} // namespace expr
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <cstddef>
+#include <string>
+#include <sstream>
+
+namespace expr
+{
+
+// Result of the non-throwing tryParse/tryEvaluate calls. Only the error code,
+// position and static details are recorded on failure, the human readable
+// message is put together when message() is called.
+class Status
+{
+	public:
+		enum Code
+		{
+			OK,
+
+			// Tokenizer
+			UNKNOWN_TOKEN,
+			UNEXPECTED_END,
+			INVALID_UNARY,
+			EXPECTED_EXPRESSION,
+			EXPECTED_OPERATOR,
+
+			// Parser
+			MISPLACED_SEPARATOR,
+			MISMATCHED_PARENTHESIS,
+			MISSING_OPERAND,
+			UNKNOWN_OPERATOR,
+
+			// Evaluator
+			NO_AST,
+			NO_VARIABLE_MAP,
+			UNDEFINED_VARIABLE,
+			INVALID_AST
+		};
+
+		Status()
+			: m_code(OK)
+			, m_position(npos)
+			, m_detail("")
+			, m_symbol(0)
+		{
+		}
+
+		Status(Code code, size_t position, const char *detail="", char symbol=0)
+			: m_code(code)
+			, m_position(position)
+			, m_detail(detail)
+			, m_symbol(symbol)
+		{
+		}
+
+		bool ok() const
+		{
+			return m_code == OK;
+		}
+
+		Code code() const
+		{
+			return m_code;
+		}
+
+		// Position value of errors that aren't tied to a place in the text
+		static const size_t npos = (size_t) -1;
+
+		// Character offset into the expression text, or npos if the error isn't tied to one
+		size_t position() const
+		{
+			return m_position;
+		}
+
+		// Variable the error relates to, if any
+		const std::string &name() const
+		{
+			return m_name;
+		}
+
+		void setName(const std::string &name)
+		{
+			m_name = name;
+		}
+
+		std::string message() const
+		{
+			std::ostringstream ss;
+			switch(m_code)
+			{
+				case OK:
+					return std::string();
+				case UNKNOWN_TOKEN:
+					ss << "Unknown token '" << m_symbol << "'";
+					break;
+				case EXPECTED_EXPRESSION:
+					ss << "Invalid syntax: " << subject() << " must follow expression";
+					break;
+				case EXPECTED_OPERATOR:
+					ss << "Invalid syntax: " << subject() << " cannot directly follow another expression without an operator between";
+					break;
+				case UNDEFINED_VARIABLE:
+					ss << "No variable '" << m_name << "' defined in VariableMap";
+					break;
+				default:
+					ss << m_detail;
+					break;
+			}
+			if (m_position != npos)
+			{
+				ss << ", character: " << m_position;
+			}
+			return ss.str();
+		}
+
+	private:
+		std::string subject() const
+		{
+			if (m_name.size())
+			{
+				return std::string("variable '") + m_name + "'";
+			}
+			return m_detail;
+		}
+
+		Code m_code;
+		size_t m_position;
+		const char *m_detail; // always a string literal
+		char m_symbol;
+		std::string m_name;
+};
+
+} // namespace expr
+
+#endif
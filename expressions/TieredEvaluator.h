@@ -0,0 +1,116 @@
+#ifndef TIEREDEVALUATOR_H
+#define TIEREDEVALUATOR_H
+
+#ifdef USE_LLVM
+
+#include "AST.h"
+#include "Evaluator.h"
+#include "LLVMCompiler.h"
+
+namespace expr
+{
+
+// Evaluates an expression with the interpreter until it has been evaluated
+// threshold times, then has it compiled on an LLVMCompiler in the background.
+// Calls keep going through the interpreter until the compiled code is ready,
+// from then on they go straight to the compiled code. The interpreted calls
+// profile the ternaries, so the compiled code is laid out for the data it sees.
+// The evaluator must be destroyed before the compiler it uses.
+//
+// Like Evaluator, a TieredEvaluator is for one thread at a time: the
+// interpreter's stacks, the branch profile and the variable map are all shared
+// between calls. Only the hand over of the compiled code from the compiler
+// thread is synchronised, through the task.
+template <typename T>
+class TieredEvaluator
+{
+	public:
+		typedef typename Evaluator<T>::VariableMap VariableMap;
+
+		TieredEvaluator(ASTNodePtr ast, VariableMap *map, LLVMCompiler<T> &compiler, unsigned int threshold=1000)
+			: m_ast(ast)
+			, m_map(map)
+			, m_compiler(compiler)
+			, m_interpreter(ast, map)
+			, m_threshold(threshold)
+			, m_calls(0)
+			, m_compiled(NULL)
+		{
+			m_interpreter.setProfile(&m_profile);
+			if (m_threshold == 0)
+			{
+				compile();
+			}
+		}
+
+		T evaluate()
+		{
+			if (m_compiled)
+			{
+				return m_compiled->evaluate();
+			}
+
+			// Taking the compiled code from the task once it's ready goes through the
+			// task's lock. If compilation failed the expression stays with the interpreter
+			if (m_task && m_task->ready())
+			{
+				try
+				{
+					m_compiled = m_task->wait();
+				}
+				catch (EvaluatorException &)
+				{
+					m_task = typename LLVMCompiler<T>::TaskPtr();
+				}
+				if (m_compiled)
+				{
+					return m_compiled->evaluate();
+				}
+			}
+
+			if (++m_calls == m_threshold && !m_task)
+			{
+				compile();
+			}
+			return m_interpreter.evaluate();
+		}
+
+		// Whether calls have switched over to the compiled code
+		bool compiled() const
+		{
+			return m_compiled != NULL;
+		}
+
+		// Number of calls that went through the interpreter
+		unsigned int interpreted() const
+		{
+			return m_calls;
+		}
+
+	private:
+		// Evaluators are not copyable
+		TieredEvaluator(const TieredEvaluator &);
+		TieredEvaluator &operator=(const TieredEvaluator &);
+
+		// The profile is copied on this thread, before compile() returns
+		void compile()
+		{
+			m_task = m_compiler.compile(m_ast, m_map, NULL, NULL, &m_profile);
+		}
+
+		ASTNodePtr m_ast;
+		VariableMap *m_map;
+		LLVMCompiler<T> &m_compiler;
+		Evaluator<T> m_interpreter;
+		BranchProfile m_profile;
+		unsigned int m_threshold;
+		unsigned int m_calls;
+		LLVMEvaluator<T> *m_compiled; // owned by m_task
+		typename LLVMCompiler<T>::TaskPtr m_task;
+};
+
+} // namespace expr
+
+#endif // USE_LLVM
+
+#endif
@@ -3,11 +3,18 @@
 
 #include "ctype.h" // for isspace, isdigit and isalnum
 #include "string.h" // for memcpy
+#include "stdlib.h" // for strtod and strtol
+#include "locale.h"
+#if defined(__APPLE__) || defined(__FreeBSD__)
+#include <xlocale.h> // for strtod_l
+#endif
 #include "Memory.h"
 #include "Exception.h"
+#include "Status.h"
 #include <string>
 #include <deque>
 #include <sstream>
+#include <locale>
 
 namespace expr
 {
@@ -31,7 +38,7 @@ class Token
 		    ENDOFTEXT
 		};
 
-		Token(TokenType type, int pos)
+		Token(TokenType type, size_t pos)
 			: m_type(type)
 			, m_pos(pos)
         {}
@@ -44,11 +51,17 @@ class Token
 			return m_type;
 		}
 
-		int getPosition()
+		size_t getPosition()
 		{
 			return m_pos;
 		}
 
+		// Used by incremental parsing to move tokens that follow an edit
+		void setPosition(size_t pos)
+		{
+			m_pos = pos;
+		}
+
 		virtual std::string print()
 		{
 			return "";
@@ -56,7 +69,7 @@ class Token
 
     protected:
         TokenType	m_type;
-		int         m_pos;
+		size_t      m_pos;
 };
 typedef SHARED_PTR<Token> TokenPtr;
 
@@ -65,7 +78,7 @@ template<typename T>
 class NumberToken : public Token
 {
 	public:
-		NumberToken(T value, int pos)
+		NumberToken(T value, size_t pos)
 			: Token(NUMBER, pos)
 			, m_value(value)
 		{}
@@ -92,7 +105,7 @@ class NumberToken : public Token
 class VariableToken : public Token
 {
 	public:
-		VariableToken(std::string value, int pos)
+		VariableToken(std::string value, size_t pos)
 			: Token(VARIABLE, pos)
 			, m_value(value)
 		{}
@@ -134,7 +147,7 @@ class FunctionToken : public Token
 				MAX,
 				POW
 			};
-		FunctionToken(FunctionType function, int pos)
+		FunctionToken(FunctionType function, size_t pos)
 			: Token(FUNCTION, pos)
 			, m_function(function)
 		{}
@@ -188,7 +201,7 @@ class FunctionToken : public Token
 class PrecedenceOperator: public Token
 {
 	public:
-		PrecedenceOperator(Token::TokenType type, int pos)
+		PrecedenceOperator(Token::TokenType type, size_t pos)
 			: Token(type, pos)
 		{}
 		virtual ~PrecedenceOperator()
@@ -219,7 +232,7 @@ class OperatorToken : public PrecedenceOperator
 			MOD
 		};
 
-		OperatorToken(OperatorType op, int pos)
+		OperatorToken(OperatorType op, size_t pos)
 			: PrecedenceOperator(Token::OPERATOR, pos)
 			, m_operator(op)
 		{}
@@ -309,7 +322,7 @@ class ConditionalToken : public PrecedenceOperator
 			LESS_THAN_EQUAL
 		};
 
-		ConditionalToken(ConditionalType conditional, int pos)
+		ConditionalToken(ConditionalType conditional, size_t pos)
 			: PrecedenceOperator(Token::CONDITIONAL, pos)
 			, m_conditional(conditional)
 		{}
@@ -375,7 +388,7 @@ class LogicalToken : public PrecedenceOperator
 			OR
 		};
 
-		LogicalToken(OperatorType op, int pos)
+		LogicalToken(OperatorType op, size_t pos)
 			: PrecedenceOperator(Token::LOGICAL, pos)
 			, m_operator(op)
 		{}
@@ -428,7 +441,7 @@ class TernaryToken : public PrecedenceOperator
 			COLON
 		};
 
-		TernaryToken(SymbolType symbol, int pos)
+		TernaryToken(SymbolType symbol, size_t pos)
 			: PrecedenceOperator(Token::TERNARY, pos)
 			, m_symbol(symbol)
 		{}
@@ -478,7 +491,7 @@ class UnaryToken: public PrecedenceOperator
 			POSITIVE,
 			NEGATIVE
 		};
-		UnaryToken(UnaryType direction, int pos)
+		UnaryToken(UnaryType direction, size_t pos)
 			: PrecedenceOperator(Token::UNARY, pos)
 			, m_direction(direction)
 		{}
@@ -524,8 +537,8 @@ class UnaryToken: public PrecedenceOperator
 class TokenizerException : public Exception
 {
     public:
-		TokenizerException(const char * message)
-        : Exception(message)
+		TokenizerException(const char * message, size_t position=npos)
+        : Exception(message, position)
         {
         }
 };
@@ -533,11 +546,21 @@ class TokenizerException : public Exception
 template <typename T>
 class Tokenizer
 {
-	typedef std::deque<TokenPtr> TokVec;
 	public:
 		Tokenizer(const char *text)
 			: m_text(text)
+			, m_length(strlen(text))
 			, m_index(0)
+			, m_start(0)
+		{
+		}
+
+		// The text does not need to be null terminated, only the first length characters are read
+		Tokenizer(const char *text, size_t length)
+			: m_text(text)
+			, m_length(length)
+			, m_index(0)
+			, m_start(0)
 		{
 		}
 
@@ -545,424 +568,561 @@ class Tokenizer
 		{
 		}
 
-		void tokenize(TokVec &tokens)
+		// Any container providing size(), back() and push_back() can receive the tokens,
+		// this lets a ParserContext reuse its token buffer between calls
+		template <typename TokenContainer>
+		void tokenize(TokenContainer &tokens)
 		{
-			while (m_text[m_index] != 0)
+			Status status = tryTokenize(tokens);
+			if (!status.ok())
 			{
-				skipWhitespace();
-				if (m_text[m_index] == 0)
-				{
-					break;
-				}
+				throw TokenizerException(status.message().c_str(), status.position());
+			}
+		}
 
-				// Check for numbers
-				if (isdigit(m_text[m_index]) || m_text[m_index] == '.')
-				{
-					tokens.push_back(TokenPtr(new NumberToken<T>(getNumber(), m_index)));
-					continue;
-				}
+		// As tokenize, but errors are returned rather than thrown
+		template <typename TokenContainer>
+		Status tryTokenize(TokenContainer &tokens)
+		{
+			ReadResult result;
+			while ((result = read(tokens)) == READ)
+			{
+			}
+			if (result == FAILED || !tryFinish(tokens))
+			{
+				return m_status;
+			}
+			return Status();
+		}
+
+		// Read a single token onto the end of tokens, returns false once the end
+		// of the text has been reached
+		template <typename TokenContainer>
+		bool next(TokenContainer &tokens)
+		{
+			ReadResult result = read(tokens);
+			if (result == FAILED)
+			{
+				throw TokenizerException(m_status.message().c_str(), m_status.position());
+			}
+			return result == READ;
+		}
+
+		// Check that the text ended on a complete expression and add the endoftext token
+		template <typename TokenContainer>
+		void finish(TokenContainer &tokens)
+		{
+			if (!tryFinish(tokens))
+			{
+				throw TokenizerException(m_status.message().c_str(), m_status.position());
+			}
+		}
+
+		// Current read position in the text
+		size_t index() const
+		{
+			return m_index;
+		}
+
+		// Move the read position, used to resume tokenizing part way through a text
+		void seek(size_t index)
+		{
+			m_index = index;
+		}
+
+	private:
+		enum ReadResult
+		{
+			READ,
+			END,
+			FAILED
+		};
+
+		template <typename TokenContainer>
+		ReadResult read(TokenContainer &tokens)
+		{
+			skipWhitespace();
+			if (m_index >= m_length)
+			{
+				return END;
+			}
+			m_start = m_index;
+
+			// Check for numbers
+			if (isdigit(peek()) || peek() == '.')
+			{
+				tokens.push_back(TokenPtr(new NumberToken<T>(getNumber(), m_start)));
+				return READ;
+			}
 
-				// Check for single character operators
+			// Check for single character operators
+			{
+				bool match = false;
+				switch(peek())
 				{
-					bool match = false;
-					switch(m_text[m_index])
+					case '+':
 					{
-						case '+':
-						{
-							TokenPtr token;
+						TokenPtr token;
 
-							// Attempt to detect unary minus
-							if (tokens.size() == 0)
+						// Attempt to detect unary minus
+						if (tokens.size() == 0)
+						{
+							// No tokens before, so unary
+							token = TokenPtr(new UnaryToken(UnaryToken::POSITIVE, m_start));
+						}
+						else
+						{
+							if (tokens.back()->getType() == Token::CLOSE_PARENTHESIS ||
+								tokens.back()->getType() == Token::NUMBER            ||
+								tokens.back()->getType() == Token::VARIABLE )
+							{
+								token = TokenPtr(new OperatorToken(OperatorToken::PLUS, m_start));
+							}
+							else if (tokens.back()->getType() == Token::FUNCTION)
 							{
-								// No tokens before, so unary
-								token = TokenPtr(new UnaryToken(UnaryToken::POSITIVE, m_index));
+								return fail(Status::INVALID_UNARY, m_start, "Invalid syntax: unary positive '+' following function declaration");
+							}
+							else if (tokens.back()->getType() == Token::UNARY)
+							{
+								return fail(Status::INVALID_UNARY, m_start, "Invalid syntax: unary positive '+' following unary declaration");
 							}
 							else
 							{
-								if (tokens.back()->getType() == Token::CLOSE_PARENTHESIS ||
-									tokens.back()->getType() == Token::NUMBER            ||
-									tokens.back()->getType() == Token::VARIABLE )
-								{
-									token = TokenPtr(new OperatorToken(OperatorToken::PLUS, m_index));
-								}
-								else if (tokens.back()->getType() == Token::FUNCTION)
-								{
-									std::stringstream ss;
-									ss << "Invalid syntax: unary positive '+' following function declaration, character: ";
-									ss << m_index;
-									throw TokenizerException(ss.str().c_str());
-								}
-								else if (tokens.back()->getType() == Token::UNARY)
-								{
-									std::stringstream ss;
-									ss << "Invalid syntax: unary positive '+' following unary declaration, character: ";
-									ss << m_index;
-									throw TokenizerException(ss.str().c_str());
-								}
-								else
-								{
-									token = TokenPtr(new UnaryToken(UnaryToken::POSITIVE, m_index));
-								}
+								token = TokenPtr(new UnaryToken(UnaryToken::POSITIVE, m_start));
 							}
-							tokens.push_back(token);
-							match = true;
-							break;
 						}
-						case '-':
-						{
-							TokenPtr token;
+						tokens.push_back(token);
+						match = true;
+						break;
+					}
+					case '-':
+					{
+						TokenPtr token;
 
-							// Attempt to detect unary minus
-							if (tokens.size() == 0)
+						// Attempt to detect unary minus
+						if (tokens.size() == 0)
+						{
+							// No tokens before, so unary
+							token = TokenPtr(new UnaryToken(UnaryToken::NEGATIVE, m_start));
+						}
+						else
+						{
+							if (tokens.back()->getType() == Token::CLOSE_PARENTHESIS ||
+								tokens.back()->getType() == Token::NUMBER            ||
+								tokens.back()->getType() == Token::VARIABLE )
+							{
+								token = TokenPtr(new OperatorToken(OperatorToken::MINUS, m_start));
+							}
+							else if (tokens.back()->getType() == Token::FUNCTION)
+							{
+								return fail(Status::INVALID_UNARY, m_start, "Invalid syntax: unary negative '-' following function declaration");
+							}
+							else if (tokens.back()->getType() == Token::UNARY)
 							{
-								// No tokens before, so unary
-								token = TokenPtr(new UnaryToken(UnaryToken::NEGATIVE, m_index));
+								return fail(Status::INVALID_UNARY, m_start, "Invalid syntax: unary negative '-' following unary declaration");
 							}
 							else
 							{
-								if (tokens.back()->getType() == Token::CLOSE_PARENTHESIS ||
-									tokens.back()->getType() == Token::NUMBER            ||
-									tokens.back()->getType() == Token::VARIABLE )
-								{
-									token = TokenPtr(new OperatorToken(OperatorToken::MINUS, m_index));
-								}
-								else if (tokens.back()->getType() == Token::FUNCTION)
-								{
-									std::stringstream ss;
-									ss << "Invalid syntax: unary negative '-' following function declaration, character: ";
-									ss << m_index;
-									throw TokenizerException(ss.str().c_str());
-								}
-								else if (tokens.back()->getType() == Token::UNARY)
-								{
-									std::stringstream ss;
-									ss << "Invalid syntax: unary negative '-' following unary declaration, character: ";
-									ss << m_index;
-									throw TokenizerException(ss.str().c_str());
-								}
-								else
-								{
-									token = TokenPtr(new UnaryToken(UnaryToken::NEGATIVE, m_index));
-								}
+								token = TokenPtr(new UnaryToken(UnaryToken::NEGATIVE, m_start));
 							}
-							tokens.push_back(token);
-							match = true;
-							break;
 						}
-						case '*':
-							followsExpression("multiplication operator '*'", tokens);
-							tokens.push_back(TokenPtr(new OperatorToken(OperatorToken::MUL, m_index)));
-							match = true;
-							break;
-						case '/':
-							followsExpression("division operator '/'", tokens);
-							tokens.push_back(TokenPtr(new OperatorToken(OperatorToken::DIV, m_index)));
-							match = true;
-							break;
-						case '^':
-							followsExpression("power operator '^'", tokens);
-							tokens.push_back(TokenPtr(new OperatorToken(OperatorToken::POW, m_index)));
-							match = true;
-							break;
-						case '%':
-							followsExpression("modulus operator '%'", tokens);
-							tokens.push_back(TokenPtr(new OperatorToken(OperatorToken::MOD, m_index)));
-							match = true;
-							break;
-						case '?':
-							followsExpression("ternary declaration '?'", tokens);
-							tokens.push_back(TokenPtr(new TernaryToken(TernaryToken::TERNARY, m_index)));
-							match = true;
-							break;
-						case ':':
-							followsExpression("ternary divider ':'", tokens);
-							tokens.push_back(TokenPtr(new TernaryToken(TernaryToken::COLON, m_index)));
-							match = true;
-							break;
-						case '(':
-							tokens.push_back(TokenPtr(new Token(Token::OPEN_PARENTHESIS, m_index)));
-							match = true;
-							break;
-						case ')':
-							tokens.push_back(TokenPtr(new Token(Token::CLOSE_PARENTHESIS, m_index)));
-							match = true;
-							break;
-						case ',':
-							followsExpression("comma separator ','", tokens);
-							tokens.push_back(TokenPtr(new Token(Token::COMMA, m_index)));
-							match = true;
-							break;
-						default:
-							break;
-					}
-					if (match)
-					{
-						m_index++;
-						continue;
+						tokens.push_back(token);
+						match = true;
+						break;
 					}
+					case '*':
+						if (!followsExpression("multiplication operator '*'", tokens))
+						{
+							return FAILED;
+						}
+						tokens.push_back(TokenPtr(new OperatorToken(OperatorToken::MUL, m_start)));
+						match = true;
+						break;
+					case '/':
+						if (!followsExpression("division operator '/'", tokens))
+						{
+							return FAILED;
+						}
+						tokens.push_back(TokenPtr(new OperatorToken(OperatorToken::DIV, m_start)));
+						match = true;
+						break;
+					case '^':
+						if (!followsExpression("power operator '^'", tokens))
+						{
+							return FAILED;
+						}
+						tokens.push_back(TokenPtr(new OperatorToken(OperatorToken::POW, m_start)));
+						match = true;
+						break;
+					case '%':
+						if (!followsExpression("modulus operator '%'", tokens))
+						{
+							return FAILED;
+						}
+						tokens.push_back(TokenPtr(new OperatorToken(OperatorToken::MOD, m_start)));
+						match = true;
+						break;
+					case '?':
+						if (!followsExpression("ternary declaration '?'", tokens))
+						{
+							return FAILED;
+						}
+						tokens.push_back(TokenPtr(new TernaryToken(TernaryToken::TERNARY, m_start)));
+						match = true;
+						break;
+					case ':':
+						if (!followsExpression("ternary divider ':'", tokens))
+						{
+							return FAILED;
+						}
+						tokens.push_back(TokenPtr(new TernaryToken(TernaryToken::COLON, m_start)));
+						match = true;
+						break;
+					case '(':
+						tokens.push_back(TokenPtr(new Token(Token::OPEN_PARENTHESIS, m_start)));
+						match = true;
+						break;
+					case ')':
+						tokens.push_back(TokenPtr(new Token(Token::CLOSE_PARENTHESIS, m_start)));
+						match = true;
+						break;
+					case ',':
+						if (!followsExpression("comma separator ','", tokens))
+						{
+							return FAILED;
+						}
+						tokens.push_back(TokenPtr(new Token(Token::COMMA, m_start)));
+						match = true;
+						break;
+					default:
+						break;
+				}
+				if (match)
+				{
+					m_index++;
+					return READ;
 				}
+			}
 
-				// Look for known two character keywords
+			// Look for known two character keywords
+			{
+				bool match = false;
+				std::string word;
+				if (m_index + 1 < m_length)
 				{
-					bool match = false;
-					std::string word;
-					if (m_text[m_index+1] != 0)
-					{
-						word = m_text[m_index];
-						word += m_text[m_index+1];
+					word = peek();
+					word += peek(1);
 
-						if (word == "==")
+					if (word == "==")
+					{
+						if (!followsExpression("equality conditional '=='", tokens))
 						{
-							followsExpression("equality conditional '=='", tokens);
-							tokens.push_back(TokenPtr(new ConditionalToken(ConditionalToken::EQUAL, m_index)));
-							m_index++;
-							match = true;
+							return FAILED;
 						}
-						else if (word == "!=")
-						{
-							followsExpression("inequality conditional '!='", tokens);
-							tokens.push_back(TokenPtr(new ConditionalToken(ConditionalToken::NOT_EQUAL, m_index)));
-							m_index++;
-							match = true;
-						}
-						else if (word == "<=")
+						tokens.push_back(TokenPtr(new ConditionalToken(ConditionalToken::EQUAL, m_start)));
+						m_index++;
+						match = true;
+					}
+					else if (word == "!=")
+					{
+						if (!followsExpression("inequality conditional '!='", tokens))
 						{
-							followsExpression("less-than-or-equal conditional '<='", tokens);
-							tokens.push_back(TokenPtr(new ConditionalToken(ConditionalToken::LESS_THAN_EQUAL, m_index)));
-							m_index++;
-							match = true;
+							return FAILED;
 						}
-						else if (word == ">=")
+						tokens.push_back(TokenPtr(new ConditionalToken(ConditionalToken::NOT_EQUAL, m_start)));
+						m_index++;
+						match = true;
+					}
+					else if (word == "<=")
+					{
+						if (!followsExpression("less-than-or-equal conditional '<='", tokens))
 						{
-							followsExpression("greater-than-or-equal conditional '>='", tokens);
-							tokens.push_back(TokenPtr(new ConditionalToken(ConditionalToken::GREATER_THAN_EQUAL, m_index)));
-							m_index++;
-							match = true;
+							return FAILED;
 						}
-						else if (word == "&&")
+						tokens.push_back(TokenPtr(new ConditionalToken(ConditionalToken::LESS_THAN_EQUAL, m_start)));
+						m_index++;
+						match = true;
+					}
+					else if (word == ">=")
+					{
+						if (!followsExpression("greater-than-or-equal conditional '>='", tokens))
 						{
-							followsExpression("logical and operator '&&'", tokens);
-							tokens.push_back(TokenPtr(new LogicalToken(LogicalToken::AND, m_index)));
-							m_index++;
-							match = true;
+							return FAILED;
 						}
-						else if (word == "||")
+						tokens.push_back(TokenPtr(new ConditionalToken(ConditionalToken::GREATER_THAN_EQUAL, m_start)));
+						m_index++;
+						match = true;
+					}
+					else if (word == "&&")
+					{
+						if (!followsExpression("logical and operator '&&'", tokens))
 						{
-							followsExpression("logical or operator '||'", tokens);
-							tokens.push_back(TokenPtr(new LogicalToken(LogicalToken::OR, m_index)));
-							m_index++;
-							match = true;
+							return FAILED;
 						}
-						else
+						tokens.push_back(TokenPtr(new LogicalToken(LogicalToken::AND, m_start)));
+						m_index++;
+						match = true;
+					}
+					else if (word == "||")
+					{
+						if (!followsExpression("logical or operator '||'", tokens))
 						{
-							// Look for single characters that are substrings of the words above
-							switch(m_text[m_index])
-							{
-								case '<':
-									followsExpression("less-than conditional '<'", tokens);
-									tokens.push_back(TokenPtr(new ConditionalToken(ConditionalToken::LESS_THAN, m_index)));
-									match = true;
-									break;
-								case '>':
-									followsExpression("greater-than conditional '>'", tokens);
-									tokens.push_back(TokenPtr(new ConditionalToken(ConditionalToken::GREATER_THAN, m_index)));
-									match = true;
-									break;
-								default:
-									break;
-							}
-
+							return FAILED;
 						}
+						tokens.push_back(TokenPtr(new LogicalToken(LogicalToken::OR, m_start)));
+						m_index++;
+						match = true;
 					}
-					if (match)
+					else
 					{
-						m_index++; // 2 character words will have already incremented once
-						continue;
+						// Look for single characters that are substrings of the words above
+						switch(peek())
+						{
+							case '<':
+								if (!followsExpression("less-than conditional '<'", tokens))
+								{
+									return FAILED;
+								}
+								tokens.push_back(TokenPtr(new ConditionalToken(ConditionalToken::LESS_THAN, m_start)));
+								match = true;
+								break;
+							case '>':
+								if (!followsExpression("greater-than conditional '>'", tokens))
+								{
+									return FAILED;
+								}
+								tokens.push_back(TokenPtr(new ConditionalToken(ConditionalToken::GREATER_THAN, m_start)));
+								match = true;
+								break;
+							default:
+								break;
+						}
+
 					}
 				}
+				if (match)
+				{
+					m_index++; // 2 character words will have already incremented once
+					return READ;
+				}
+			}
+
 
+			// Look for multi character keywords or variables
+			{
+				bool match = false;
+				std::string word;
 
-				// Look for multi character keywords or variables
+				while (m_index < m_length)
 				{
-					bool match = false;
-					std::string word;
+					char c = peek();
 
-					while (m_text[m_index] != 0)
+					// Only proceed if character is alphanumeric or underscore
+					if (!isalnum(c) && c != '_')
 					{
-						char c = m_text[m_index];
-
-						// Only proceed if character is alphanumeric or underscore
-						if (!isalnum(c) && c != '_')
-						{
-							break;
-						}
+						break;
+					}
 
-						word +=c;
-						m_index++;
+					word +=c;
+					m_index++;
 
-						if (word ==  "sin")
+					if (word ==  "sin")
+					{
+						if (!expressionAllowed("sin", tokens))
 						{
-							expressionAllowed("sin", tokens);
-							tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::SIN, m_index)));
-							match = true;
-							break;
+							return FAILED;
 						}
-						else if (word == "cos")
+						tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::SIN, m_start)));
+						match = true;
+						break;
+					}
+					else if (word == "cos")
+					{
+						if (!expressionAllowed("cos", tokens))
 						{
-							expressionAllowed("cos", tokens);
-							tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::COS, m_index)));
-							match = true;
-							break;
+							return FAILED;
 						}
-						else if (word == "tan")
+						tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::COS, m_start)));
+						match = true;
+						break;
+					}
+					else if (word == "tan")
+					{
+						if (!expressionAllowed("tan", tokens))
 						{
-							expressionAllowed("tan", tokens);
-							tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::TAN, m_index)));
-							match = true;
-							break;
+							return FAILED;
 						}
-						else if (word == "sqrt")
+						tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::TAN, m_start)));
+						match = true;
+						break;
+					}
+					else if (word == "sqrt")
+					{
+						if (!expressionAllowed("sqrt", tokens))
 						{
-							expressionAllowed("sqrt", tokens);
-							tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::SQRT, m_index)));
-							match = true;
-							break;
+							return FAILED;
 						}
-						else if (word == "ceil")
+						tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::SQRT, m_start)));
+						match = true;
+						break;
+					}
+					else if (word == "ceil")
+					{
+						if (!expressionAllowed("ceil", tokens))
 						{
-							expressionAllowed("ceil", tokens);
-							tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::CEIL, m_index)));
-							match = true;
-							break;
+							return FAILED;
 						}
-						else if (word == "floor")
+						tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::CEIL, m_start)));
+						match = true;
+						break;
+					}
+					else if (word == "floor")
+					{
+						if (!expressionAllowed("floor", tokens))
 						{
-							expressionAllowed("floor", tokens);
-							tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::FLOOR, m_index)));
-							match = true;
-							break;
+							return FAILED;
 						}
-						else if (word == "min")
+						tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::FLOOR, m_start)));
+						match = true;
+						break;
+					}
+					else if (word == "min")
+					{
+						if (!expressionAllowed("min", tokens))
 						{
-							expressionAllowed("min", tokens);
-							tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::MIN, m_index)));
-							match = true;
-							break;
+							return FAILED;
 						}
-						else if (word == "max")
+						tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::MIN, m_start)));
+						match = true;
+						break;
+					}
+					else if (word == "max")
+					{
+						if (!expressionAllowed("max", tokens))
 						{
-							expressionAllowed("max", tokens);
-							tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::MAX, m_index)));
-							match = true;
-							break;
+							return FAILED;
 						}
-						else if (word == "pow")
+						tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::MAX, m_start)));
+						match = true;
+						break;
+					}
+					else if (word == "pow")
+					{
+						if (!expressionAllowed("pow", tokens))
 						{
-							expressionAllowed("pow", tokens);
-							tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::POW, m_index)));
-							match = true;
-							break;
+							return FAILED;
 						}
-						else if (word == "log")
+						tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::POW, m_start)));
+						match = true;
+						break;
+					}
+					else if (word == "log")
+					{
+						// Check for other versions of log
+						if (peek() == '2')
 						{
-							// Check for other versions of log
-							if (m_text[m_index] == '2')
+							if (!expressionAllowed("log2", tokens))
 							{
-								expressionAllowed("log2", tokens);
-								m_index++;
-								tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::LOG2, m_index)));
+								return FAILED;
 							}
-							else if (m_text[m_index] == '1')
+							m_index++;
+							tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::LOG2, m_start)));
+						}
+						else if (peek() == '1')
+						{
+							if (peek(1) == '0')
 							{
-								if (m_text[m_index + 1] == '0')
-								{
-								expressionAllowed("log10", tokens);
-									m_index+=2;
-									tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::LOG10, m_index)));
-								}
-							}
-							else
+							if (!expressionAllowed("log10", tokens))
 							{
-									expressionAllowed("log", tokens);
-									m_index+=2;
-								tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::LOG, m_index)));
+								return FAILED;
+							}
+								m_index+=2;
+								tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::LOG10, m_start)));
 							}
-							match = true;
-							break;
 						}
-
+						else
+						{
+								if (!expressionAllowed("log", tokens))
+								{
+									return FAILED;
+								}
+								m_index+=2;
+							tokens.push_back(TokenPtr(new FunctionToken(FunctionToken::LOG, m_start)));
+						}
+						match = true;
+						break;
 					}
 
-					if (match)
-					{
-						continue;
-					}
-					else
+				}
+
+				if (match)
+				{
+					return READ;
+				}
+				else
+				{
+					if (word != "")
 					{
-						if (word != "")
+						if (!expressionAllowed("variable", tokens, &word))
 						{
-							expressionAllowed(std::string("variable '") + word + "'", tokens);
-							tokens.push_back(TokenPtr(new VariableToken(word, m_index)));
-							continue;
+							return FAILED;
 						}
+						tokens.push_back(TokenPtr(new VariableToken(word, m_start)));
+						return READ;
 					}
 				}
-				// Don't know what this token is
-				std::stringstream ss;
-				ss << "Unknown token '" << m_text[m_index] << "', character: ";
-				ss << m_index;
-				throw TokenizerException(ss.str().c_str());
-
-
 			}
+			// Don't know what this token is
+			return fail(Status::UNKNOWN_TOKEN, m_start, "", peek());
+		}
 
-			// add the endoftext token
+		template <typename TokenContainer>
+		bool tryFinish(TokenContainer &tokens)
+		{
 			if (tokens.size() != 0)
 			{
 				if (tokens.back()->getType() != Token::NUMBER         &&
 					tokens.back()->getType() != Token::VARIABLE       &&
 					tokens.back()->getType() != Token::CLOSE_PARENTHESIS )
 				{
-					std::stringstream ss;
-					ss << "Unexpected end of expression, character: " << m_index;
-					throw TokenizerException(ss.str().c_str());
+					fail(Status::UNEXPECTED_END, m_index, "Unexpected end of expression");
+					return false;
 				}
 			}
 			tokens.push_back(TokenPtr(new Token(Token::ENDOFTEXT, m_index)));
+			return true;
 		}
 
-	private:
+		ReadResult fail(Status::Code code, size_t position, const char *detail, char symbol=0)
+		{
+			m_status = Status(code, position, detail, symbol);
+			return FAILED;
+		}
 
 		void skipWhitespace()
 		{
-			while(isspace(m_text[m_index]))
+			while(isspace(peek()))
 			{
 				m_index++;
 			}
 		}
 
-		void followsExpression(std::string descriptor, TokVec &tokens)
+		template <typename TokenContainer>
+		bool followsExpression(const char *descriptor, TokenContainer &tokens)
 		{
-			if (tokens.size() == 0)
-			{
-				std::stringstream ss;
-				ss << "Invalid syntax: " << descriptor << " must follow expression, character: ";
-				ss << m_index +1;
-				throw TokenizerException(ss.str().c_str());
-			}
-
-			if (tokens.back()->getType() != Token::NUMBER         &&
-				tokens.back()->getType() != Token::VARIABLE       &&
-				tokens.back()->getType() != Token::CLOSE_PARENTHESIS )
+			if (tokens.size() == 0 ||
+				(tokens.back()->getType() != Token::NUMBER         &&
+				 tokens.back()->getType() != Token::VARIABLE       &&
+				 tokens.back()->getType() != Token::CLOSE_PARENTHESIS ))
 			{
-				std::stringstream ss;
-				ss << "Invalid syntax: " << descriptor << " must follow expression, character: ";
-				ss << m_index + 1;
-				throw TokenizerException(ss.str().c_str());
+				fail(Status::EXPECTED_EXPRESSION, m_start, descriptor);
+				return false;
 			}
+			return true;
 		}
 
-		void expressionAllowed(std::string descriptor, TokVec &tokens)
+		template <typename TokenContainer>
+		bool expressionAllowed(const char *descriptor, TokenContainer &tokens, const std::string *variable=NULL)
 		{
 			if (tokens.size() != 0)
 			{
@@ -971,67 +1131,131 @@ class Tokenizer
 					tokens.back()->getType() == Token::FUNCTION       ||
 					tokens.back()->getType() == Token::CLOSE_PARENTHESIS )
 				{
-					std::stringstream ss;
-					ss << "Invalid syntax: " << descriptor << " cannot directly follow another expression without an operator between, character: ";
-					ss << m_index;
-					throw TokenizerException(ss.str().c_str());
+					fail(Status::EXPECTED_OPERATOR, m_start, descriptor);
+					if (variable)
+					{
+						m_status.setName(*variable);
+					}
+					return false;
 				}
 			}
+			return true;
 		}
 
 		T getNumber()
 		{
-			int index = m_index;
-			std::stringstream ss;
-			T value;
+			size_t index = m_index;
 
 			// loop through till we find a non digit
-			while(isdigit(m_text[m_index]))
+			while(isdigit(peek()))
 			{
 				m_index++;
 			}
 			// check for decimal point
-			if(m_text[m_index] == '.')
+			if(peek() == '.')
 			{
 				m_index++;
 
 				// Add the digits after the decimal point
-				while(isdigit(m_text[m_index]))
+				while(isdigit(peek()))
 				{
 					m_index++;
 				}
 			}
 			// check for exponent
-			if(m_text[m_index] == 'e' || m_text[m_index] == 'E')
+			if(peek() == 'e' || peek() == 'E')
 			{
 				m_index++;
-				if (m_text[m_index] == '+' || m_text[m_index] == '-')
+				if (peek() == '+' || peek() == '-')
 				{
 					m_index++;
 				}
 
 				// Add the rest of the digits
-				while(isdigit(m_text[m_index]))
+				while(isdigit(peek()))
 				{
 					m_index++;
 				}
 			}
 
-			// Convert from char *to T via stringstream
-			char *number = new char[m_index - index +1];
-			memcpy(number, &m_text[index], (m_index - index)*sizeof(char));
-			number[m_index-index] = '\0';
+			// Copy into a terminated buffer on the stack, only very long numbers need the heap
+			size_t length = m_index - index;
+			if (length < 64)
+			{
+				char number[64];
+				memcpy(number, &m_text[index], length*sizeof(char));
+				number[length] = '\0';
+				return convertNumber(number);
+			}
+			return convertNumber(std::string(&m_text[index], length).c_str());
+		}
+
+		// Convert from char *to T via stringstream, the common types are specialised
+		// below to avoid constructing a stream for every number
+		static T convertNumber(const char *number)
+		{
+			std::stringstream ss;
+			T value;
+			ss.imbue(std::locale::classic());
 			ss << number;
 			ss >> value;
-			delete[] number;
 			return value;
+		}
 
+		// Characters past the end of the text read as null
+		char peek(size_t offset=0)
+		{
+			return (m_index + offset < m_length) ? m_text[m_index + offset] : '\0';
 		}
 
 		const char * m_text;
-		int m_index;
+		size_t m_length;
+		size_t m_index;
+		size_t m_start; // start of the token being read, tokens and their errors are reported here
+		Status m_status;
 };
 
+// Expressions always use '.' as the decimal point, so numbers are converted in
+// the C locale rather than whatever locale the application has set
+#if defined(__unix__) || defined(__APPLE__)
+inline locale_t numberLocale()
+{
+	static locale_t locale = newlocale(LC_ALL_MASK, "C", (locale_t) 0);
+	return locale;
+}
+
+template <> inline float Tokenizer<float>::convertNumber(const char *number)
+{
+	return strtof_l(number, NULL, numberLocale());
+}
+
+template <> inline double Tokenizer<double>::convertNumber(const char *number)
+{
+	return strtod_l(number, NULL, numberLocale());
+}
+#elif defined(_MSC_VER)
+inline _locale_t numberLocale()
+{
+	static _locale_t locale = _create_locale(LC_ALL, "C");
+	return locale;
+}
+
+template <> inline float Tokenizer<float>::convertNumber(const char *number)
+{
+	return _strtof_l(number, NULL, numberLocale());
+}
+
+template <> inline double Tokenizer<double>::convertNumber(const char *number)
+{
+	return _strtod_l(number, NULL, numberLocale());
+}
+#endif
+
+template <> inline int Tokenizer<int>::convertNumber(const char *number)
+{
+	return (int) strtol(number, NULL, 10);
+}
+
 } // namespace expr
 
 #endif
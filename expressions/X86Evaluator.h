@@ -0,0 +1,540 @@
+#ifndef X86EVALUATOR_H
+#define X86EVALUATOR_H
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+
+#include "math.h"
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "AST.h"
+#include "Evaluator.h"
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+namespace expr
+{
+
+// Instruction prefix and libm functions for each value type
+template <typename T>
+struct X86Traits;
+
+template <>
+struct X86Traits<float>
+{
+	typedef float (*Function1)(float);
+	typedef float (*Function2)(float, float);
+
+	static const unsigned char prefix = 0xF3; // ss instructions
+	static const bool wide = false;
+
+	static Function1 function(Function1ASTNode::Function1Type function)
+	{
+		switch (function)
+		{
+			case Function1ASTNode::SIN:   return ::sinf;
+			case Function1ASTNode::COS:   return ::cosf;
+			case Function1ASTNode::TAN:   return ::tanf;
+			case Function1ASTNode::SQRT:  return ::sqrtf;
+			case Function1ASTNode::LOG:   return ::logf;
+			case Function1ASTNode::LOG2:  return ::log2f;
+			case Function1ASTNode::LOG10: return ::log10f;
+			case Function1ASTNode::CEIL:  return ::ceilf;
+			case Function1ASTNode::FLOOR: return ::floorf;
+			default: return NULL;
+		}
+	}
+
+	static Function2 pow() { return ::powf; }
+	static Function2 mod() { return ::fmodf; }
+};
+
+template <>
+struct X86Traits<double>
+{
+	typedef double (*Function1)(double);
+	typedef double (*Function2)(double, double);
+
+	static const unsigned char prefix = 0xF2; // sd instructions
+	static const bool wide = true;
+
+	static Function1 function(Function1ASTNode::Function1Type function)
+	{
+		switch (function)
+		{
+			case Function1ASTNode::SIN:   return ::sin;
+			case Function1ASTNode::COS:   return ::cos;
+			case Function1ASTNode::TAN:   return ::tan;
+			case Function1ASTNode::SQRT:  return ::sqrt;
+			case Function1ASTNode::LOG:   return ::log;
+			case Function1ASTNode::LOG2:  return ::log2;
+			case Function1ASTNode::LOG10: return ::log10;
+			case Function1ASTNode::CEIL:  return ::ceil;
+			case Function1ASTNode::FLOOR: return ::floor;
+			default: return NULL;
+		}
+	}
+
+	static Function2 pow() { return ::pow; }
+	static Function2 mod() { return ::fmod; }
+};
+
+
+// Compiles an expression straight to x86-64 machine code, without LLVM. The
+// code uses scalar SSE instructions and calls libm for everything else, so it
+// gives the same results as Evaluator<T>. Compiling takes microseconds, which
+// makes it worth using even for expressions which are only evaluated a few
+// thousand times. Available for float and double.
+template <typename T>
+class X86Evaluator
+{
+	public:
+		typedef std::map<std::string, T> VariableMap;
+
+		// Evaluates the expression for a single row, slots holds the value of each
+		// entry of variables()
+		typedef T (*Function)(const T *slots);
+
+		X86Evaluator(ASTNodePtr ast, VariableMap *map=NULL)
+			: m_map(map)
+			, m_memory(NULL)
+			, m_size(0)
+			, m_function(NULL)
+			, m_depth(0)
+			, m_frame(0)
+		{
+			collectVariables<T>(ast, m_variables);
+			generate(ast);
+			install();
+		}
+
+		~X86Evaluator()
+		{
+			if (m_memory)
+			{
+				munmap(m_memory, m_size);
+			}
+		}
+
+		// Evaluate with the variables from the map given on construction
+		T evaluate()
+		{
+			if (m_sources.size() != m_variables.size())
+			{
+				bind();
+			}
+
+			// Most expressions only use a handful of variables
+			T stack[16];
+			std::vector<T> heap;
+			T *slots = stack;
+			if (m_sources.size() > 16)
+			{
+				heap.resize(m_sources.size());
+				slots = &heap[0];
+			}
+			for (size_t i=0; i<m_sources.size(); i++)
+			{
+				slots[i] = *m_sources[i];
+			}
+			return m_function(slots);
+		}
+
+		T evaluate(const T *slots)
+		{
+			return m_function(slots);
+		}
+
+		Function function() const
+		{
+			return m_function;
+		}
+
+		// Variables in the order the slots are expected in
+		const std::vector<std::string> &variables() const
+		{
+			return m_variables;
+		}
+
+		// Bytes of machine code generated for the expression
+		size_t codeSize() const
+		{
+			return m_code.size();
+		}
+
+	private:
+		// Evaluators are not copyable
+		X86Evaluator(const X86Evaluator &);
+		X86Evaluator &operator=(const X86Evaluator &);
+
+		void generate(ASTNodePtr ast)
+		{
+			// push rbx; mov rbx, rdi - the slots pointer has to survive libm calls
+			emit(0x53);
+			emit(0x48); emit(0x89); emit(0xFB);
+			// sub rsp, frame - patched once the number of spill slots is known
+			emit(0x48); emit(0x81); emit(0xEC);
+			size_t frame = m_code.size();
+			emit32(0);
+
+			generateNode(ast);
+
+			// add rsp, frame; pop rbx; ret
+			emit(0x48); emit(0x81); emit(0xC4); emit32(m_frame);
+			emit(0x5B);
+			emit(0xC3);
+			patch32(frame, m_frame);
+		}
+
+		// Copy the code into pages of its own, which are made executable but no
+		// longer writable
+		void install()
+		{
+			long page = sysconf(_SC_PAGESIZE);
+			if (page <= 0)
+			{
+				page = 4096;
+			}
+			m_size = (m_code.size() + page - 1) / page * page;
+
+			void *memory = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (memory == MAP_FAILED)
+			{
+				throw EvaluatorException("Could not allocate memory for x86 code");
+			}
+			memcpy(memory, &m_code[0], m_code.size());
+			if (mprotect(memory, m_size, PROT_READ | PROT_EXEC) != 0)
+			{
+				munmap(memory, m_size);
+				throw EvaluatorException("Could not make x86 code executable");
+			}
+
+			m_memory = memory;
+			m_function = (Function) (uintptr_t) memory;
+		}
+
+		// Look up where each variable lives in the map. Map entries don't move, so
+		// this only has to be done once, unless a variable was missing
+		void bind()
+		{
+			if (!m_map)
+			{
+				throw EvaluatorException("Variable encountered, but no variable map provided");
+			}
+
+			std::vector<T*> sources;
+			for (size_t i=0; i<m_variables.size(); i++)
+			{
+				typename VariableMap::iterator it = m_map->find(m_variables[i]);
+				if (it == m_map->end())
+				{
+					std::stringstream ss;
+					ss << "Variable '" << m_variables[i] << "' not defined";
+					throw EvaluatorException(ss.str().c_str());
+				}
+				sources.push_back(&it->second);
+			}
+			m_sources.swap(sources);
+		}
+
+		// Generate code which leaves the value of the node in xmm0
+		void generateNode(ASTNodePtr ast)
+		{
+			if(!ast)
+			{
+				throw EvaluatorException("No abstract syntax tree provided");
+			}
+			if (ast->type() == ASTNode::NUMBER || ast->type() == ASTNode::VARIABLE)
+			{
+				loadLeaf(ast, 0);
+			}
+			else if (ast->type() == ASTNode::OPERATION)
+			{
+				SHARED_PTR<OperationASTNode> op = STATIC_POINTER_CAST<OperationASTNode>(ast);
+				generateOperands(op->right(), op->left(), false); // the operators are switched thanks to rpn notation
+				switch(op->operation())
+				{
+					case OperationASTNode::PLUS:  scalar(0x58); break;
+					case OperationASTNode::MINUS: scalar(0x5C); break;
+					case OperationASTNode::MUL:   scalar(0x59); break;
+					case OperationASTNode::DIV:   scalar(0x5E); break;
+					case OperationASTNode::POW:   call((const void *) X86Traits<T>::pow()); break;
+					case OperationASTNode::MOD:   call((const void *) X86Traits<T>::mod()); break;
+					default: throw EvaluatorException("Unknown operator in syntax tree");
+				}
+			}
+			else if (ast->type() == ASTNode::FUNCTION1)
+			{
+				SHARED_PTR<Function1ASTNode> f = STATIC_POINTER_CAST<Function1ASTNode>(ast);
+				generateNode(f->left());
+				if (f->function() == Function1ASTNode::SQRT)
+				{
+					// sqrtss xmm0, xmm0
+					emit(X86Traits<T>::prefix); emit(0x0F); emit(0x51); emit(0xC0);
+					return;
+				}
+				typename X86Traits<T>::Function1 function = X86Traits<T>::function(f->function());
+				if (!function)
+				{
+					throw EvaluatorException("Unknown function in syntax tree");
+				}
+				call((const void *) function);
+			}
+			else if (ast->type() == ASTNode::FUNCTION2)
+			{
+				SHARED_PTR<Function2ASTNode> f = STATIC_POINTER_CAST<Function2ASTNode>(ast);
+				switch(f->function())
+				{
+					// min/maxss return their second operand when the operands are equal or
+					// unordered, so swapping the operands matches std::min and std::max
+					case Function2ASTNode::MIN:
+						generateOperands(f->right(), f->left(), true);
+						scalar(0x5D);
+						break;
+					case Function2ASTNode::MAX:
+						generateOperands(f->right(), f->left(), true);
+						scalar(0x5F);
+						break;
+					case Function2ASTNode::POW:
+						generateOperands(f->right(), f->left(), false);
+						call((const void *) X86Traits<T>::pow());
+						break;
+					default: throw EvaluatorException("Unknown function in syntax tree");
+				}
+			}
+			else if (ast->type() == ASTNode::COMPARISON)
+			{
+				SHARED_PTR<ComparisonASTNode> c = STATIC_POINTER_CAST<ComparisonASTNode>(ast);
+				// cmpss only has less than predicates, greater than swaps the operands
+				switch(c->comparison())
+				{
+					case ComparisonASTNode::EQUAL:              generateOperands(c->right(), c->left(), false); compare(0); break;
+					case ComparisonASTNode::NOT_EQUAL:          generateOperands(c->right(), c->left(), false); compare(4); break;
+					case ComparisonASTNode::GREATER_THAN:       generateOperands(c->right(), c->left(), true);  compare(1); break;
+					case ComparisonASTNode::GREATER_THAN_EQUAL: generateOperands(c->right(), c->left(), true);  compare(2); break;
+					case ComparisonASTNode::LESS_THAN:          generateOperands(c->right(), c->left(), false); compare(1); break;
+					case ComparisonASTNode::LESS_THAN_EQUAL:    generateOperands(c->right(), c->left(), false); compare(2); break;
+					default: throw EvaluatorException("Unknown comparison in syntax tree");
+				}
+				toNumber();
+			}
+			else if (ast->type() == ASTNode::LOGICAL)
+			{
+				SHARED_PTR<LogicalASTNode> l = STATIC_POINTER_CAST<LogicalASTNode>(ast);
+				generateOperands(l->right(), l->left(), false);
+
+				// Turn both operands into masks: xorps xmm2, xmm2; cmpneq xmm0, xmm2; cmpneq xmm1, xmm2
+				emit(0x0F); emit(0x57); emit(0xD2);
+				emit(X86Traits<T>::prefix); emit(0x0F); emit(0xC2); emit(0xC2); emit(4);
+				emit(X86Traits<T>::prefix); emit(0x0F); emit(0xC2); emit(0xCA); emit(4);
+				switch(l->operation())
+				{
+					case LogicalASTNode::AND: emit(0x0F); emit(0x54); emit(0xC1); break; // andps xmm0, xmm1
+					case LogicalASTNode::OR:  emit(0x0F); emit(0x56); emit(0xC1); break; // orps xmm0, xmm1
+					default: throw EvaluatorException("Unknown logical operator in syntax tree");
+				}
+				toNumber();
+			}
+			else if (ast->type() == ASTNode::BRANCH)
+			{
+				SHARED_PTR<BranchASTNode> b = STATIC_POINTER_CAST<BranchASTNode>(ast);
+				generateNode(b->condition());
+
+				// xorps xmm1, xmm1; ucomiss xmm0, xmm1
+				emit(0x0F); emit(0x57); emit(0xC9);
+				if (X86Traits<T>::wide)
+				{
+					emit(0x66);
+				}
+				emit(0x0F); emit(0x2E); emit(0xC1);
+
+				// Only an ordered compare equal to zero is false, NaN is true as in C
+				size_t unordered = jump(0x8A); // jp
+				size_t zero = jump(0x84);      // je
+				patchJump(unordered);
+				generateNode(b->yes());
+				size_t end = jump(0);          // jmp
+				patchJump(zero);
+				generateNode(b->no());
+				patchJump(end);
+			}
+			else
+			{
+				throw EvaluatorException("Incorrect syntax tree!");
+			}
+		}
+
+		// Leave v1 in xmm0 and v2 in xmm1, or the other way around if swapped
+		void generateOperands(ASTNodePtr v1, ASTNodePtr v2, bool swapped)
+		{
+			generateNode(v1);
+			if (v2 && (v2->type() == ASTNode::NUMBER || v2->type() == ASTNode::VARIABLE))
+			{
+				// No need to spill for a leaf, it can be loaded straight into place
+				if (swapped)
+				{
+					emit(0x0F); emit(0x28); emit(0xC8); // movaps xmm1, xmm0
+					loadLeaf(v2, 0);
+				}
+				else
+				{
+					loadLeaf(v2, 1);
+				}
+				return;
+			}
+
+			int slot = m_depth++;
+			m_frame = std::max(m_frame, m_depth * 16);
+			// movss [rsp + slot], xmm0
+			emit(X86Traits<T>::prefix); emit(0x0F); emit(0x11); emit(0x84); emit(0x24); emit32(slot * 16);
+
+			generateNode(v2);
+			m_depth--;
+
+			if (swapped)
+			{
+				// movss xmm1, [rsp + slot]
+				emit(X86Traits<T>::prefix); emit(0x0F); emit(0x10); emit(0x8C); emit(0x24); emit32(slot * 16);
+			}
+			else
+			{
+				// movaps xmm1, xmm0; movss xmm0, [rsp + slot]
+				emit(0x0F); emit(0x28); emit(0xC8);
+				emit(X86Traits<T>::prefix); emit(0x0F); emit(0x10); emit(0x84); emit(0x24); emit32(slot * 16);
+			}
+		}
+
+		// Load a number or variable into xmm0 or xmm1
+		void loadLeaf(ASTNodePtr ast, int xmm)
+		{
+			if (ast->type() == ASTNode::NUMBER)
+			{
+				loadConstant(STATIC_POINTER_CAST<NumberASTNode<T> >(ast)->value(), xmm);
+				return;
+			}
+
+			std::string variable = STATIC_POINTER_CAST<VariableASTNode<T> >(ast)->variable();
+			size_t slot = std::find(m_variables.begin(), m_variables.end(), variable) - m_variables.begin();
+			// movss xmm, [rbx + slot]
+			emit(X86Traits<T>::prefix); emit(0x0F); emit(0x10); emit(xmm ? 0x8B : 0x83); emit32(slot * sizeof(T));
+		}
+
+		void loadConstant(T value, int xmm)
+		{
+			if (X86Traits<T>::wide)
+			{
+				// mov rax, imm64; movq xmm, rax
+				uint64_t bits;
+				memcpy(&bits, &value, sizeof(bits));
+				emit(0x48); emit(0xB8); emit64(bits);
+				emit(0x66); emit(0x48); emit(0x0F); emit(0x6E); emit(xmm ? 0xC8 : 0xC0);
+			}
+			else
+			{
+				// mov eax, imm32; movd xmm, eax
+				uint32_t bits;
+				memcpy(&bits, &value, sizeof(bits));
+				emit(0xB8); emit32(bits);
+				emit(0x66); emit(0x0F); emit(0x6E); emit(xmm ? 0xC8 : 0xC0);
+			}
+		}
+
+		// Arithmetic instruction on xmm0 and xmm1, leaving the result in xmm0
+		void scalar(unsigned char opcode)
+		{
+			emit(X86Traits<T>::prefix); emit(0x0F); emit(opcode); emit(0xC1);
+		}
+
+		// cmpss xmm0, xmm1, predicate
+		void compare(unsigned char predicate)
+		{
+			emit(X86Traits<T>::prefix); emit(0x0F); emit(0xC2); emit(0xC1); emit(predicate);
+		}
+
+		// Turn a mask in xmm0 into 1 or 0
+		void toNumber()
+		{
+			loadConstant(1, 1);
+			emit(0x0F); emit(0x54); emit(0xC1); // andps xmm0, xmm1
+		}
+
+		// Arguments are already in xmm0 and xmm1, the stack is 16 byte aligned
+		void call(const void *function)
+		{
+			// mov rax, function; call rax
+			emit(0x48); emit(0xB8); emit64((uint64_t) (uintptr_t) function);
+			emit(0xFF); emit(0xD0);
+		}
+
+		// Emit a jump with a 32 bit offset to be patched, condition 0 is unconditional
+		size_t jump(unsigned char condition)
+		{
+			if (condition)
+			{
+				emit(0x0F); emit(condition);
+			}
+			else
+			{
+				emit(0xE9);
+			}
+			size_t offset = m_code.size();
+			emit32(0);
+			return offset;
+		}
+
+		// Point a jump at the current end of the code
+		void patchJump(size_t offset)
+		{
+			patch32(offset, (uint32_t) (m_code.size() - (offset + 4)));
+		}
+
+		void emit(unsigned char byte)
+		{
+			m_code.push_back(byte);
+		}
+
+		void emit32(uint32_t value)
+		{
+			for (int i=0; i<4; i++)
+			{
+				m_code.push_back((unsigned char) (value >> (i * 8)));
+			}
+		}
+
+		void emit64(uint64_t value)
+		{
+			emit32((uint32_t) value);
+			emit32((uint32_t) (value >> 32));
+		}
+
+		void patch32(size_t offset, uint32_t value)
+		{
+			for (int i=0; i<4; i++)
+			{
+				m_code[offset + i] = (unsigned char) (value >> (i * 8));
+			}
+		}
+
+		VariableMap *m_map;
+		std::vector<std::string> m_variables;
+		std::vector<T*> m_sources; // map entries of the variables, once bound
+
+		std::vector<unsigned char> m_code;
+		void *m_memory;
+		size_t m_size;
+		Function m_function;
+		int m_depth; // spill slots in use while generating
+		int m_frame; // bytes of stack needed for spills
+};
+
+} // namespace expr
+
+#endif // x86-64
+
+#endif
@@ -3,6 +3,7 @@
 
 
 #include "expressions/AST.h"
+#include "expressions/Canonical.h"
 #include "expressions/Parser.h"
 #include "expressions/Evaluator.h"
 #include "expressions/Generator.h"
@@ -0,0 +1,464 @@
+// fuzz.cpp
+// g++ fuzz.cpp -o fuzz -I. -O2 -pthread
+// g++ fuzz.cpp -o fuzz -I. -O2 `llvm-config --cppflags --ldflags --libs core jit native` -DUSE_LLVM -pthread
+//
+// Differential fuzzing of the evaluators. Generated expressions are evaluated on
+// generated inputs by every backend compiled in, in float and in double, and the
+// results are checked against the interpreter of the same type. Results further
+// apart than the tolerance in ULPs are printed as tab separated lines:
+//   divergence  type  backend  expression  row  expected  actual  ulps
+// followed by the expression and its inputs as comments. NaN only matches NaN,
+// and an infinity only matches itself. Once done, each backend reports its
+// throughput on the same workload:
+//   throughput  type  backend  evaluations  ns_per_evaluation  ns_per_compile
+// Lines starting with # are comments.
+//
+// fuzz [expressions] [seed] [ulps] runs 500 expressions from seed 1 with a
+// tolerance of 4 ULPs by default. The exit status is 1 if any backend diverged
+// or failed, so it can be run after every change to an evaluator.
+#include <expressions/expressions.h>
+#include <expressions/X86Evaluator.h>
+#include <expressions/RandomExpression.h>
+#include <iostream>
+#include <iomanip>
+#include <limits>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <time.h>
+
+// Rows of inputs each expression is evaluated on
+const size_t Rows = 64;
+
+// Divergences printed in full per backend and type, the rest are only counted
+const size_t Reports = 10;
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+template <typename T>
+struct Bits
+{
+};
+
+template <>
+struct Bits<float>
+{
+	typedef int32_t Type;
+};
+
+template <>
+struct Bits<double>
+{
+	typedef int64_t Type;
+};
+
+// Distance between two results in units in the last place. Signed zeros are
+// equal, anything against a NaN or an infinity it doesn't equal is as far apart
+// as can be
+template <typename T>
+uint64_t ulps(T a, T b)
+{
+	if (a != a || b != b)
+	{
+		return a != a && b != b ? 0 : std::numeric_limits<uint64_t>::max();
+	}
+	if (a == b)
+	{
+		return 0;
+	}
+	const T infinity = std::numeric_limits<T>::infinity();
+	if (a == infinity || a == -infinity || b == infinity || b == -infinity)
+	{
+		return std::numeric_limits<uint64_t>::max();
+	}
+
+	// Sign and magnitude onto one line of integers, so neighbouring values
+	// are one apart even across zero
+	typedef typename Bits<T>::Type Type;
+	Type x, y;
+	memcpy(&x, &a, sizeof(x));
+	memcpy(&y, &b, sizeof(y));
+	int64_t ox = x < 0 ? (int64_t) std::numeric_limits<Type>::min() - x : x;
+	int64_t oy = y < 0 ? (int64_t) std::numeric_limits<Type>::min() - y : y;
+	return ox > oy ? (uint64_t) ox - (uint64_t) oy : (uint64_t) oy - (uint64_t) ox;
+}
+
+
+// Inputs for one expression, a column of values per variable
+template <typename T>
+struct Workload
+{
+	std::vector<std::string> names;
+	std::vector<std::vector<T> > columns;
+	size_t rows;
+
+	// Index of the column for a variable, for the backends that take slots
+	size_t column(const std::string &name) const
+	{
+		for (size_t i=0; i<names.size(); i++)
+		{
+			if (names[i] == name)
+			{
+				return i;
+			}
+		}
+		throw expr::EvaluatorException(("Unknown variable " + name).c_str());
+	}
+};
+
+// One way of evaluating expressions. Compiling and evaluating are timed
+// separately, as a backend can be slow to compile and still pay off on
+// enough rows
+template <typename T>
+class Backend
+{
+	public:
+		Backend(const std::string &name)
+			: name(name)
+			, evaluations(0)
+			, compileTime(0)
+			, evaluateTime(0)
+			, divergences(0)
+			, failures(0)
+		{
+		}
+
+		virtual ~Backend()
+		{
+		}
+
+		// Fills out with the result of every row of the workload
+		void run(expr::ASTNodePtr ast, const Workload<T> &workload, std::vector<T> &out)
+		{
+			out.resize(workload.rows);
+			double start = now();
+			double compiled;
+			try
+			{
+				compile(ast, workload);
+				compiled = now();
+				evaluate(workload, out);
+			}
+			catch (...)
+			{
+				// The next compile would otherwise leak the evaluator, and with it
+				// any code it generated
+				release();
+				throw;
+			}
+			double end = now();
+			release();
+
+			compileTime += compiled - start;
+			evaluateTime += end - compiled;
+			evaluations += workload.rows;
+		}
+
+		std::string name;
+		size_t evaluations;
+		double compileTime;
+		double evaluateTime;
+		size_t divergences;
+		size_t failures;
+
+	protected:
+		virtual void compile(expr::ASTNodePtr ast, const Workload<T> &workload) = 0;
+		virtual void evaluate(const Workload<T> &workload, std::vector<T> &out) = 0;
+		virtual void release() = 0;
+};
+
+// Backends reading their variables from a VariableMap
+template <typename T, typename Evaluator>
+class MapBackend : public Backend<T>
+{
+	public:
+		MapBackend(const std::string &name) : Backend<T>(name), m_evaluator(NULL) {}
+		~MapBackend() { release(); }
+
+	protected:
+		void compile(expr::ASTNodePtr ast, const Workload<T> &workload)
+		{
+			m_vm.clear();
+			for (size_t i=0; i<workload.names.size(); i++)
+			{
+				m_vm[workload.names[i]] = 0;
+			}
+			m_evaluator = new Evaluator(ast, &m_vm);
+		}
+
+		void evaluate(const Workload<T> &workload, std::vector<T> &out)
+		{
+			std::vector<T *> values;
+			for (size_t i=0; i<workload.names.size(); i++)
+			{
+				values.push_back(&m_vm[workload.names[i]]);
+			}
+			for (size_t r=0; r<workload.rows; r++)
+			{
+				for (size_t i=0; i<values.size(); i++)
+				{
+					*values[i] = workload.columns[i][r];
+				}
+				out[r] = m_evaluator->evaluate();
+			}
+		}
+
+		void release()
+		{
+			delete m_evaluator;
+			m_evaluator = NULL;
+		}
+
+		typename expr::Evaluator<T>::VariableMap m_vm;
+		Evaluator *m_evaluator;
+};
+
+// Backends taking their variables as an array of slots, in the order of the
+// evaluator's variables()
+template <typename T, typename Evaluator>
+class SlotBackend : public Backend<T>
+{
+	public:
+		SlotBackend(const std::string &name) : Backend<T>(name), m_evaluator(NULL) {}
+		~SlotBackend() { release(); }
+
+	protected:
+		void compile(expr::ASTNodePtr ast, const Workload<T> &)
+		{
+			m_evaluator = new Evaluator(ast);
+		}
+
+		void evaluate(const Workload<T> &workload, std::vector<T> &out)
+		{
+			const std::vector<std::string> &variables = m_evaluator->variables();
+			std::vector<size_t> columns;
+			for (size_t i=0; i<variables.size(); i++)
+			{
+				columns.push_back(workload.column(variables[i]));
+			}
+			std::vector<T> slots(variables.size() + 1);
+			for (size_t r=0; r<workload.rows; r++)
+			{
+				for (size_t i=0; i<columns.size(); i++)
+				{
+					slots[i] = workload.columns[columns[i]][r];
+				}
+				out[r] = m_evaluator->evaluate(&slots[0]);
+			}
+		}
+
+		void release()
+		{
+			delete m_evaluator;
+			m_evaluator = NULL;
+		}
+
+		Evaluator *m_evaluator;
+};
+
+#ifdef USE_LLVM
+// The LLVM batch kernel, evaluating every row in one call. Compiling the
+// kernel counts towards the compile time
+template <typename T>
+class KernelBackend : public Backend<T>
+{
+	public:
+		KernelBackend(const std::string &name) : Backend<T>(name), m_evaluator(NULL), m_kernel(NULL) {}
+		~KernelBackend() { release(); }
+
+	protected:
+		void compile(expr::ASTNodePtr ast, const Workload<T> &)
+		{
+			m_evaluator = new expr::LLVMEvaluator<T>(ast);
+			m_kernel = m_evaluator->kernel();
+		}
+
+		void evaluate(const Workload<T> &workload, std::vector<T> &out)
+		{
+			const std::vector<std::string> &variables = m_evaluator->variables();
+			std::vector<const T *> inputs;
+			for (size_t i=0; i<variables.size(); i++)
+			{
+				inputs.push_back(&workload.columns[workload.column(variables[i])][0]);
+			}
+			m_kernel(inputs.empty() ? NULL : &inputs[0], &out[0], workload.rows);
+		}
+
+		void release()
+		{
+			delete m_evaluator;
+			m_evaluator = NULL;
+			m_kernel = NULL;
+		}
+
+		expr::LLVMEvaluator<T> *m_evaluator;
+		typename expr::LLVMEvaluator<T>::Kernel m_kernel;
+};
+#endif
+
+
+// Mostly values where the functions are well behaved, with some integers and
+// zeros so that %, == and the ternaries see exact values too
+template <typename T>
+T input(expr::RandomExpression &random)
+{
+	switch (random.below(8))
+	{
+		case 0:  return 0;
+		case 1:
+		case 2:  return (T) random.below(21) - 10;
+		default: return (T) (random.uniform() * 20 - 10);
+	}
+}
+
+// Runs every backend on the same expressions and inputs. The first backend is
+// the reference the others are checked against
+template <typename T>
+bool fuzz(const char *type, std::vector<Backend<T> *> &backends, size_t expressions, uint64_t seed, uint64_t tolerance)
+{
+	const int precision = std::numeric_limits<T>::digits10 + 2;
+	bool passed = true;
+	expr::RandomExpression driver(seed);
+	std::vector<std::vector<T> > results(backends.size());
+
+	for (size_t e=0; e<expressions; e++)
+	{
+		// Each expression has a shape of its own, from chains to wide trees
+		expr::RandomExpression::Options options;
+		options.depth = 1 + driver.below(6);
+		options.width = 1 + driver.below(3);
+		options.variables = driver.below(4);
+		expr::RandomExpression random(driver.next(), options);
+		std::string text = random.generate();
+
+		Workload<T> workload;
+		workload.names = random.variables();
+		workload.rows = Rows;
+		workload.columns.resize(workload.names.size());
+		for (size_t i=0; i<workload.names.size(); i++)
+		{
+			for (size_t r=0; r<Rows; r++)
+			{
+				workload.columns[i].push_back(input<T>(random));
+			}
+		}
+
+		expr::Parser<T> parser;
+		expr::ASTNodePtr ast;
+		try
+		{
+			ast = parser.parse(text.c_str());
+		}
+		catch (expr::Exception &ex)
+		{
+			std::cout << "# " << type << " expression " << e << " did not parse: " << ex.what() << std::endl;
+			std::cout << "# " << text << std::endl;
+			passed = false;
+			continue;
+		}
+
+		for (size_t b=0; b<backends.size(); b++)
+		{
+			Backend<T> &backend = *backends[b];
+			try
+			{
+				backend.run(ast, workload, results[b]);
+			}
+			catch (std::exception &ex)
+			{
+				std::cout << "# " << type << " " << backend.name << " failed on expression " << e << ": " << ex.what() << std::endl;
+				std::cout << "# " << text << std::endl;
+				backend.failures++;
+				results[b].clear();
+				passed = false;
+				continue;
+			}
+			if (b == 0 || results[0].empty())
+			{
+				continue;
+			}
+
+			for (size_t r=0; r<Rows; r++)
+			{
+				uint64_t distance = ulps(results[0][r], results[b][r]);
+				if (distance <= tolerance)
+				{
+					continue;
+				}
+				passed = false;
+				if (backend.divergences++ >= Reports)
+				{
+					continue;
+				}
+				std::cout << std::setprecision(precision);
+				std::cout << "divergence\t" << type << "\t" << backend.name << "\t" << e << "\t" << r << "\t" << results[0][r] << "\t" << results[b][r] << "\t" << distance << std::endl;
+				std::cout << "# " << text << std::endl;
+				std::cout << "#";
+				for (size_t i=0; i<workload.names.size(); i++)
+				{
+					std::cout << " " << workload.names[i] << " = " << workload.columns[i][r];
+				}
+				std::cout << std::endl;
+			}
+		}
+	}
+
+	std::cout << std::setprecision(6);
+	for (size_t b=0; b<backends.size(); b++)
+	{
+		Backend<T> &backend = *backends[b];
+		if (b > 0 && backend.divergences > Reports)
+		{
+			std::cout << "# " << type << " " << backend.name << " diverged on " << backend.divergences << " rows, the first " << Reports << " are shown" << std::endl;
+		}
+		std::cout << "throughput\t" << type << "\t" << backend.name << "\t" << backend.evaluations << "\t"
+			<< (backend.evaluations ? backend.evaluateTime / backend.evaluations : 0) << "\t"
+			<< backend.compileTime / expressions << std::endl;
+	}
+	return passed;
+}
+
+template <typename T>
+bool fuzz(const char *type, size_t expressions, uint64_t seed, uint64_t tolerance)
+{
+	std::vector<Backend<T> *> backends;
+	backends.push_back(new MapBackend<T, expr::Evaluator<T> >("interpreter"));
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+	backends.push_back(new MapBackend<T, expr::X86Evaluator<T> >("x86"));
+	backends.push_back(new SlotBackend<T, expr::X86Evaluator<T> >("x86_slots"));
+#endif
+#ifdef USE_LLVM
+	backends.push_back(new MapBackend<T, expr::LLVMEvaluator<T> >("llvm"));
+	backends.push_back(new SlotBackend<T, expr::LLVMEvaluator<T> >("llvm_slots"));
+	backends.push_back(new KernelBackend<T>("llvm_kernel"));
+#endif
+
+	bool passed = fuzz<T>(type, backends, expressions, seed, tolerance);
+	for (size_t b=0; b<backends.size(); b++)
+	{
+		delete backends[b];
+	}
+	return passed;
+}
+
+
+int main(int argc, char *argv[])
+{
+	size_t expressions = argc > 1 ? strtoul(argv[1], NULL, 10) : 500;
+	uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+	uint64_t tolerance = argc > 3 ? strtoull(argv[3], NULL, 10) : 4;
+
+	std::cout << "# " << expressions << " expressions of " << Rows << " rows from seed " << seed << ", tolerance " << tolerance << " ulps" << std::endl;
+	std::cout << "# divergence\ttype\tbackend\texpression\trow\texpected\tactual\tulps" << std::endl;
+	std::cout << "# throughput\ttype\tbackend\tevaluations\tns_per_evaluation\tns_per_compile" << std::endl;
+
+	bool passed = fuzz<float>("float", expressions, seed, tolerance);
+	passed = fuzz<double>("double", expressions, seed, tolerance) && passed;
+	return passed ? 0 : 1;
+}
@@ -1,17 +1,31 @@
 // tests.cpp
-// g++ tests.cpp -o test -I. `llvm-config --cppflags --ldflags --libs core jit native` -Wall -DUSE_LLVM
+// g++ tests.cpp -o test -I. `llvm-config --cppflags --ldflags --libs core jit native` -Wall -DUSE_LLVM -pthread
 #include <expressions/expressions.h>
+#include <expressions/BulkParser.h>
+#include <expressions/IncrementalParser.h>
+#include <expressions/LLVMCompiler.h>
+#include <expressions/TieredEvaluator.h>
+#include <expressions/X86Evaluator.h>
+#include <expressions/RandomExpression.h>
 #include <iostream>
 #include "math.h"
 
 #include <cmath> // for fabs
 #include <limits> // for epsilon
+#include <pthread.h>
+#include <locale.h>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h> // for getpid
+#endif
 
 
 
 #ifdef USE_LLVM
-typedef expr::LLVMEvaluator Evaluator;
-typedef expr::LLVMEvaluator::VariableMap VariableMap;
+typedef expr::LLVMEvaluator<float> Evaluator;
+typedef expr::LLVMEvaluator<float>::VariableMap VariableMap;
 #else
 typedef expr::Evaluator<float> Evaluator;
 typedef expr::Evaluator<float>::VariableMap VariableMap;
@@ -127,6 +141,1024 @@ void clone()
 }
 
 
+void parserContext()
+{
+	expr::Parser<float> parser;
+	expr::ParserContext<float> context;
+	const char *expression = "min(4,8) < max(4,8) && 10 % 4 == 2 ? sqrt(floor(16.5)) + log2(16) : -1";
+
+	// The first parse may need to grow the buffers, after that they should be reused
+	parser.parse(expression, context);
+	for (int i=0; i<10; i++)
+	{
+		parser.parse("(x + y) * 10", context);
+		parser.parse(expression, context);
+		if (context.statistics().bufferAllocations != 0)
+		{
+			std::cerr << "parser context allocated buffers on a repeated parse" << std::endl;
+			return;
+		}
+	}
+
+	parser.parse("(x + y) * 10", context);
+	if (context.statistics().nodes != 5)
+	{
+		std::cerr << "parser context reported " << context.statistics().nodes << " nodes instead of 5" << std::endl;
+	}
+}
+
+
+void lengthDelimited()
+{
+	// Parse an expression out of the middle of a buffer that is not terminated after it
+	const char buffer[] = { 'x', ' ', '*', ' ', '2', '0', '0', '#' };
+	expr::Parser<float> parser;
+	VariableMap vm;
+	vm["x"] = 3;
+	Evaluator eval(parser.parse(buffer, 5), &vm);
+	if (eval.evaluate() != 6.0f)
+	{
+		std::cerr << "length delimited expression did not evaluate correctly" << std::endl;
+	}
+
+	try
+	{
+		parser.parse(buffer + 2, 3);
+		std::cerr << "length delimited expression \"* 2\" did not result in a syntax error" << std::endl;
+	}
+	catch (expr::ParserException &e)
+	{
+		if (e.position() != 0)
+		{
+			std::cerr << "length delimited syntax error reported at " << e.position() << " instead of 0" << std::endl;
+		}
+	}
+}
+
+
+void numberParsing()
+{
+	// Just above the halfway point between 1 and the next float, rounding through a double lands on it and then down
+	expr::Parser<float> parser;
+	expr::Evaluator<float> eval(parser.parse("1.0000000596046448"));
+	if (eval.evaluate() != 1.00000012f)
+	{
+		std::cerr << "float literal was rounded twice" << std::endl;
+	}
+
+	// A locale with a decimal comma must not change how literals are read
+	const char *locales[] = { "de_DE.UTF-8", "de_DE", "fr_FR.UTF-8", "fr_FR" };
+	for (size_t i=0; i<sizeof(locales) / sizeof(locales[0]); i++)
+	{
+		if (setlocale(LC_NUMERIC, locales[i]))
+		{
+			expr::Parser<double> doubles;
+			expr::Evaluator<double> result(doubles.parse("2.5 * 2"));
+			if (result.evaluate() != 5.0)
+			{
+				std::cerr << "number parsing depends on the " << locales[i] << " locale" << std::endl;
+			}
+			break;
+		}
+	}
+	setlocale(LC_NUMERIC, "C");
+}
+
+
+void incrementalParse()
+{
+	expr::IncrementalParser<float> parser;
+	VariableMap vm;
+	vm["a"] = 1; vm["b"] = 2; vm["c"] = 3; vm["d"] = 4; vm["e"] = 5;
+
+	SHARED_PTR<expr::OperationASTNode> before = STATIC_POINTER_CAST<expr::OperationASTNode>(parser.parse("a*b + c*d"));
+
+	// Replace c with e, only e, e*d and the addition should be rebuilt
+	SHARED_PTR<expr::OperationASTNode> after = STATIC_POINTER_CAST<expr::OperationASTNode>(parser.edit(6, 1, "e"));
+	if (parser.text() != "a*b + e*d" || Evaluator(after, &vm).evaluate() != 22.0f)
+	{
+		std::cerr << "incremental edit did not evaluate correctly" << std::endl;
+	}
+	if (parser.changed().size() != 3 || after->right() != before->right() || parser.retokenized() > 2)
+	{
+		std::cerr << "incremental edit rebuilt " << parser.changed().size() << " nodes from " << parser.retokenized() << " tokens" << std::endl;
+	}
+
+	// A broken edit leaves the previous expression in place
+	try
+	{
+		parser.edit(4, 1, "*/");
+		std::cerr << "incremental edit \"a*b */ e*d\" did not result in a syntax error" << std::endl;
+	}
+	catch (expr::ParserException &e)
+	{
+	}
+	parser.edit(parser.text().size(), 0, " ^ 2");
+	if (parser.text() != "a*b + e*d ^ 2" || Evaluator(parser.ast(), &vm).evaluate() != 82.0f)
+	{
+		std::cerr << "incremental edit did not evaluate \"" << parser.text() << "\" correctly" << std::endl;
+	}
+}
+
+
+void statusErrors()
+{
+	expr::Parser<float> parser;
+	expr::ASTNodePtr ast;
+
+	expr::Status status = parser.tryParse("x % ", ast);
+	if (status.code() != expr::Status::UNEXPECTED_END || ast)
+	{
+		std::cerr << "tryParse did not report an unexpected end for \"x % \"" << std::endl;
+	}
+
+	status = parser.tryParse("1-*2", ast);
+	if (status.code() != expr::Status::EXPECTED_EXPRESSION || status.position() != 2 ||
+		status.message() != "Invalid syntax: multiplication operator '*' must follow expression, character: 2")
+	{
+		std::cerr << "tryParse reported \"" << status.message() << "\" for \"1-*2\"" << std::endl;
+	}
+
+	status = parser.tryParse("x y", ast);
+	if (status.code() != expr::Status::EXPECTED_OPERATOR || status.name() != "y" || status.position() != 2)
+	{
+		std::cerr << "tryParse reported \"" << status.message() << "\" for \"x y\"" << std::endl;
+	}
+
+	status = parser.tryParse("(x + z) * 2", ast);
+	if (!status.ok() || !ast)
+	{
+		std::cerr << "tryParse failed for a valid expression: " << status.message() << std::endl;
+		return;
+	}
+
+	expr::Evaluator<float>::VariableMap vm;
+	vm["x"] = 1;
+	float result;
+	status = expr::Evaluator<float>(ast, &vm).tryEvaluate(result);
+	if (status.code() != expr::Status::UNDEFINED_VARIABLE || status.name() != "z")
+	{
+		std::cerr << "tryEvaluate did not report the undefined variable 'z'" << std::endl;
+	}
+}
+
+
+void bulkParse()
+{
+	// Enough records to be split across several threads, with every 1000th one broken
+	std::string data;
+	for (int i=0; i<50000; i++)
+	{
+		data += (i % 1000 == 999) ? "x y\n" : "(x + y) * 10\n";
+	}
+
+	expr::BulkParser<float> bulk(4);
+	expr::BulkParser<float>::Result result;
+	bulk.parse(data.c_str(), data.size(), result);
+
+	if (result.asts.size() != 50000 || result.errors.size() != 50)
+	{
+		std::cerr << "bulk parse returned " << result.asts.size() << " records and " << result.errors.size() << " errors" << std::endl;
+		return;
+	}
+	for (size_t i=0; i<result.errors.size(); i++)
+	{
+		const expr::BulkParser<float>::Error &error = result.errors[i];
+		// The tokenizer reports the start of the offending variable
+		if (error.record % 1000 != 999 || result.asts[error.record] || data.compare(error.offset - 2, 3, "x y") != 0)
+		{
+			std::cerr << "bulk parse reported an error for record " << result.errors[i].record << std::endl;
+		}
+	}
+}
+
+
+void branchProfile()
+{
+	expr::Parser<float> parser;
+	VariableMap vm;
+	vm["x"] = 0;
+	expr::ASTNodePtr ast = parser.parse("x > 2 ? sin(x) * cos(x) + x ^ 3 : x / 7");
+
+	expr::BranchProfile profile;
+	expr::Evaluator<float> eval(ast, &vm);
+	eval.setProfile(&profile);
+	for (int i=0; i<10; i++)
+	{
+		vm["x"] = i;
+		eval.evaluate();
+	}
+
+	expr::BranchProfile::Counts counts = profile.counts(ast.get());
+	if (counts.yes != 7 || counts.no != 3)
+	{
+		std::cerr << "branch profile did not count the arms taken" << std::endl;
+	}
+
+#ifdef USE_LLVM
+	// Expensive arms are only evaluated when taken, cheap ones are selected
+	Evaluator weighted(ast, &vm, expr::LLVMOptions(), &profile);
+	Evaluator selected(parser.parse("x > 2 ? x : 0"), &vm);
+	Evaluator shortCircuit(parser.parse("x > 2 && sqrt(x) * log2(x) > 4"), &vm);
+	vm["x"] = 5;
+	if (fabs(weighted.evaluate() - eval.evaluate()) > 1e-3f || selected.evaluate() != 5.0f || shortCircuit.evaluate() != 1.0f)
+	{
+		std::cerr << "profiled LLVM branches did not evaluate correctly" << std::endl;
+	}
+	vm["x"] = 1;
+	if (fabs(weighted.evaluate() - eval.evaluate()) > 1e-3f || selected.evaluate() != 0.0f || shortCircuit.evaluate() != 0.0f)
+	{
+		std::cerr << "profiled LLVM branches did not evaluate correctly" << std::endl;
+	}
+#endif
+}
+
+
+void shaderFunction()
+{
+	expr::Parser<float> parser;
+	expr::ShaderGenerator<float> generator;
+
+	// Subtrees with several parents are only computed once
+	expr::ASTNodePtr shared = parser.parse("x + 1");
+	expr::ASTNodePtr square(new expr::OperationASTNode(expr::OperationASTNode::MUL, shared, shared));
+	if (generator.generateFunction(square) != "float calculate()\n{\n\tfloat t0 = (x+1f);\n\treturn (t0*t0);\n}\n")
+	{
+		std::cerr << "shared subtree was not generated as a temporary" << std::endl;
+	}
+
+	// Nested modulos must not repeat their operands, at the top level or in an arm
+	std::string expression = "x";
+	for (int i=0; i<12; i++)
+	{
+		expression = "(" + expression + " + 1) % y";
+	}
+	const std::string nested[] = { expression, "y > 0 ? " + expression + " : 0", "y > 0 && " + expression };
+	for (size_t i=0; i<sizeof(nested) / sizeof(nested[0]); i++)
+	{
+		std::string code = generator.generateFunction(parser.parse(nested[i].c_str()));
+		if (code.size() > 50 * nested[i].size() || code.find("\treturn ") == std::string::npos)
+		{
+			std::cerr << "nested modulo function grew faster than \"" << nested[i].substr(0, 20) << "...\"" << std::endl;
+		}
+	}
+}
+
+
+void shaderStream()
+{
+	expr::Parser<float> parser;
+	expr::ShaderGenerator<float> generator;
+	expr::ASTNodePtr ast = parser.parse("x % 3 + 0.1");
+
+	// Code is appended to the stream, with numbers unaffected by its formatting
+	std::ostringstream ss;
+	ss << std::fixed;
+	ss.precision(2);
+	ss << "float a = ";
+	generator.generate(ast, ss);
+	ss << "; " << 0.5f << "\n";
+	generator.generateFunction(ast, ss, "calculate");
+	if (ss.str() != "float a = ((x - 3f * trunc(x/3f))+0.1f); 0.50\n" + generator.generateFunction(ast))
+	{
+		std::cerr << "streamed shader code does not match the generated string" << std::endl;
+	}
+}
+
+
+void shaderCache()
+{
+	expr::Parser<float> parser;
+	expr::ShaderCache<float> cache;
+
+	// Equivalent up to operand order, comparison direction and number formatting
+	bool inserted = false;
+	expr::ShaderCache<float>::Entry &first = cache.lookup(parser.parse("x * 2 + min(y, 1.5) > pow(x, y) && y == 3"), &inserted);
+	first.program = 7;
+	expr::ShaderCache<float>::Entry &second = cache.lookup(parser.parse("3.0 == y && (x ^ y) < min(y, 1.50) + 2e0 * x"));
+	if (!inserted || &first != &second || second.program != 7 || cache.size() != 1)
+	{
+		std::cerr << "equivalent expressions were not given the same cached shader" << std::endl;
+	}
+
+	// Operand order still matters for operators which don't commute, and for min
+	// and max, which return a different operand for NaN or 0 and -0
+	cache.lookup(parser.parse("x - y"));
+	cache.lookup(parser.parse("y - x"), &inserted);
+	if (!inserted || cache.size() != 3)
+	{
+		std::cerr << "different expressions were given the same cached shader" << std::endl;
+	}
+	cache.lookup(parser.parse("min(x, y)"));
+	cache.lookup(parser.parse("min(y, x)"), &inserted);
+	if (!inserted || cache.size() != 5)
+	{
+		std::cerr << "min with swapped operands was given the same cached shader" << std::endl;
+	}
+
+	// The hash doesn't depend on the platform's byte order
+	if (expr::structuralHash<float>(parser.parse("x * 2.5 + 1")) != ((expr::ASTHash(0xf11f2ae1) << 32) | 0x0f98e83b))
+	{
+		std::cerr << "structural hash changed" << std::endl;
+	}
+
+	expr::ASTNodePtr ast = parser.parse("(x + 1) % y > x ? sin(x) : y / 2");
+	if (expr::structuralHash<float>(expr::canonicalize<float>(ast)) != expr::structuralHash<float>(expr::canonicalize<float>(ast->clone())))
+	{
+		std::cerr << "canonical hash is not stable" << std::endl;
+	}
+}
+
+
+void shaderModule()
+{
+	typedef expr::ShaderGenerator<float> Generator;
+	expr::Parser<float> parser;
+	Generator generator;
+	expr::ASTNodePtr ast = parser.parse("a + b + c + d + (t0 + 1) % 2");
+
+	Generator::Module block = generator.generateModule(ast);
+	if (block.source.find("layout(std140) uniform Inputs\n{\n\tfloat a;\n") != 0 || block.source.find("\tfloat t_0 = ") == std::string::npos)
+	{
+		std::cerr << "uniform block module was not generated correctly" << std::endl;
+	}
+
+	Generator::Module array = generator.generateModule(ast, Generator::VEC4_ARRAY, "values");
+	if (array.source.find("uniform vec4 values[2];") != 0 || array.source.find("\tfloat t0 = values[1].x;\n") == std::string::npos)
+	{
+		std::cerr << "vec4 array module was not generated correctly" << std::endl;
+	}
+
+	// One buffer holds every input
+	VariableMap vm;
+	vm["a"] = 1; vm["b"] = 2; vm["c"] = 3; vm["d"] = 4; vm["t0"] = 5;
+	std::vector<float> buffer(array.size / sizeof(float), -1);
+	array.pack(vm, &buffer[0]);
+	if (array.size != 32 || array.bindings.size() != 5 || array.bindings[4].offset != 16 || buffer[4] != 5 || buffer[7] != 0)
+	{
+		std::cerr << "module inputs were not packed correctly" << std::endl;
+	}
+}
+
+
+void cSource()
+{
+	typedef expr::ShaderGenerator<float> Generator;
+	expr::Parser<float> parser;
+	Generator generator;
+	expr::ASTNodePtr ast = parser.parse("x % 2 > y ? min(x, 0.1) : log10(y)");
+
+	std::string c = generator.generateSource(ast, "calculate", Generator::C);
+	if (c.find("static inline float calculate_min(float a, float b)\n{\n\treturn b < a ? b : a;\n}\n") == std::string::npos ||
+		c.find("float calculate(float x, float y)\n{\n\treturn (((fmodf(x,2.0f)>y)) ? calculate_min(x,0.100000001f):log10f(y));\n}\n") == std::string::npos)
+	{
+		std::cerr << "C function was not generated correctly" << std::endl;
+	}
+	if (c.find("#pragma omp simd") == std::string::npos || c.find("out[i] = calculate(inputs[0][i], inputs[1][i]);") == std::string::npos)
+	{
+		std::cerr << "C batch function was not generated correctly" << std::endl;
+	}
+
+	std::string cpp = generator.generateSource(ast, "calculate", Generator::CPP, false);
+	if (cpp.find("std::fmod(x,2.0f)") == std::string::npos || cpp.find("_batch") != std::string::npos)
+	{
+		std::cerr << "C++ function was not generated correctly" << std::endl;
+	}
+}
+
+
+#if defined(__unix__) || defined(__APPLE__)
+// Compiles the C source of an expression with the system compiler and checks
+// it against the interpreter for every pair of the given values
+template <typename T>
+void compiledSource(expr::ASTNodePtr ast, const char *type, const std::vector<T> &values, const char *label)
+{
+	std::vector<std::string> variables;
+	expr::collectVariables<T>(ast, variables);
+	if (variables.size() != 2)
+	{
+		std::cerr << "compiled source test of " << label << " needs two variables" << std::endl;
+		return;
+	}
+
+	std::ostringstream source;
+	source.precision(17);
+	expr::ShaderGenerator<T> generator;
+	generator.generateSource(ast, source, "calculate", expr::ShaderGenerator<T>::C, false);
+	source << "\n#include <stdio.h>\n\nint main(void)\n{\n\tstatic const " << type << " values[] = { ";
+	for (size_t i=0; i<values.size(); i++)
+	{
+		source << (i ? ", " : "");
+		if (values[i] != values[i])
+		{
+			source << "NAN";
+		}
+		else
+		{
+			source << values[i];
+		}
+	}
+	source << " };\n\tsize_t i, j;\n\tfor (i=0; i<" << values.size() << "; i++)\n\t\tfor (j=0; j<" << values.size() << "; j++)\n";
+	source << "\t\t\tprintf(\"%.17g\\n\", (double) calculate(values[i], values[j]));\n\treturn 0;\n}\n";
+
+	std::ostringstream path;
+	path << "/tmp/expressions_source_" << getpid();
+	std::ofstream file(std::string(path.str() + ".c").c_str());
+	file << source.str();
+	file.close();
+	std::string command = "cc -std=c99 -o " + path.str() + " " + path.str() + ".c -lm";
+	if (system(command.c_str()) != 0)
+	{
+		std::cerr << "generated C source of " << label << " did not compile:\n" << source.str() << std::endl;
+		return;
+	}
+
+	FILE *output = popen(path.str().c_str(), "r");
+	typename expr::Evaluator<T>::VariableMap vm;
+	expr::Evaluator<T> eval(ast, &vm);
+	char line[64];
+	for (size_t i=0; i<values.size(); i++)
+	{
+		for (size_t j=0; j<values.size(); j++)
+		{
+			vm[variables[0]] = values[i];
+			vm[variables[1]] = values[j];
+			T expected = eval.evaluate();
+			if (!fgets(line, sizeof(line), output))
+			{
+				std::cerr << "compiled " << label << " stopped at " << values[i] << ", " << values[j] << std::endl;
+				pclose(output);
+				return;
+			}
+			T result = (T) strtod(line, NULL);
+			if (result != expected && (result == result || expected == expected))
+			{
+				std::cerr << "compiled " << label << " gave " << result << " instead of " << expected << " at " << values[i] << ", " << values[j] << std::endl;
+			}
+		}
+	}
+	pclose(output);
+	remove(path.str().c_str());
+	remove(std::string(path.str() + ".c").c_str());
+}
+#endif
+
+
+void compiledSources()
+{
+#if defined(__unix__) || defined(__APPLE__)
+	if (system("cc --version > /dev/null 2>&1") != 0)
+	{
+		return; // no compiler to check against
+	}
+
+	int integers[] = { -7, -2, -1, 0, 1, 3, 10 };
+	std::vector<int> ints(integers, integers + sizeof(integers) / sizeof(integers[0]));
+	expr::Parser<int> ip;
+
+	// Operands under a ternary arm must only be evaluated when the arm is taken
+	compiledSource<int>(ip.parse("x != 0 ? min(10 / x, 5) : y"), "int", ints, "guarded min");
+	compiledSource<int>(ip.parse("y == 0 ? x : max(x % y, y / 2)"), "int", ints, "guarded max");
+	expr::ASTNodePtr quotient = ip.parse("10 / x");
+	expr::ASTNodePtr sum(new expr::OperationASTNode(expr::OperationASTNode::PLUS, quotient, quotient));
+	expr::ASTNodePtr guarded(new expr::BranchASTNode(ip.parse("x != 0"), sum, ip.parse("y")));
+	compiledSource<int>(guarded, "int", ints, "guarded shared subtree");
+
+	// The math library works in double, integer results are truncated
+	compiledSource<int>(ip.parse("sqrt(x * x + y * y) * 3 + pow(y, 2) / 3 + floor(x)"), "int", ints, "integer math");
+
+	// NaN operands pick the same side of min and max as the interpreter
+	float reals[] = { -1.5f, -0.0f, 0.0f, 0.25f, 3.0f, std::numeric_limits<float>::quiet_NaN() };
+	std::vector<float> floats(reals, reals + sizeof(reals) / sizeof(reals[0]));
+	expr::Parser<float> fp;
+	compiledSource<float>(fp.parse("min(x, y) * 2 + max(y, x)"), "float", floats, "float min and max");
+#endif
+}
+
+
+void openclKernel()
+{
+	expr::Parser<double> parser;
+	expr::ShaderGenerator<double> generator;
+	std::string kernel = generator.generateKernel(parser.parse("x % y > 1 ? log10(x) : max(y, 2)"));
+
+	if (kernel.find("#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n") != 0 ||
+		kernel.find("\treturn (((fmod(x,y)>1.0)) ? log10(x):calculate_max(y,2.0));\n") == std::string::npos ||
+		kernel.find("__kernel void calculate_kernel(__global const double *in0, __global const double *in1, __global double *out, const unsigned int n)") == std::string::npos ||
+		kernel.find("out[i] = calculate(in0[i], in1[i]);") == std::string::npos)
+	{
+		std::cerr << "OpenCL kernel was not generated correctly" << std::endl;
+	}
+
+	// Integer kernels can use arithmetic, but OpenCL has no integer sqrt, sin or pow
+	expr::Parser<int> ip;
+	expr::ShaderGenerator<int> integers;
+	std::string arithmetic = integers.generateKernel(ip.parse("x % 3 + max(x / 2, y)"));
+	if (arithmetic.find("cl_khr_fp64") != std::string::npos ||
+		arithmetic.find("\treturn ((x%3)+calculate_max((x/2),y));\n") == std::string::npos ||
+		arithmetic.find("__kernel void calculate_kernel(__global const int *in0, __global const int *in1, __global int *out, const unsigned int n)") == std::string::npos)
+	{
+		std::cerr << "integer OpenCL kernel was not generated correctly" << std::endl;
+	}
+	const char *math[] = { "sqrt(x) + 1", "x > 0 ? sin(x) : 0", "pow(x, 2)", "x ^ 2" };
+	for (size_t i=0; i<sizeof(math) / sizeof(math[0]); i++)
+	{
+		std::ostringstream ss;
+		try
+		{
+			integers.generateKernel(ip.parse(math[i]), ss);
+			std::cerr << "integer OpenCL kernel calling the math library was generated for " << math[i] << std::endl;
+		}
+		catch (expr::GeneratorException &)
+		{
+			if (!ss.str().empty())
+			{
+				std::cerr << "rejected integer OpenCL kernel left partial output for " << math[i] << std::endl;
+			}
+		}
+	}
+}
+
+
+void randomExpressions()
+{
+	expr::RandomExpression::Options options;
+	options.depth = 5;
+	options.width = 3;
+	expr::RandomExpression first(42, options);
+	expr::RandomExpression second(42, options);
+
+	expr::Parser<float> parser;
+	VariableMap vm;
+	vm["x0"] = 1.5f;
+	vm["x1"] = 2;
+	vm["x2"] = 0.25f;
+	for (int i=0; i<100; i++)
+	{
+		std::string expression = first.generate();
+		if (expression != second.generate())
+		{
+			std::cerr << "random expressions from the same seed differ" << std::endl;
+			return;
+		}
+		try
+		{
+			Evaluator(parser.parse(expression), &vm).evaluate();
+		}
+		catch (expr::Exception &e)
+		{
+			std::cerr << "random expression '" << expression << "' failed: " << e.what() << std::endl;
+			return;
+		}
+	}
+}
+
+
+struct DeepExpression
+{
+	expr::ASTNodePtr ast;
+	expr::BranchProfile profile;
+	float result;
+	float cloned;
+};
+
+// Evaluates, clones and destroys the expression, all on a small stack
+void *deepExpression(void *data)
+{
+	DeepExpression *deep = (DeepExpression *) data;
+	VariableMap vm;
+	vm["x"] = 1;
+
+	expr::Evaluator<float> evaluator(deep->ast, &vm);
+	evaluator.setProfile(&deep->profile);
+	deep->result = evaluator.evaluate();
+
+	expr::ASTNodePtr copy = deep->ast->clone();
+	deep->ast = expr::ASTNodePtr();
+	deep->cloned = expr::Evaluator<float>(copy, &vm).evaluate();
+	return NULL;
+}
+
+void deepExpressions()
+{
+	// Nested 20000 deep, each level adds one or passes its operand through
+	const int depth = 20000;
+	const char *prefixes[] = { "(", "max(", "(x > 0 ? ", "floor(" };
+	const char *suffixes[] = { " + 1)", ", 0)", " : 0)", ")" };
+	std::string text;
+	for (int i=depth - 1; i>=0; i--)
+	{
+		text += prefixes[i % 4];
+	}
+	text += "x";
+	for (int i=0; i<depth; i++)
+	{
+		text += suffixes[i % 4];
+	}
+
+	DeepExpression deep;
+	deep.result = deep.cloned = 0;
+	{
+		expr::Parser<float> parser;
+		deep.ast = parser.parse(text);
+	}
+
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setstacksize(&attributes, 64 * 1024);
+	pthread_t thread;
+	if (pthread_create(&thread, &attributes, &deepExpression, &deep) != 0)
+	{
+		std::cerr << "could not start a thread for deep expressions" << std::endl;
+		pthread_attr_destroy(&attributes);
+		return;
+	}
+	pthread_join(thread, NULL);
+	pthread_attr_destroy(&attributes);
+
+	float expected = 1 + depth / 4;
+	if (deep.result != expected || deep.cloned != expected)
+	{
+		std::cerr << "deep expression evaluated to " << deep.result << " and " << deep.cloned << " when cloned, expected " << expected << std::endl;
+	}
+	if (deep.profile.empty())
+	{
+		std::cerr << "deep expression did not profile its branches" << std::endl;
+	}
+}
+
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+template <typename T>
+bool x86Matches(const char *expression, T xValue, T yValue)
+{
+	expr::Parser<T> parser;
+	typename expr::Evaluator<T>::VariableMap vm;
+	vm["x"] = xValue;
+	vm["y"] = yValue;
+	vm["pi"] = pi;
+
+	expr::ASTNodePtr ast = parser.parse(expression);
+	T expected = expr::Evaluator<T>(ast, &vm).evaluate();
+	T result = expr::X86Evaluator<T>(ast, &vm).evaluate();
+
+	// NaN should come out of both, as should the same infinity
+	if (expected != expected || result != result)
+	{
+		return expected != expected && result != result;
+	}
+	return result == expected || fabs(result - expected) <= fabs(expected) * 1e-5;
+}
+
+
+void x86Backend()
+{
+	const char *expressions[] = {
+		"(y + x)",
+		"2 * (y + x)",
+		"(y + x / y) * (x - y / x)",
+		"x / ((x + y) * (x - y)) / y",
+		"1 - ((x * y) + (y / x)) - 3",
+		"sin(2 * x) + cos(pi / y)",
+		"sqrt(1 - sin(2 * x) + cos(pi / y) / 3)",
+		"(x^2 / sin(2 * pi / y)) -x / 2",
+		"x + (cos(y - sin(2 / x * pi)) - sin(x - cos(2 * y / pi))) - y",
+		"min(4,8) < max(4,8) && 10 % 4 == 2 ? (ceil(cos(60*pi/180) + sin(30*pi/180) + tan(45*pi/180)) + sqrt(floor(16.5)) + log2(16)) * log10(100) : 0",
+		"min(x, y) + max(x, y) * pow(y, 2) - x % y",
+		"x >= y || x == 0 ? (x != y && y <= 1) - tan(x) : (x < y) + (x > y)"
+	};
+	const size_t count = sizeof(expressions) / sizeof(expressions[0]);
+
+	for (size_t i=0; i<count; i++)
+	{
+		for (float xValue=-10; xValue<10; xValue+=0.7f)
+		{
+			for (float yValue=-10; yValue<10; yValue+=0.7f)
+			{
+				if (!x86Matches<float>(expressions[i], xValue, yValue) || !x86Matches<double>(expressions[i], xValue, yValue))
+				{
+					std::cerr << "x86 code for \"" << expressions[i] << "\" disagrees with the interpreter where x = " << xValue << " and y = " << yValue << std::endl;
+					xValue = yValue = 10;
+				}
+			}
+		}
+	}
+
+	// min and max pick the same operand as std::min and std::max for signed zeros and NaN
+	float nan = std::numeric_limits<float>::quiet_NaN();
+	if (!x86Matches<float>("min(x, y) + 1 / max(x, y)", 0.0f, -0.0f) || !x86Matches<float>("1 / min(x, y)", -0.0f, 0.0f) ||
+		!x86Matches<float>("max(x, y)", nan, 1.0f) || !x86Matches<float>("min(x, y)", 1.0f, nan) || !x86Matches<float>("x ? 1 : 2", nan, 0.0f))
+	{
+		std::cerr << "x86 code disagrees with the interpreter on signed zero or NaN" << std::endl;
+	}
+}
+#endif
+
+
+#ifdef USE_LLVM
+void sharedSession()
+{
+	expr::Parser<float> parser;
+	VariableMap vm;
+	vm["x"] = 3;
+	vm["y"] = 4;
+
+	expr::LLVMSession session;
+	Evaluator *first = new Evaluator(parser.parse("x * y"), &vm, session);
+	Evaluator second(parser.parse("x + y"), &vm, session);
+
+	// Releasing one expression must leave the rest of the session intact
+	float product = first->evaluate();
+	delete first;
+	Evaluator third(parser.parse("x - y"), &vm, session);
+
+	if (product != 12.0f || second.evaluate() != 7.0f || third.evaluate() != -1.0f)
+	{
+		std::cerr << "expressions sharing an LLVM session did not evaluate correctly" << std::endl;
+	}
+}
+
+
+void llvmOptions()
+{
+	expr::Parser<float> parser;
+	VariableMap vm;
+	vm["x"] = 0.5f;
+	vm["y"] = 2;
+	expr::ASTNodePtr ast = parser.parse("(x + y) * (x + y) - sqrt(y) / x");
+
+	expr::LLVMOptions none;
+	none.level = expr::LLVMOptions::NONE;
+	expr::LLVMOptions native;
+	native.fastMath = true;
+	native.nativeCPU = true;
+
+	Evaluator unoptimised(ast, &vm, none);
+	Evaluator optimised(ast, &vm, native);
+	if (fabs(unoptimised.evaluate() - optimised.evaluate()) > 1e-4f)
+	{
+		std::cerr << "optimised and unoptimised LLVM code disagree" << std::endl;
+	}
+}
+
+
+void slotArguments()
+{
+	expr::Parser<float> parser;
+	VariableMap vm;
+	vm["y"] = 3;
+
+	// Variables only have to exist by the time the expression is evaluated
+	Evaluator eval(parser.parse("x * 10 + y"), &vm);
+	try
+	{
+		eval.evaluate();
+		std::cerr << "evaluating an undefined variable did not fail" << std::endl;
+	}
+	catch (expr::EvaluatorException &)
+	{
+	}
+	vm["x"] = 2;
+	if (eval.evaluate() != 23.0f)
+	{
+		std::cerr << "expression did not evaluate correctly once its variable was defined" << std::endl;
+	}
+
+	// The compiled function isn't tied to the map
+	float slots[2];
+	slots[eval.variables()[0] == "x" ? 0 : 1] = 4;
+	slots[eval.variables()[0] == "x" ? 1 : 0] = 5;
+	if (eval.function()(slots) != 45.0f)
+	{
+		std::cerr << "compiled function did not evaluate the given slots correctly" << std::endl;
+	}
+}
+
+
+void batchKernel()
+{
+	expr::Parser<float> parser;
+	VariableMap vm;
+	vm["x"] = 0;
+	vm["y"] = 0;
+
+	Evaluator eval(parser.parse("x > y ? x * y : x - y"), &vm);
+	Evaluator::Kernel kernel = eval.kernel();
+
+	const size_t rows = 1000;
+	std::vector<float> xs(rows), ys(rows), out(rows);
+	for (size_t i=0; i<rows; i++)
+	{
+		xs[i] = i * 0.5f;
+		ys[i] = 100.0f - i;
+	}
+	std::vector<const float *> inputs;
+	for (size_t i=0; i<eval.variables().size(); i++)
+	{
+		inputs.push_back(eval.variables()[i] == "x" ? &xs[0] : &ys[0]);
+	}
+	kernel(&inputs[0], &out[0], rows);
+
+	for (size_t i=0; i<rows; i++)
+	{
+		float expected = xs[i] > ys[i] ? xs[i] * ys[i] : xs[i] - ys[i];
+		if (out[i] != expected)
+		{
+			std::cerr << "batch kernel row " << i << " did not evaluate correctly" << std::endl;
+			break;
+		}
+	}
+
+	// Kernels select between both arms, however costly, and the arm not taken
+	// mustn't trap on an integer division by zero
+	expr::Parser<int> ip;
+	expr::LLVMEvaluator<int>::VariableMap ivm;
+	ivm["x"] = 0;
+	ivm["y"] = 0;
+	expr::LLVMEvaluator<int> integer(ip.parse("x != 0 ? 1000 / x * 7 + 100 % x - x * x * x + 1000 / x : y"), &ivm);
+	std::vector<int> ixs(rows), iys(rows), iout(rows);
+	for (size_t i=0; i<rows; i++)
+	{
+		ixs[i] = (int) (i % 7) - 3;
+		iys[i] = (int) i;
+	}
+	std::vector<const int *> iinputs;
+	for (size_t i=0; i<integer.variables().size(); i++)
+	{
+		iinputs.push_back(integer.variables()[i] == "x" ? &ixs[0] : &iys[0]);
+	}
+	integer.kernel()(&iinputs[0], &iout[0], rows);
+
+	for (size_t i=0; i<rows; i++)
+	{
+		int x = ixs[i];
+		int expected = x != 0 ? 1000 / x * 7 + 100 % x - x * x * x + 1000 / x : iys[i];
+		if (iout[i] != expected)
+		{
+			std::cerr << "integer batch kernel row " << i << " did not evaluate correctly" << std::endl;
+			break;
+		}
+	}
+}
+
+
+void compactMode()
+{
+	expr::Parser<float> parser;
+	VariableMap vm;
+	vm["x"] = 3;
+	vm["y"] = 4;
+	expr::ASTNodePtr ast = parser.parse("x > y ? x * y : sqrt(x + y)");
+
+	expr::LLVMOptions options;
+	options.compact = true;
+	Evaluator full(ast, &vm);
+	Evaluator compact(ast, &vm, options);
+
+	// The kernel is generated after the IR of the function was dropped
+	float x = 5, y = 2, out = 0;
+	const float *inputs[2] = { compact.variables()[0] == "x" ? &x : &y, compact.variables()[0] == "x" ? &y : &x };
+	compact.kernel()(inputs, &out, 1);
+
+	Evaluator::MemoryFootprint before = full.memoryFootprint();
+	Evaluator::MemoryFootprint after = compact.memoryFootprint();
+	if (compact.evaluate() != full.evaluate() || out != 10.0f)
+	{
+		std::cerr << "compacted LLVM expression did not evaluate correctly" << std::endl;
+	}
+	if (before.code == 0 || after.code == 0 || before.instructions == 0 || after.instructions != 0)
+	{
+		std::cerr << "memory footprint does not reflect the compacted IR" << std::endl;
+	}
+}
+
+
+void llvmTypes()
+{
+	expr::Parser<double> doubleParser;
+	expr::LLVMEvaluator<double>::VariableMap dvm;
+	dvm["x"] = 1e300;
+	expr::LLVMEvaluator<double> d(doubleParser.parse("x * 10 / 3 + sqrt(2)"), &dvm);
+	if (fabs(d.evaluate() / (1e301 / 3 + sqrt(2.0)) - 1) > 1e-12)
+	{
+		std::cerr << "double precision LLVM expression did not evaluate correctly" << std::endl;
+	}
+
+	expr::Parser<int> intParser;
+	expr::LLVMEvaluator<int>::VariableMap ivm;
+	ivm["x"] = 17;
+	ivm["y"] = 5;
+	expr::LLVMEvaluator<int> i(intParser.parse("x / y * 100 + x % y + sqrt(x) + (x > y)"), &ivm);
+	if (i.evaluate() != 3 * 100 + 2 + 4 + 1)
+	{
+		std::cerr << "integer LLVM expression did not evaluate correctly" << std::endl;
+	}
+
+	// Cheap arms are selected between, but a division in the arm not taken mustn't trap
+	ivm["x"] = 0;
+	expr::LLVMEvaluator<int> guarded(intParser.parse("x != 0 ? 100 / x : 0"), &ivm);
+	expr::LLVMEvaluator<int> shortCircuit(intParser.parse("x != 0 && 100 % x > 1"), &ivm);
+	if (guarded.evaluate() != 0 || shortCircuit.evaluate() != 0)
+	{
+		std::cerr << "integer LLVM division in an arm not taken did not evaluate correctly" << std::endl;
+	}
+	ivm["x"] = 7;
+	if (guarded.evaluate() != 14 || shortCircuit.evaluate() != 1)
+	{
+		std::cerr << "integer LLVM division in an arm taken did not evaluate correctly" << std::endl;
+	}
+}
+
+
+void asyncCompile()
+{
+	expr::Parser<float> parser;
+	VariableMap vm;
+	vm["x"] = 2;
+
+	expr::LLVMCompiler<float> compiler(4);
+	std::vector<expr::LLVMCompiler<float>::TaskPtr> tasks;
+	for (int i=0; i<100; i++)
+	{
+		std::ostringstream ss;
+		ss << "x * " << i;
+		tasks.push_back(compiler.compile(parser.parse(ss.str()), &vm));
+	}
+	expr::LLVMCompiler<float>::TaskPtr failing = compiler.compile(expr::ASTNodePtr(), &vm);
+
+	for (int i=0; i<100; i++)
+	{
+		if (tasks[i]->wait()->evaluate() != 2.0f * i)
+		{
+			std::cerr << "asynchronously compiled expression did not evaluate correctly" << std::endl;
+		}
+	}
+
+	try
+	{
+		failing->wait();
+		std::cerr << "compiling without a syntax tree did not fail" << std::endl;
+	}
+	catch (expr::EvaluatorException &)
+	{
+	}
+	tasks.clear();
+
+	// Compiled code keeps its session alive once the compiler is gone
+	expr::LLVMCompiler<float>::TaskPtr kept;
+	expr::LLVMEvaluator<float> *released = NULL;
+	{
+		expr::LLVMCompiler<float> temporary(1);
+		kept = temporary.compile(parser.parse("x + 1"), &vm);
+		released = temporary.compile(parser.parse("x + 2"), &vm)->release();
+		kept->wait();
+	}
+	if (kept->wait()->evaluate() != 3.0f || released->evaluate() != 4.0f)
+	{
+		std::cerr << "compiled expressions did not outlive their compiler" << std::endl;
+	}
+	delete released;
+	kept = expr::LLVMCompiler<float>::TaskPtr();
+}
+
+
+void tieredEvaluation()
+{
+	expr::Parser<float> parser;
+	VariableMap vm;
+	vm["x"] = 3;
+
+	expr::LLVMCompiler<float> compiler(1);
+	expr::TieredEvaluator<float> tiered(parser.parse("x * x + 1"), &vm, compiler, 10);
+
+	// Keep evaluating until the compiled code takes over, which happens after
+	// the tenth call once the background compilation finishes
+	for (int i=0; i<10000 && !tiered.compiled(); i++)
+	{
+		if (tiered.evaluate() != 10.0f)
+		{
+			std::cerr << "interpreted tiered expression did not evaluate correctly" << std::endl;
+			return;
+		}
+		if (i >= 10)
+		{
+			usleep(1000);
+		}
+	}
+
+	if (!tiered.compiled() || tiered.interpreted() < 10)
+	{
+		std::cerr << "tiered expression was not compiled after its threshold" << std::endl;
+	}
+	vm["x"] = 4;
+	if (tiered.evaluate() != 17.0f)
+	{
+		std::cerr << "compiled tiered expression did not evaluate correctly" << std::endl;
+	}
+}
+#endif
+
+
 void test()
 {
 	unsigned int count = 0;
@@ -165,6 +1197,35 @@ void test()
 	syntaxErrors("1-*2"); count++;
 
 	clone(); count++;
+	parserContext(); count++;
+	lengthDelimited(); count++;
+	numberParsing(); count++;
+	incrementalParse(); count++;
+	statusErrors(); count++;
+	bulkParse(); count++;
+	branchProfile(); count++;
+	shaderFunction(); count++;
+	shaderStream(); count++;
+	shaderCache(); count++;
+	shaderModule(); count++;
+	cSource(); count++;
+	compiledSources(); count++;
+	openclKernel(); count++;
+	randomExpressions(); count++;
+	deepExpressions(); count++;
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+	x86Backend(); count++;
+#endif
+#ifdef USE_LLVM
+	sharedSession(); count++;
+	llvmOptions(); count++;
+	slotArguments(); count++;
+	batchKernel(); count++;
+	compactMode(); count++;
+	llvmTypes(); count++;
+	asyncCompile(); count++;
+	tieredEvaluation(); count++;
+#endif
 
 	std::cout << "Ran " << count << " tests successfully" << std::endl;;
 }